@@ -0,0 +1,222 @@
+/*
+ * This file is part of the stfuboot project.
+ *
+ * Copyright (C) 2012 Innovative Converged Devices (ICD)
+ *
+ * Author(s):
+ *          Andrey Smirnov <andrey.smirnov@convergeddevices.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * AES-128 encryption and CTR mode.
+ *
+ * Only the forward cipher is needed for CTR, so there is no inverse
+ * table. A single 1K T-table is used for all four byte positions: the
+ * other three are rotations of it, and on Cortex-M3 the rotation is
+ * folded into the EOR by the barrel shifter for free. Both the table
+ * and the S-box are generated at runtime so they end up in RAM (no
+ * flash wait states) and do not take space in the bootloader ROM.
+ *
+ * The file is also compiled for the host so the tools and the
+ * benchmark exercise exactly the same code.
+ */
+
+#include <stdbool.h>
+#include <string.h>
+
+#include "aes.h"
+
+static uint8_t  aes_sbox[256];
+static uint32_t aes_te[256];
+static bool aes_tables_ready;
+
+#define ROTL8(x)	(((x) << 8)  | ((x) >> 24))
+#define ROTL16(x)	(((x) << 16) | ((x) >> 16))
+#define ROTL24(x)	(((x) << 24) | ((x) >> 8))
+
+#define BYTE(x, n)	(((x) >> (8 * (n))) & 0xFF)
+
+static inline uint8_t aes_xtime(uint8_t x)
+{
+	return (x << 1) ^ ((x & 0x80) ? 0x1B : 0x00);
+}
+
+static inline uint8_t aes_rotl8(uint8_t x, int n)
+{
+	return (x << n) | (x >> (8 - n));
+}
+
+static void aes_init_tables(void)
+{
+	uint8_t p = 1, q = 1, s;
+	int i;
+
+	/*
+	 * Walk the multiplicative group with generator 3: p runs over
+	 * 3^i and q over its inverse 3^-i, which gives the S-box
+	 * without a separate inversion routine.
+	 */
+	do {
+		p = p ^ aes_xtime(p);
+
+		q ^= q << 1;
+		q ^= q << 2;
+		q ^= q << 4;
+		if (q & 0x80)
+			q ^= 0x09;
+
+		aes_sbox[p] = 0x63 ^ q ^ aes_rotl8(q, 1) ^ aes_rotl8(q, 2) ^
+			      aes_rotl8(q, 3) ^ aes_rotl8(q, 4);
+	} while (p != 1);
+
+	aes_sbox[0] = 0x63;
+
+	/* Column (2s, s, s, 3s) stored little-endian, row 0 in the LSB */
+	for (i = 0; i < 256; i++) {
+		s = aes_sbox[i];
+		aes_te[i] = (uint32_t)aes_xtime(s) |
+			    (uint32_t)s << 8 |
+			    (uint32_t)s << 16 |
+			    (uint32_t)(aes_xtime(s) ^ s) << 24;
+	}
+
+	aes_tables_ready = true;
+}
+
+static inline uint32_t load_le32(const uint8_t *p)
+{
+	return (uint32_t)p[0] | (uint32_t)p[1] << 8 |
+	       (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline void store_le32(uint8_t *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static inline uint32_t aes_sub_word(uint32_t w)
+{
+	return (uint32_t)aes_sbox[BYTE(w, 0)] |
+	       (uint32_t)aes_sbox[BYTE(w, 1)] << 8 |
+	       (uint32_t)aes_sbox[BYTE(w, 2)] << 16 |
+	       (uint32_t)aes_sbox[BYTE(w, 3)] << 24;
+}
+
+void stfub_aes_set_key(struct stfub_aes_ctx *ctx, const uint8_t *key)
+{
+	uint32_t *rk = ctx->rk;
+	uint8_t rcon = 0x01;
+	int i;
+
+	if (!aes_tables_ready)
+		aes_init_tables();
+
+	for (i = 0; i < 4; i++)
+		rk[i] = load_le32(key + 4 * i);
+
+	for (i = 4; i < 44; i++) {
+		uint32_t t = rk[i - 1];
+
+		if (i % 4 == 0) {
+			t = aes_sub_word(ROTL24(t)) ^ rcon;
+			rcon = aes_xtime(rcon);
+		}
+
+		rk[i] = rk[i - 4] ^ t;
+	}
+}
+
+#define AES_ROUND(d0, d1, d2, d3, s0, s1, s2, s3, k)			\
+	do {								\
+		d0 = aes_te[BYTE(s0, 0)] ^ ROTL8(aes_te[BYTE(s1, 1)]) ^	\
+		     ROTL16(aes_te[BYTE(s2, 2)]) ^			\
+		     ROTL24(aes_te[BYTE(s3, 3)]) ^ (k)[0];		\
+		d1 = aes_te[BYTE(s1, 0)] ^ ROTL8(aes_te[BYTE(s2, 1)]) ^	\
+		     ROTL16(aes_te[BYTE(s3, 2)]) ^			\
+		     ROTL24(aes_te[BYTE(s0, 3)]) ^ (k)[1];		\
+		d2 = aes_te[BYTE(s2, 0)] ^ ROTL8(aes_te[BYTE(s3, 1)]) ^	\
+		     ROTL16(aes_te[BYTE(s0, 2)]) ^			\
+		     ROTL24(aes_te[BYTE(s1, 3)]) ^ (k)[2];		\
+		d3 = aes_te[BYTE(s3, 0)] ^ ROTL8(aes_te[BYTE(s0, 1)]) ^	\
+		     ROTL16(aes_te[BYTE(s1, 2)]) ^			\
+		     ROTL24(aes_te[BYTE(s2, 3)]) ^ (k)[3];		\
+	} while (0)
+
+#define AES_FINAL(s0, s1, s2, s3)					\
+	((uint32_t)aes_sbox[BYTE(s0, 0)] |				\
+	 (uint32_t)aes_sbox[BYTE(s1, 1)] << 8 |				\
+	 (uint32_t)aes_sbox[BYTE(s2, 2)] << 16 |			\
+	 (uint32_t)aes_sbox[BYTE(s3, 3)] << 24)
+
+void stfub_aes_encrypt_block(const struct stfub_aes_ctx *ctx,
+			     const uint8_t *in, uint8_t *out)
+{
+	const uint32_t *rk = ctx->rk;
+	uint32_t s0, s1, s2, s3, t0, t1, t2, t3;
+	int round;
+
+	s0 = load_le32(in)      ^ rk[0];
+	s1 = load_le32(in + 4)  ^ rk[1];
+	s2 = load_le32(in + 8)  ^ rk[2];
+	s3 = load_le32(in + 12) ^ rk[3];
+
+	for (round = 1; round < 9; round += 2) {
+		AES_ROUND(t0, t1, t2, t3, s0, s1, s2, s3, rk + 4 * round);
+		AES_ROUND(s0, s1, s2, s3, t0, t1, t2, t3, rk + 4 * round + 4);
+	}
+	AES_ROUND(t0, t1, t2, t3, s0, s1, s2, s3, rk + 36);
+
+	store_le32(out,      AES_FINAL(t0, t1, t2, t3) ^ rk[40]);
+	store_le32(out + 4,  AES_FINAL(t1, t2, t3, t0) ^ rk[41]);
+	store_le32(out + 8,  AES_FINAL(t2, t3, t0, t1) ^ rk[42]);
+	store_le32(out + 12, AES_FINAL(t3, t0, t1, t2) ^ rk[43]);
+}
+
+/*
+ * The counter block is the 96-bit nonce followed by the big-endian
+ * index of the 16 byte block within the image, so any part of the
+ * image can be processed independently of the rest.
+ */
+void stfub_aes_ctr_crypt(const struct stfub_aes_ctx *ctx,
+			 const uint8_t *nonce, uint32_t offset,
+			 uint8_t *buf, size_t len)
+{
+	uint8_t counter[STFUB_AES_BLOCK_SIZE];
+	uint8_t stream[STFUB_AES_BLOCK_SIZE];
+	uint32_t block = offset / STFUB_AES_BLOCK_SIZE;
+	unsigned int skip = offset % STFUB_AES_BLOCK_SIZE;
+	unsigned int i;
+
+	memcpy(counter, nonce, STFUB_AES_NONCE_SIZE);
+
+	while (len) {
+		counter[12] = block >> 24;
+		counter[13] = block >> 16;
+		counter[14] = block >> 8;
+		counter[15] = block;
+
+		stfub_aes_encrypt_block(ctx, counter, stream);
+
+		for (i = skip; i < STFUB_AES_BLOCK_SIZE && len; i++, len--)
+			*buf++ ^= stream[i];
+
+		skip = 0;
+		block++;
+	}
+}
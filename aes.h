@@ -0,0 +1,44 @@
+/*
+ * This file is part of the stfuboot project.
+ *
+ * Copyright (C) 2012 Innovative Converged Devices (ICD)
+ *
+ * Author(s):
+ *          Andrey Smirnov <andrey.smirnov@convergeddevices.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __AES_H__
+#define __AES_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define STFUB_AES_BLOCK_SIZE	16
+#define STFUB_AES_KEY_SIZE	16
+#define STFUB_AES_NONCE_SIZE	12
+
+struct stfub_aes_ctx {
+	uint32_t rk[44];
+};
+
+void stfub_aes_set_key(struct stfub_aes_ctx *ctx, const uint8_t *key);
+void stfub_aes_encrypt_block(const struct stfub_aes_ctx *ctx,
+			     const uint8_t *in, uint8_t *out);
+void stfub_aes_ctr_crypt(const struct stfub_aes_ctx *ctx,
+			 const uint8_t *nonce, uint32_t offset,
+			 uint8_t *buf, size_t len);
+
+#endif	/* __AES_H__ */
@@ -0,0 +1,290 @@
+/*
+ * This file is part of the stfuboot project.
+ *
+ * Copyright (C) 2012 Innovative Converged Devices (ICD)
+ *
+ * Author(s):
+ *          Andrey Smirnov <andrey.smirnov@convergeddevices.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Bulk transfer mode, see include/libstfub/bulk_protocol.h for the
+ * protocol itself.
+ *
+ * Data is received into two block buffers in turn. A block is handed to
+ * the flash code from stfub_bulk_tick() as soon as it is complete. USB
+ * is polled from the same loop, so while a block is being programmed
+ * the endpoint holds at most one packet of the next one and NAKs the
+ * rest; what the second buffer saves is the round trip between blocks,
+ * not the transfer time. Should both buffers ever be full the OUT
+ * endpoint is NAKed until one of them has been written.
+ */
+
+#include <stdbool.h>
+#include <string.h>
+
+#include <libopencm3/usb/usbd.h>
+
+#include <libstfub/bulk_protocol.h>
+
+#include "bulk.h"
+#include "dfu.h"
+
+#define MIN(a, b) ((a)<(b) ? (a) : (b))
+
+#define STFUB_BULK_BUFFERS	2
+#define STFUB_BULK_REPLIES	4
+
+enum stfub_bulk_state {
+	STFUB_BULK_IDLE,
+	STFUB_BULK_RECEIVING,
+	STFUB_BULK_MANIFEST,
+	STFUB_BULK_FAILED,
+};
+
+struct stfub_bulk_buffer {
+	u8   data[STFUB_BULK_BLOCK_SIZE];
+	int  len;
+	bool full;
+};
+
+struct stfub_bulk {
+	usbd_device *usbddev;
+	enum stfub_bulk_state state;
+
+	u32  left;		/* bytes of the stream not received yet */
+	u32  blocks;		/* blocks committed to flash */
+	bool nak;
+
+	int  fill, drain;
+	struct stfub_bulk_buffer buffer[STFUB_BULK_BUFFERS];
+
+	/* Replies wait here for the IN endpoint, oldest first */
+	int  head, queued;
+	struct stfub_bulk_reply reply[STFUB_BULK_REPLIES];
+};
+
+static struct stfub_bulk bulk;
+
+/*
+   Queue a reply carrying the state as it is now. Every reply is sent,
+   in order, save for an ACK following one that has not gone out yet:
+   acknowledgements are cumulative, so the newer one takes its place.
+   That leaves at most READY, ACK and DONE of a session and the READY
+   of the next one queued at any time.
+ */
+static void stfub_bulk_reply(u8 type, u8 status)
+{
+	struct stfub_bulk_reply *reply;
+	int last = (bulk.head + bulk.queued - 1) % STFUB_BULK_REPLIES;
+
+	if (bulk.queued && type == STFUB_BULK_ACK &&
+	    bulk.reply[last].type == STFUB_BULK_ACK) {
+		reply = &bulk.reply[last];
+	} else {
+		if (bulk.queued == STFUB_BULK_REPLIES)
+			return;
+
+		reply = &bulk.reply[(last + 1) % STFUB_BULK_REPLIES];
+		bulk.queued++;
+	}
+
+	reply->magic	  = STFUB_BULK_MAGIC;
+	reply->type	  = type;
+	reply->status	  = status;
+	reply->window	  = STFUB_BULK_BUFFERS;
+	reply->blocks	  = bulk.blocks;
+	reply->__reserved = 0;
+}
+
+static void stfub_bulk_send_reply(void)
+{
+	if (!bulk.queued)
+		return;
+
+	/* Zero means the previous reply is still in the FIFO */
+	if (usbd_ep_write_packet(bulk.usbddev, STFUB_BULK_EP_IN,
+				 &bulk.reply[bulk.head],
+				 sizeof(bulk.reply[bulk.head]))) {
+		bulk.head = (bulk.head + 1) % STFUB_BULK_REPLIES;
+		bulk.queued--;
+	}
+}
+
+static void stfub_bulk_set_nak(bool nak)
+{
+	if (bulk.nak != nak) {
+		usbd_ep_nak_set(bulk.usbddev, STFUB_BULK_EP_OUT, nak);
+		bulk.nak = nak;
+	}
+}
+
+static void stfub_bulk_fail(void)
+{
+	enum dfu_status status = stfub_dfu_stream_status();
+
+	if (status == DFU_STATUS_OK)
+		status = DFU_STATUS_ERR_UNKNOWN;
+
+	stfub_dfu_stream_abort();
+	stfub_bulk_reply(STFUB_BULK_DONE, status);
+
+	/* Whatever the host still has in flight is dropped */
+	bulk.state = STFUB_BULK_FAILED;
+	stfub_bulk_set_nak(false);
+}
+
+static void stfub_bulk_start(const struct stfub_bulk_request *req)
+{
+	if (req->magic != STFUB_BULK_MAGIC || req->opcode != STFUB_BULK_START)
+		return;
+
+	/* Leave DFU alone if it is busy, this is not our session */
+	if (stfub_dfu_stream_begin(req->altsetting) < 0) {
+		stfub_bulk_reply(STFUB_BULK_DONE, DFU_STATUS_ERR_UNKNOWN);
+		bulk.state = STFUB_BULK_FAILED;
+		return;
+	}
+
+	bulk.left   = req->length;
+	bulk.blocks = 0;
+	bulk.fill   = 0;
+	bulk.drain  = 0;
+	bulk.buffer[0].len  = bulk.buffer[1].len  = 0;
+	bulk.buffer[0].full = bulk.buffer[1].full = false;
+
+	bulk.state = STFUB_BULK_RECEIVING;
+	stfub_bulk_reply(STFUB_BULK_READY, DFU_STATUS_OK);
+}
+
+static void stfub_bulk_data_rx(usbd_device *usbddev, u8 ep)
+{
+	struct stfub_bulk_buffer *buf = &bulk.buffer[bulk.fill];
+	u8 packet[STFUB_BULK_PACKET_SIZE];
+	u16 len;
+
+	if (bulk.state != STFUB_BULK_RECEIVING) {
+		len = usbd_ep_read_packet(usbddev, ep, packet, sizeof(packet));
+
+		if (bulk.state == STFUB_BULK_IDLE &&
+		    len == sizeof(struct stfub_bulk_request))
+			stfub_bulk_start((const struct stfub_bulk_request *)packet);
+		return;
+	}
+
+	/* The host has ignored the window */
+	if (buf->full) {
+		usbd_ep_read_packet(usbddev, ep, packet, sizeof(packet));
+		stfub_bulk_fail();
+		return;
+	}
+
+	/*
+	   Blocks are a multiple of the packet size and the stream is
+	   sent back to back, so a packet never straddles two blocks.
+	 */
+	len = usbd_ep_read_packet(usbddev, ep, buf->data + buf->len,
+				  sizeof(buf->data) - buf->len);
+	len = MIN(len, bulk.left);
+
+	buf->len  += len;
+	bulk.left -= len;
+
+	if (buf->len == sizeof(buf->data) || !bulk.left) {
+		buf->full = true;
+		bulk.fill = (bulk.fill + 1) % STFUB_BULK_BUFFERS;
+
+		if (bulk.buffer[bulk.fill].full)
+			stfub_bulk_set_nak(true);
+	}
+}
+
+void stfub_bulk_tick(void)
+{
+	struct stfub_bulk_buffer *buf = &bulk.buffer[bulk.drain];
+	int ret;
+
+	switch (bulk.state) {
+	case STFUB_BULK_RECEIVING:
+		if (buf->full) {
+			if (stfub_dfu_stream_write(bulk.blocks, buf->data,
+						   buf->len) < 0) {
+				stfub_bulk_fail();
+				break;
+			}
+
+			buf->len  = 0;
+			buf->full = false;
+			bulk.drain = (bulk.drain + 1) % STFUB_BULK_BUFFERS;
+			bulk.blocks++;
+
+			stfub_bulk_set_nak(false);
+			stfub_bulk_reply(STFUB_BULK_ACK, DFU_STATUS_OK);
+		}
+
+		if (!bulk.left && !bulk.buffer[bulk.drain].full) {
+			if (stfub_dfu_stream_end() < 0) {
+				stfub_bulk_fail();
+				break;
+			}
+			bulk.state = STFUB_BULK_MANIFEST;
+		}
+		break;
+	case STFUB_BULK_MANIFEST:
+		ret = stfub_dfu_stream_poll();
+		if (ret < 0) {
+			stfub_bulk_fail();
+		} else if (ret > 0) {
+			bulk.state = STFUB_BULK_IDLE;
+			stfub_bulk_reply(STFUB_BULK_DONE, DFU_STATUS_OK);
+		}
+		break;
+	default:
+		break;
+	}
+
+	stfub_bulk_send_reply();
+}
+
+/*
+   Selecting the interface (again) drops whatever session is going on,
+   which is how the host recovers from an error.
+ */
+void stfub_bulk_reset(void)
+{
+	if (bulk.state == STFUB_BULK_RECEIVING)
+		stfub_dfu_stream_abort();
+
+	bulk.state  = STFUB_BULK_IDLE;
+	bulk.head   = 0;
+	bulk.queued = 0;
+
+	if (bulk.usbddev)
+		stfub_bulk_set_nak(false);
+}
+
+void stfub_bulk_set_config(usbd_device *usbddev)
+{
+	bulk.usbddev = usbddev;
+	bulk.nak     = false;
+
+	usbd_ep_setup(usbddev, STFUB_BULK_EP_OUT, USB_ENDPOINT_ATTR_BULK,
+		      STFUB_BULK_PACKET_SIZE, stfub_bulk_data_rx);
+	usbd_ep_setup(usbddev, STFUB_BULK_EP_IN, USB_ENDPOINT_ATTR_BULK,
+		      STFUB_BULK_PACKET_SIZE, NULL);
+
+	stfub_bulk_reset();
+}
@@ -0,0 +1,35 @@
+/*
+ * This file is part of the stfuboot project.
+ *
+ * Copyright (C) 2012 Innovative Converged Devices (ICD)
+ *
+ * Author(s):
+ *          Andrey Smirnov <andrey.smirnov@convergeddevices.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __BULK_H__
+#define __BULK_H__
+
+#include <libopencm3/usb/usbd.h>
+
+#define STFUB_BULK_EP_OUT	0x01
+#define STFUB_BULK_EP_IN	0x81
+
+void stfub_bulk_set_config(usbd_device *usbddev);
+void stfub_bulk_reset(void);
+void stfub_bulk_tick(void);
+
+#endif	/* __BULK_H__ */
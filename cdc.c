@@ -0,0 +1,157 @@
+/*
+ * This file is part of the stfuboot project.
+ *
+ * Copyright (C) 2012 Innovative Converged Devices (ICD)
+ *
+ * Author(s):
+ *          Andrey Smirnov <andrey.smirnov@convergeddevices.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * CDC-ACM log console, the USB counterpart of the UART in uart.c.
+ *
+ * Console output goes here instead of the UART for as long as a
+ * terminal on the host has the port open, which it signals by raising
+ * DTR. Characters are queued in a ring buffer and sent a packet at a
+ * time from stfub_cdc_tick(); whatever the host sends is read and
+ * dropped, the console is output only.
+ */
+
+#include <stdbool.h>
+#include <string.h>
+
+#include <libopencm3/usb/cdc.h>
+#include <libopencm3/usb/usbd.h>
+
+#include "cdc.h"
+#include "stats.h"
+
+#define MIN(a, b) ((a)<(b) ? (a) : (b))
+
+#define STFUB_CDC_PACKET_SIZE	64
+#define STFUB_CDC_BUFFER_SIZE	1024	/* a power of two */
+
+struct stfub_cdc {
+	usbd_device *usbddev;
+	bool dtr;
+
+	struct usb_cdc_line_coding line_coding;
+
+	/* Free running, wrapped when used as indices */
+	u32 head, tail;
+	char data[STFUB_CDC_BUFFER_SIZE];
+};
+
+static struct stfub_cdc cdc = {
+	/* Reported back to the host, the baud rate means nothing here */
+	.line_coding = {
+		.dwDTERate	= 115200,
+		.bCharFormat	= 0,
+		.bParityType	= 0,
+		.bDataBits	= 8,
+	},
+};
+
+bool stfub_cdc_connected(void)
+{
+	return cdc.usbddev && cdc.dtr;
+}
+
+static void stfub_cdc_push(char c)
+{
+	if (cdc.head - cdc.tail == STFUB_CDC_BUFFER_SIZE) {
+		stfub_stats.uart_drops++;
+		return;
+	}
+
+	cdc.data[cdc.head++ % STFUB_CDC_BUFFER_SIZE] = c;
+}
+
+void stfub_cdc_putchar(char c)
+{
+	if (c == '\n')
+		stfub_cdc_push('\r');
+
+	stfub_cdc_push(c);
+}
+
+void stfub_cdc_tick(void)
+{
+	u32 start, len;
+
+	if (!stfub_cdc_connected() || cdc.head == cdc.tail)
+		return;
+
+	/* Up to the end of the buffer, the rest goes with the next one */
+	start = cdc.tail % STFUB_CDC_BUFFER_SIZE;
+	len   = MIN(cdc.head - cdc.tail, STFUB_CDC_BUFFER_SIZE - start);
+	len   = MIN(len, STFUB_CDC_PACKET_SIZE);
+
+	/* Zero means the previous packet is still in the FIFO */
+	cdc.tail += usbd_ep_write_packet(cdc.usbddev, STFUB_CDC_EP_IN,
+					 cdc.data + start, len);
+}
+
+static void stfub_cdc_data_rx(usbd_device *usbddev, u8 ep)
+{
+	u8 packet[STFUB_CDC_PACKET_SIZE];
+
+	usbd_ep_read_packet(usbddev, ep, packet, sizeof(packet));
+}
+
+int stfub_cdc_handle_control_request(usbd_device *usbddev,
+				     struct usb_setup_data *req,
+				     u8 **buf, u16 *len,
+				     void (**complete)(usbd_device *usbddev,
+						       struct usb_setup_data *req))
+{
+	switch (req->bRequest) {
+	case USB_CDC_REQ_SET_CONTROL_LINE_STATE:
+		cdc.dtr = req->wValue & 1;
+		return USBD_REQ_HANDLED;
+	case USB_CDC_REQ_SET_LINE_CODING:
+		if (*len < sizeof(cdc.line_coding))
+			return USBD_REQ_NOTSUPP;
+
+		memcpy(&cdc.line_coding, *buf, sizeof(cdc.line_coding));
+		return USBD_REQ_HANDLED;
+	case USB_CDC_REQ_GET_LINE_CODING:
+		*buf = (u8 *)&cdc.line_coding;
+		*len = MIN(*len, sizeof(cdc.line_coding));
+		return USBD_REQ_HANDLED;
+	default:
+		return USBD_REQ_NOTSUPP;
+	}
+}
+
+/* A bus reset closes the port, output goes back to the UART */
+void stfub_cdc_reset(void)
+{
+	cdc.dtr = false;
+}
+
+void stfub_cdc_set_config(usbd_device *usbddev)
+{
+	cdc.usbddev = usbddev;
+	cdc.dtr	    = false;
+
+	usbd_ep_setup(usbddev, STFUB_CDC_EP_OUT, USB_ENDPOINT_ATTR_BULK,
+		      STFUB_CDC_PACKET_SIZE, stfub_cdc_data_rx);
+	usbd_ep_setup(usbddev, STFUB_CDC_EP_IN, USB_ENDPOINT_ATTR_BULK,
+		      STFUB_CDC_PACKET_SIZE, NULL);
+	usbd_ep_setup(usbddev, STFUB_CDC_EP_NOTIFY, USB_ENDPOINT_ATTR_INTERRUPT,
+		      16, NULL);
+}
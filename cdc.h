@@ -0,0 +1,45 @@
+/*
+ * This file is part of the stfuboot project.
+ *
+ * Copyright (C) 2012 Innovative Converged Devices (ICD)
+ *
+ * Author(s):
+ *          Andrey Smirnov <andrey.smirnov@convergeddevices.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __CDC_H__
+#define __CDC_H__
+
+#include <stdbool.h>
+
+#include <libopencm3/usb/usbd.h>
+
+#define STFUB_CDC_EP_OUT	0x02
+#define STFUB_CDC_EP_IN		0x82
+#define STFUB_CDC_EP_NOTIFY	0x83
+
+void stfub_cdc_set_config(usbd_device *usbddev);
+void stfub_cdc_reset(void);
+int stfub_cdc_handle_control_request(usbd_device *usbddev,
+				     struct usb_setup_data *req,
+				     u8 **buf, u16 *len,
+				     void (**complete)(usbd_device *usbddev,
+						       struct usb_setup_data *req));
+void stfub_cdc_tick(void);
+bool stfub_cdc_connected(void);
+void stfub_cdc_putchar(char c);
+
+#endif	/* __CDC_H__ */
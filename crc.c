@@ -0,0 +1,129 @@
+/*
+ * This file is part of the stfuboot project.
+ *
+ * Copyright (C) 2012 Innovative Converged Devices (ICD)
+ *
+ * Author(s):
+ *          Andrey Smirnov <andrey.smirnov@convergeddevices.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "crc.h"
+
+#define MIN(a, b) ((a)<(b) ? (a) : (b))
+
+#ifdef STFUB_HOST
+
+#include "stm32-crc.h"
+
+static uint32_t stfub_crc;
+
+void stfub_crc_continue(const void *data, uint32_t words)
+{
+	stfub_crc = stm32_crc_update(stfub_crc, data, words);
+}
+
+void stfub_crc_start(const void *data, uint32_t words)
+{
+	stfub_crc = STM32_CRC_INIT;
+	stfub_crc_continue(data, words);
+}
+
+bool stfub_crc_busy(void)
+{
+	return false;
+}
+
+uint32_t stfub_crc_result(void)
+{
+	return stfub_crc;
+}
+
+#else
+
+#include <libopencm3/stm32/crc.h>
+#include <libopencm3/stm32/f1/dma.h>
+#include <libopencm3/stm32/f1/rcc.h>
+
+#define STFUB_CRC_DMA		DMA1
+#define STFUB_CRC_DMA_CHANNEL	DMA_CHANNEL1
+
+/*
+   Memory to memory mode: the "memory" side is the incrementing source,
+   the "peripheral" side the fixed CRC_DR it is written to. Nothing is
+   kept in RAM, this also runs from the reset handler before .bss is
+   cleared.
+ */
+void stfub_crc_continue(const void *data, uint32_t words)
+{
+	DMA_CCR(STFUB_CRC_DMA, STFUB_CRC_DMA_CHANNEL) = 0;
+	DMA_IFCR(STFUB_CRC_DMA) = DMA_IFCR_CGIF1;
+
+	if (!words)
+		return;
+
+	DMA_CPAR(STFUB_CRC_DMA, STFUB_CRC_DMA_CHANNEL)	 = (u32)&CRC_DR;
+	DMA_CMAR(STFUB_CRC_DMA, STFUB_CRC_DMA_CHANNEL)	 = (u32)data;
+	DMA_CNDTR(STFUB_CRC_DMA, STFUB_CRC_DMA_CHANNEL) = words;
+	DMA_CCR(STFUB_CRC_DMA, STFUB_CRC_DMA_CHANNEL)	 =
+		DMA_CCR_MEM2MEM | DMA_CCR_PL_HIGH | DMA_CCR_MSIZE_32BIT |
+		DMA_CCR_PSIZE_32BIT | DMA_CCR_MINC | DMA_CCR_DIR | DMA_CCR_EN;
+}
+
+void stfub_crc_start(const void *data, uint32_t words)
+{
+	rcc_peripheral_enable_clock(&RCC_AHBENR,
+				    RCC_AHBENR_CRCEN | RCC_AHBENR_DMA1EN);
+	crc_reset();
+
+	stfub_crc_continue(data, words);
+}
+
+bool stfub_crc_busy(void)
+{
+	return (DMA_CCR(STFUB_CRC_DMA, STFUB_CRC_DMA_CHANNEL) & DMA_CCR_EN) &&
+		!(DMA_ISR(STFUB_CRC_DMA) & (DMA_ISR_TCIF1 | DMA_ISR_TEIF1));
+}
+
+uint32_t stfub_crc_result(void)
+{
+	return CRC_DR;
+}
+
+#endif
+
+/* Blocks of any length, waits for the result */
+uint32_t stfub_crc_block(const void *data, uint32_t words)
+{
+	const uint32_t *p = data;
+	uint32_t n = MIN(words, STFUB_CRC_DMA_MAX_WORDS);
+
+	stfub_crc_start(p, n);
+
+	for (;;) {
+		while (stfub_crc_busy())
+			;
+
+		p     += n;
+		words -= n;
+		if (!words)
+			break;
+
+		n = MIN(words, STFUB_CRC_DMA_MAX_WORDS);
+		stfub_crc_continue(p, n);
+	}
+
+	return stfub_crc_result();
+}
@@ -0,0 +1,48 @@
+/*
+ * This file is part of the stfuboot project.
+ *
+ * Copyright (C) 2012 Innovative Converged Devices (ICD)
+ *
+ * Author(s):
+ *          Andrey Smirnov <andrey.smirnov@convergeddevices.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __CRC_H__
+#define __CRC_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+   CRC engine: the STM32 CRC unit fed from memory by DMA1 channel 1, so
+   a block is checked at bus speed and, started in the background, while
+   the CPU does something else. There is only one CRC unit; a background
+   calculation owns it until stfub_crc_busy() returns false.
+
+   The host build (STFUB_HOST) runs the same API on the software model
+   in tools/stm32-crc.c.
+ */
+
+/* CNDTR is 16 bits wide, longer blocks go in several transfers */
+#define STFUB_CRC_DMA_MAX_WORDS	0x8000
+
+uint32_t stfub_crc_block(const void *data, uint32_t words);
+void stfub_crc_start(const void *data, uint32_t words);
+void stfub_crc_continue(const void *data, uint32_t words);
+bool stfub_crc_busy(void);
+uint32_t stfub_crc_result(void);
+
+#endif	/* __CRC_H__ */
@@ -24,30 +24,134 @@
 #include <string.h>
 #include <stdbool.h>
 
+#include <libopencm3/cm3/scb.h>
 #include <libopencm3/stm32/f1/flash.h>
 #include <libopencm3/usb/usbd.h>
 
+#include <libstfub/fault.h>
+#include <libstfub/info_block.h>
+
+#include "aes.h"
+#include "crc.h"
 #include "dfu.h"
+#include "ed25519.h"
+#include "keys.h"
+#include "dwt.h"
+#include "erase.h"
+#include "geometry.h"
+#include "rle.h"
+#include "sha256.h"
+#include "stats.h"
+#include "timebase.h"
+#include "trace.h"
+#include "verify.h"
+#include "wear.h"
 
 #define MIN(a, b) ((a)<(b) ? (a) : (b))
+#define MAX(a, b) ((a)>(b) ? (a) : (b))
+
+/*
+   Rough timings used to estimate how much of the manifestation is left
+   for bwPollTimeout. They err on the slow side, a host polling too
+   early only gets told to wait some more.
+ */
+#define STFUB_DFU_MANIFEST_PAGE_MS		40
+#define STFUB_DFU_MANIFEST_CRC_WORDS_PER_MS	2048
+#define STFUB_DFU_MANIFEST_INFO_BLOCK_MS	20
+
+#ifdef STFUB_CRYPTO
+/*
+   The signature is verified a few rounds per tick, so USB is served in
+   between. A round is timed with the DWT every time, the estimate below
+   is only used until the first one has been.
+ */
+#define STFUB_DFU_SIGNATURE_ROUNDS_PER_TICK	4
+#define STFUB_DFU_SIGNATURE_ROUND_CYCLES	(2 * STFUB_DWT_CYCLES_PER_MS)
+#endif
+
+enum stfub_manifest_step {
+	STFUB_MANIFEST_FLUSH,
+	STFUB_MANIFEST_CHECK_CRC,
+	STFUB_MANIFEST_CHECK_SIGNATURE,
+	STFUB_MANIFEST_WRITE_INFO_BLOCK,
+	STFUB_MANIFEST_DONE,
+};
 
 struct stfub_memory_bank {
 	u32 start, end;
+	/* Virtual, read-only banks have no fixed address, this returns
+	 * their contents at the start of each upload */
+	const void *(*snapshot)(u32 *size);
+	/* Virtual banks that answer a question take it as a download */
+	enum dfu_status (*query)(const void *buf, u32 len);
+	u32 (*query_ms)(const void *buf, u32 len);
+	/* Uploads are run-length encoded, see libstfub/rle.h */
+	bool compressed;
 };
 
-static const struct stfub_memory_bank stfub_memory_banks[] = {
+static const void *stfub_dfu_wear_counters_snapshot(u32 *size)
+{
+	*size = sizeof(struct stfub_wear_counters);
+	return stfub_wear_counters();
+}
+
+static const void *stfub_dfu_statistics_snapshot(u32 *size)
+{
+	*size = sizeof(struct stfub_statistics);
+	return stfub_stats_snapshot();
+}
+
+/* Empty if nothing has faulted since the record was cleared */
+static const void *stfub_dfu_fault_record_snapshot(u32 *size)
+{
+	const struct stfub_fault_record *record = stfub_fault_record();
+
+	*size = record ? sizeof(*record) : 0;
+	return record;
+}
+
+extern unsigned _ri_ram_start, _ri_ram_end;
+extern unsigned _if_rom_start;
+extern unsigned _bl_rom_start, _ky_rom_start;
+extern unsigned _op_rom_start, _op_rom_end;
+
+/*
+   Not const, the banks backed by memory come from the memory layout
+   (stfub-mem-layout.ld) and are set up by stfub_dfu_init().
+ */
+static struct stfub_memory_bank stfub_memory_banks[] = {
 	[STFUB_AS_MAIN_MEMORY] = {
-		.start	= 0x08004800,
-		.end	= 0x08040000,
 	},
+	/* The key slot page is deliberately left out */
 	[STFUB_AS_SYSTEM_MEMORY] = {
-		.start	= 0x08001000,
-		.end	= 0x08004800,
 	},
 	[STFUB_AS_OPTION_BYTES] = {
-		.start	= 0x1FFFF800,
-		.end	= 0x1FFFF810,
 	},
+	[STFUB_AS_WEAR_COUNTERS] = {
+		.snapshot = stfub_dfu_wear_counters_snapshot,
+	},
+	[STFUB_AS_STATISTICS] = {
+		.snapshot = stfub_dfu_statistics_snapshot,
+	},
+	[STFUB_AS_RAM] = {
+	},
+	[STFUB_AS_FAULT_RECORD] = {
+		.snapshot = stfub_dfu_fault_record_snapshot,
+	},
+	[STFUB_AS_VERIFY] = {
+		.snapshot = stfub_verify_result,
+		.query    = stfub_verify_query,
+		.query_ms = stfub_verify_query_ms,
+	},
+	/* Main memory again, for images without an info block */
+	[STFUB_AS_RAW_FIRMWARE] = {
+	},
+#ifdef STFUB_RLE
+	/* Main memory once more, read-only and uploaded compressed */
+	[STFUB_AS_MAIN_MEMORY_RLE] = {
+		.compressed = true,
+	},
+#endif
 };
 
 struct stfub_dfu {
@@ -55,25 +159,78 @@ struct stfub_dfu {
 
 	u32 timeout;
 
+	/* When the last request came in, and the bwPollTimeout the host
+	 * was given last */
+	struct {
+		u32 timestamp;
+		u32 timeout;
+	} poll;
+
 	enum dfu_status status;
 	enum dfu_state  state;
 
 	struct {
 		const u8 *readptr;
+		const u8 *readend;
 		u8 *writeptr;
+		/* Everything below this address has been erased */
+		u8 *erased;
+		/* End of the data the download is expected to carry */
+		u8 *end;
+		/* Blocks of the download in place so far, all of them
+		 * but the last one as long as block 0 */
+		u32 committed;
+		u32 size;
 	} block;
 
 	const struct stfub_memory_bank *bank;
+	/* Bank of the DFU interface's altsetting, bank may differ while
+	 * a stream is in progress */
+	const struct stfub_memory_bank *selected_bank;
+
+	struct {
+		struct stfub_firmware_info info __attribute__((aligned(4)));
+#ifdef STFUB_CRYPTO
+		struct stfub_aes_ctx aes;
+		struct stfub_sha256_ctx sha;
+		bool encrypted;
+#endif
+	} image;
+
+	struct {
+		enum stfub_manifest_step step;
+		const u32 *crcptr;
+		u32 crc_words_left;
+#ifdef STFUB_CRYPTO
+		/* The signature check has got past its start */
+		bool verifying;
+		struct stfub_ed25519_verify_ctx signature;
+#endif
+	} manifest;
 
 	struct {
 		int block_no;
 		int block_len;
-		u8 block[2048];
+		u8 block[STFUB_DFU_TRANSFER_SIZE];
 	} pending;
+
+	/* Vector table of the image to start instead of staying in DFU */
+	void *exit_table;
 };
 
 static struct stfub_dfu dfu;
 
+#ifdef STFUB_CRYPTO
+/* Cycles the last full batch of signature rounds took per round */
+static u32 stfub_dfu_signature_round_measured;
+#endif
+
+static void stfub_dfu_set_bank(u16 altsetting, u32 start, u32 end)
+{
+	stfub_memory_banks[altsetting].start = start;
+	stfub_memory_banks[altsetting].end   = end;
+}
+
 void stfub_dfu_init(const struct usb_dfu_descriptor *descr)
 {
 	dfu.state	= STATE_DFU_IDLE;
@@ -81,25 +238,132 @@ void stfub_dfu_init(const struct usb_dfu_descriptor *descr)
 	dfu.descr	= descr;
 	dfu.timeout	= 100;
 	dfu.bank	= &stfub_memory_banks[STFUB_AS_MAIN_MEMORY];
+	dfu.selected_bank = dfu.bank;
 	dfu.pending.block_len = -1;
+	dfu.manifest.step = STFUB_MANIFEST_DONE;
+
+	stfub_dfu_set_bank(STFUB_AS_MAIN_MEMORY, (u32)&_if_rom_start,
+			   stfub_wear_log_start());
+	stfub_dfu_set_bank(STFUB_AS_RAW_FIRMWARE, (u32)&_if_rom_start,
+			   stfub_wear_log_start());
+#ifdef STFUB_RLE
+	stfub_dfu_set_bank(STFUB_AS_MAIN_MEMORY_RLE, (u32)&_if_rom_start,
+			   stfub_wear_log_start());
+#endif
+	stfub_dfu_set_bank(STFUB_AS_SYSTEM_MEMORY, (u32)&_bl_rom_start,
+			   (u32)&_ky_rom_start);
+	stfub_dfu_set_bank(STFUB_AS_OPTION_BYTES, (u32)&_op_rom_start,
+			   (u32)&_op_rom_end);
+	stfub_dfu_set_bank(STFUB_AS_RAM, (u32)&_ri_ram_start,
+			   (u32)&_ri_ram_end);
+}
+
+/* Address range of a bank, both 0 for the virtual ones */
+void stfub_dfu_bank_range(u16 altsetting, u32 *start, u32 *end)
+{
+	*start = stfub_memory_banks[altsetting].start;
+	*end   = stfub_memory_banks[altsetting].end;
+}
+
+void *stfub_dfu_exit_requested(void)
+{
+	return dfu.exit_table;
+}
+
+static bool stfub_dfu_bank_is_ram(struct stfub_dfu *dfu)
+{
+	return dfu->bank == &stfub_memory_banks[STFUB_AS_RAM];
 }
 
 void stfub_dfu_switch_altsetting(usbd_device *usbd_dev, u16 interface, u16 altsetting)
 {
-	dfu.bank = &stfub_memory_banks[altsetting];
+	dfu.selected_bank = &stfub_memory_banks[altsetting];
+
+	/* Otherwise it takes effect back in dfuIDLE */
+	if (!stfub_dfu_busy()) {
+		dfu.bank = dfu.selected_bank;
+		dfu.block.committed = 0;
+	}
+}
+
+static bool stfub_dfu_attribute_is_set(struct stfub_dfu *dfu, u8 attribute)
+{
+	return dfu->descr->bmAttributes & attribute;
+}
+
+static enum dfu_state stfub_dfu_get_state(struct stfub_dfu *dfu)
+{
+	return dfu->state;
+}
+
+static void stfub_dfu_set_state(struct stfub_dfu *dfu,
+				 enum dfu_state state)
+{
+	if (dfu->state != state)
+		stfub_trace(STFUB_TRACE_STATE, state);
+
+	/* A stream works on a bank of its own up to here, see
+	 * stfub_dfu_stream_begin() */
+	if (state == STATE_DFU_IDLE)
+		dfu->bank = dfu->selected_bank;
+
+	dfu->state = state;
+}
+
+static enum dfu_status stfub_dfu_get_status(struct stfub_dfu *dfu)
+{
+	return dfu->status;
+}
+
+static void stfub_dfu_set_status(struct stfub_dfu *dfu,
+				  enum dfu_status status)
+{
+	dfu->status = status;
+}
+
+/*
+   Whether a download, upload or manifestation is under way, by DFU or
+   by a stream. A failed one that the host has not cleared up counts as
+   over.
+ */
+bool stfub_dfu_busy(void)
+{
+	switch (stfub_dfu_get_state(&dfu)) {
+	case STATE_DFU_IDLE:
+	case STATE_DFU_ERROR:
+		return false;
+	default:
+		return true;
+	}
 }
 
 static int stfub_dfu_read_firmware_block(struct stfub_dfu *dfu, u16 block_no,
 					 u8 *buf, int len)
 {
 	int read_len;
-	const u8 *start_address  = (const u8 *)dfu->bank->start;
-	const u8 *end_address    = (const u8 *)dfu->bank->end;
+	u32 size;
+
+#ifdef STFUB_RLE
+	if (dfu->bank->compressed) {
+		if (block_no == 0)
+			stfub_rle_begin((const void *)dfu->bank->start,
+					(const void *)dfu->bank->end);
 
-	if (block_no == 0)
-		dfu->block.readptr = start_address;
+		return stfub_rle_read(buf, len);
+	}
+#endif
+
+	if (block_no == 0) {
+		if (dfu->bank->snapshot) {
+			dfu->block.readptr = dfu->bank->snapshot(&size);
+			dfu->block.readend = dfu->block.readptr + size;
+		} else {
+			dfu->block.readptr = (const u8 *)dfu->bank->start;
+			dfu->block.readend = (const u8 *)dfu->bank->end;
+		}
+	}
 
-	read_len = MIN(len, end_address - dfu->block.readptr);
+	read_len = MIN(len, dfu->block.readend - dfu->block.readptr);
 
 	memcpy(buf, dfu->block.readptr, read_len);
 
@@ -108,6 +372,440 @@ static int stfub_dfu_read_firmware_block(struct stfub_dfu *dfu, u16 block_no,
 	return read_len;
 }
 
+static bool stfub_dfu_bank_is_raw(struct stfub_dfu *dfu)
+{
+	return dfu->bank == &stfub_memory_banks[STFUB_AS_RAW_FIRMWARE];
+}
+
+/* Whether the bank ends up with one, raw images get theirs made up */
+static bool stfub_dfu_bank_has_info_block(struct stfub_dfu *dfu)
+{
+	return dfu->bank == &stfub_memory_banks[STFUB_AS_MAIN_MEMORY] ||
+		stfub_dfu_bank_is_raw(dfu);
+}
+
+/*
+   Everything about the download is known from its first block: reject
+   it there, before anything gets erased, rather than after the old
+   firmware is already gone.
+ */
+static int stfub_dfu_parse_info_block(struct stfub_dfu *dfu)
+{
+	struct stfub_firmware_info *info = &dfu->image.info;
+	u32 capacity = dfu->bank->end - dfu->bank->start - sizeof(*info);
+#ifdef STFUB_CRYPTO
+	const u8 *key;
+#endif
+
+	if (dfu->pending.block_len < (int)sizeof(*info)) {
+		stfub_dfu_set_status(dfu, DFU_STATUS_ERR_FILE);
+		return -1;
+	}
+
+	memcpy(info, dfu->pending.block, sizeof(*info));
+
+	if (stfub_crc_block(info, STFUB_INFO_BLOCK_CRC_WORDS) !=
+	    info->crc.info_block || info->size % 4) {
+		stfub_dfu_set_status(dfu, DFU_STATUS_ERR_FILE);
+		return -1;
+	}
+
+	if (info->size > capacity) {
+		stfub_dfu_set_status(dfu, DFU_STATUS_ERR_ADDRESS);
+		return -1;
+	}
+
+#ifdef STFUB_CRYPTO
+	dfu->image.encrypted = info->flags & STFUB_FW_ENCRYPTED;
+	if (dfu->image.encrypted) {
+		key = stfub_key_slot_aes(info->cipher.key_slot);
+		if (!key) {
+			stfub_dfu_set_status(dfu, DFU_STATUS_ERR_FILE);
+			return -1;
+		}
+
+		stfub_aes_set_key(&dfu->image.aes, key);
+	}
+
+	stfub_sha256_init(&dfu->image.sha);
+#else
+	/* Neither can be dealt with without STFUB_CRYPTO */
+	if (info->flags & (STFUB_FW_ENCRYPTED | STFUB_FW_SIGNED)) {
+		stfub_dfu_set_status(dfu, DFU_STATUS_ERR_FILE);
+		return -1;
+	}
+#endif
+
+	dfu->block.end = (u8 *)dfu->bank->start + sizeof(*info) + info->size;
+
+	return 0;
+}
+
+/*
+   Raw images come without an info block, the device writes its own at
+   manifestation. The data goes to the application area right behind
+   it, and the CRC is calculated from flash as each block is programmed
+   (see stfub_dfu_crc_raw_block()), so the info block describes what
+   was actually written rather than what the host meant to send.
+ */
+static int stfub_dfu_begin_raw_image(struct stfub_dfu *dfu)
+{
+#ifdef STFUB_REQUIRE_SIGNED_IMAGES
+	/* Raw images cannot be signed (keys.h sets this for verified
+	 * boot too) */
+	stfub_dfu_set_status(dfu, DFU_STATUS_ERR_FILE);
+	return -1;
+#else
+	memset(&dfu->image.info, 0, sizeof(dfu->image.info));
+#ifdef STFUB_CRYPTO
+	dfu->image.encrypted = false;
+#endif
+
+	dfu->block.writeptr += sizeof(dfu->image.info);
+
+	return 0;
+#endif
+}
+
+/*
+   Feed a raw image block to the CRC unit once it is in flash. The DMA
+   runs while the next block comes in; a last block that ends in the
+   middle of a word takes the erased half-word after it along, which
+   is what the reset handler sees too.
+ */
+static void stfub_dfu_crc_raw_block(struct stfub_dfu *dfu, int len)
+{
+	u32 words = (len + 3) / 4;
+
+	while (stfub_crc_busy())
+		;
+
+	if (!dfu->image.info.size)
+		stfub_crc_start(dfu->block.writeptr, words);
+	else
+		stfub_crc_continue(dfu->block.writeptr, words);
+
+	dfu->image.info.size += words * 4;
+}
+
+#ifdef STFUB_CRYPTO
+/*
+   Locate the part of the pending block that lies past the info block
+   and its offset within the firmware. Returns the length of that part.
+ */
+static int stfub_dfu_firmware_part(struct stfub_dfu *dfu, int len,
+				   u8 **buf, u32 *offset)
+{
+	u8 *firmware_start = (u8 *)dfu->bank->start +
+		sizeof(struct stfub_firmware_info);
+
+	*buf	= dfu->pending.block;
+	*offset	= 0;
+
+	if (dfu->block.writeptr < firmware_start) {
+		*buf += firmware_start - dfu->block.writeptr;
+		len  -= firmware_start - dfu->block.writeptr;
+	} else {
+		*offset = dfu->block.writeptr - firmware_start;
+	}
+
+	return len;
+}
+
+static void stfub_dfu_decrypt_block(struct stfub_dfu *dfu, int len)
+{
+	u32 offset;
+	u8 *buf;
+
+	len = stfub_dfu_firmware_part(dfu, len, &buf, &offset);
+	if (len > 0)
+		stfub_aes_ctr_crypt(&dfu->image.aes,
+				    dfu->image.info.cipher.nonce,
+				    offset, buf, len);
+}
+
+/*
+   Hash the plaintext as it goes to flash, so only the signature check
+   is left to do once the download is over.
+ */
+static void stfub_dfu_hash_block(struct stfub_dfu *dfu, int len)
+{
+	u32 offset;
+	u8 *buf;
+
+	len = stfub_dfu_firmware_part(dfu, len, &buf, &offset);
+	if (offset >= dfu->image.info.size)
+		return;
+
+	len = MIN((u32)len, dfu->image.info.size - offset);
+	if (len > 0)
+		stfub_sha256_update(&dfu->image.sha, buf, len);
+}
+
+/*
+   Everything about the signature but the curve arithmetic. Returns 1 if
+   there is a signature to verify, 0 if the image gets by without one
+   and -1 if it is rejected outright.
+ */
+static int stfub_dfu_start_signature_check(struct stfub_dfu *dfu)
+{
+	struct stfub_firmware_info *info = &dfu->image.info;
+	u8 digest[STFUB_SHA256_DIGEST_SIZE];
+	const u8 *public_key;
+
+	if (!(info->flags & STFUB_FW_SIGNED)) {
+#ifdef STFUB_REQUIRE_SIGNED_IMAGES
+		return -1;
+#else
+		return 0;
+#endif
+	}
+
+	if (dfu->image.sha.length != info->size)
+		return -1;
+
+	stfub_sha256_final(&dfu->image.sha, digest);
+	if (memcmp(digest, info->signature.digest, sizeof(digest)))
+		return -1;
+
+	public_key = stfub_key_slot_ed25519(info->signature.key_slot);
+	if (!public_key)
+		return -1;
+
+	if (stfub_ed25519_verify_start(&dfu->manifest.signature,
+				       info->signature.value, digest,
+				       sizeof(digest), public_key) < 0)
+		return -1;
+
+	return 1;
+}
+
+/* Same as stfub_ed25519_verify_continue(), a tick's worth of rounds */
+static int stfub_dfu_continue_signature_check(struct stfub_dfu *dfu)
+{
+	u32 cycles;
+	int ret;
+
+	cycles = stfub_dwt_cycles();
+	ret = stfub_ed25519_verify_continue(&dfu->manifest.signature,
+					    STFUB_DFU_SIGNATURE_ROUNDS_PER_TICK);
+	if (!ret)
+		stfub_dfu_signature_round_measured =
+			(stfub_dwt_cycles() - cycles) /
+			STFUB_DFU_SIGNATURE_ROUNDS_PER_TICK;
+
+	return ret;
+}
+
+static u32 stfub_dfu_signature_ms_left(struct stfub_dfu *dfu)
+{
+	u32 cycles = stfub_dfu_signature_round_measured;
+	u32 rounds = STFUB_ED25519_ROUNDS;
+
+	if (!cycles)
+		cycles = STFUB_DFU_SIGNATURE_ROUND_CYCLES;
+
+	if (dfu->manifest.step == STFUB_MANIFEST_CHECK_SIGNATURE &&
+	    dfu->manifest.verifying)
+		rounds = dfu->manifest.signature.rounds_left;
+
+	return rounds * cycles / STFUB_DWT_CYCLES_PER_MS + 1;
+}
+#endif
+
+/*
+   The info block is the only thing the reset handler trusts, so it is
+   kept out of flash until the rest of the image has been checked: block
+   0 is programmed without it, which leaves that area erased, and an
+   interrupted or rejected download never looks bootable.
+ */
+static int stfub_dfu_write_info_block(struct stfub_dfu *dfu)
+{
+	enum stfub_flash_status ret;
+
+	flash_unlock();
+	ret = stfub_flash_program(dfu->bank->start, &dfu->image.info,
+				  sizeof(dfu->image.info));
+	flash_lock();
+
+	if (ret != STFUB_FLASH_OK ||
+	    memcmp((const void *)dfu->bank->start, &dfu->image.info,
+		   sizeof(dfu->image.info)))
+		return -1;
+
+	return 0;
+}
+
+/*
+   A block that covers a whole sector that has not been erased yet and
+   already holds the same data does not need to be written at all. The
+   first sector of an image is always erased, it has to make room for
+   the new info block.
+ */
+static bool stfub_dfu_block_is_unchanged(struct stfub_dfu *dfu, int len)
+{
+	if ((u32)len != stfub_flash_sector_size((u32)dfu->block.writeptr) ||
+	    dfu->block.erased != dfu->block.writeptr)
+		return false;
+
+	if (stfub_dfu_bank_has_info_block(dfu) &&
+	    dfu->block.writeptr == (u8 *)dfu->bank->start)
+		return false;
+
+	return !memcmp(dfu->block.writeptr, dfu->pending.block, len);
+}
+
+/*
+   Images downloaded to RAM are raw, linked to run at the start of the
+   bank with their vector table there, and are started as soon as the
+   host has seen the end of manifestation.
+ */
+static int stfub_dfu_write_ram_block(struct stfub_dfu *dfu)
+{
+#ifdef STFUB_REQUIRE_SIGNED_IMAGES
+	/* A RAM image is started unchecked, which would get around the
+	 * signature that every flash image needs */
+	stfub_dfu_set_status(dfu, DFU_STATUS_ERR_TARGET);
+	return -1;
+#else
+	u8 *end_address = (u8 *)dfu->bank->end;
+
+	/* Any block can be written again, in any order */
+	if (dfu->pending.block_no == 0)
+		dfu->block.size = dfu->pending.block_len;
+
+	dfu->block.writeptr = (u8 *)dfu->bank->start +
+		dfu->pending.block_no * dfu->block.size;
+
+	if (dfu->pending.block_len > (int)dfu->block.size ||
+	    dfu->pending.block_len > end_address - dfu->block.writeptr) {
+		stfub_dfu_set_status(dfu, DFU_STATUS_ERR_ADDRESS);
+		return -1;
+	}
+
+	memcpy(dfu->block.writeptr, dfu->pending.block, dfu->pending.block_len);
+	dfu->block.writeptr += dfu->pending.block_len;
+
+	dfu->pending.block_len = -1;
+	return 0;
+#endif
+}
+
+/*
+   Images that can be started as soon as the host is done with them: a
+   RAM image, or firmware whose CRC (and signature) manifestation has
+   just checked, so there is no reason to go through a reset and have
+   the reset handler check it all over again.
+ */
+static bool stfub_dfu_bank_is_startable(struct stfub_dfu *dfu)
+{
+	return stfub_dfu_bank_is_ram(dfu) ||
+		stfub_dfu_bank_has_info_block(dfu);
+}
+
+static void stfub_dfu_leave(struct stfub_dfu *dfu)
+{
+	if (stfub_dfu_bank_is_ram(dfu))
+		dfu->exit_table = (void *)dfu->bank->start;
+	else if (stfub_dfu_bank_has_info_block(dfu))
+		dfu->exit_table = (void *)(dfu->bank->start +
+					   sizeof(struct stfub_firmware_info));
+	else
+		/* The bootloader and option bytes take effect on reset */
+		scb_reset_system();
+}
+
+static void stfub_dfu_exit_complete(usbd_device *usbddev,
+				    struct usb_setup_data *req)
+{
+	stfub_dfu_leave(&dfu);
+}
+
+/* DFU 1.1, A.2.9: a bus reset in dfuMANIFEST-WAIT-RESET ends DFU mode */
+void stfub_dfu_bus_reset(void)
+{
+	if (stfub_dfu_get_state(&dfu) == STATE_DFU_MANIFEST_WAIT_RESET)
+		stfub_dfu_leave(&dfu);
+}
+
+static int stfub_dfu_write_query_block(struct stfub_dfu *dfu)
+{
+	enum dfu_status status;
+
+	status = dfu->bank->query(dfu->pending.block, dfu->pending.block_len);
+	if (status != DFU_STATUS_OK) {
+		stfub_dfu_set_status(dfu, status);
+		return -1;
+	}
+
+	dfu->pending.block_len = -1;
+	return 0;
+}
+
+/*
+   Flash blocks are placed by their number, block 0 sets the length of
+   the others. Decryption, hashing and erasing all go through the image
+   in order, so the only block that can be written is the next one, at
+   the address its number gives, which has to be where the previous
+   blocks ended. Blocks already committed are acknowledged again
+   without touching the flash: after an error and DFU_CLRSTATUS, or a
+   status the host never saw, it resends the block it is unsure of and
+   carries on from there instead of starting over.
+
+   Returns 1 for a block that is committed already.
+ */
+static int stfub_dfu_locate_block(struct stfub_dfu *dfu)
+{
+	u32 block_no = dfu->pending.block_no;
+	u8 *base = (u8 *)dfu->bank->start;
+
+	if (stfub_dfu_bank_is_raw(dfu))
+		base += sizeof(struct stfub_firmware_info);
+
+	if (!dfu->block.committed || block_no > dfu->block.committed ||
+	    dfu->pending.block_len > (int)dfu->block.size) {
+		stfub_dfu_set_status(dfu, DFU_STATUS_ERR_ADDRESS);
+		return -1;
+	}
+
+	if (block_no < dfu->block.committed)
+		return 1;
+
+	/* Past the end of the image, where a DFU suffix goes, the data
+	 * is dropped whatever its address */
+	if (dfu->block.writeptr != dfu->block.end &&
+	    base + block_no * dfu->block.size != dfu->block.writeptr) {
+		stfub_dfu_set_status(dfu, DFU_STATUS_ERR_ADDRESS);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+   Block 0 normally starts a new download. On "Main Memory" it carries
+   the info block, which holds the CRC of the whole firmware, so a block
+   0 with the info block of the download in progress is a resend and is
+   acknowledged again like any other committed block. Raw images have
+   nothing to tell them apart, their block 0 always starts over.
+ */
+static bool stfub_dfu_block_zero_is_committed(struct stfub_dfu *dfu)
+{
+	return dfu->block.committed &&
+		dfu->bank == &stfub_memory_banks[STFUB_AS_MAIN_MEMORY] &&
+		dfu->pending.block_len == (int)dfu->block.size &&
+		!memcmp(dfu->pending.block, &dfu->image.info,
+			sizeof(dfu->image.info));
+}
+
+/* The block is in flash, the next one may follow */
+static void stfub_dfu_commit_block(struct stfub_dfu *dfu, int len)
+{
+	dfu->block.writeptr += len;
+	dfu->block.committed++;
+	dfu->pending.block_len = -1;
+}
+
 static int stfub_dfu_write_firmware_block(struct stfub_dfu *dfu)
 {
 	stfub_printf("stfub_dfu_write_firmware_block\n");
@@ -115,8 +813,17 @@ static int stfub_dfu_write_firmware_block(struct stfub_dfu *dfu)
 	if (dfu->bank == &stfub_memory_banks[STFUB_AS_OPTION_BYTES]) {
 		/* Option bytes are a special case, handle them separately */
 		return -1;
+	} else if (dfu->bank->query) {
+		return stfub_dfu_write_query_block(dfu);
+	} else if (dfu->bank->snapshot || dfu->bank->compressed) {
+		stfub_dfu_set_status(dfu, DFU_STATUS_ERR_WRITE);
+		return -1;
+	} else if (stfub_dfu_bank_is_ram(dfu)) {
+		return stfub_dfu_write_ram_block(dfu);
 	} else {
-		int write_len, i;
+		enum stfub_flash_status status;
+		int write_len, i, ret;
+		u32 cycles, pages;
 
 		u8 *start_address  = (u8 *)dfu->bank->start;
 		u8 *end_address    = (u8 *)dfu->bank->end;
@@ -133,70 +840,277 @@ static int stfub_dfu_write_firmware_block(struct stfub_dfu *dfu)
 		if (dfu->pending.block_len % 2) 
 			return -1;
 
-		if (dfu->pending.block_no == 0)
+		if (dfu->pending.block_no == 0) {
+			if (stfub_dfu_block_zero_is_committed(dfu)) {
+				dfu->pending.block_len = -1;
+				return 0;
+			}
+
+			/* Erasing the first sector must not take anything
+			 * in front of the bank with it */
+			if (stfub_flash_sector_start((u32)start_address) !=
+			    (u32)start_address) {
+				stfub_dfu_set_status(dfu, DFU_STATUS_ERR_ADDRESS);
+				return -1;
+			}
+
 			dfu->block.writeptr = start_address;
+			dfu->block.erased   = start_address;
+			dfu->block.end      = end_address;
+			dfu->block.size     = dfu->pending.block_len;
+			dfu->block.committed = 0;
+
+			if (stfub_dfu_bank_is_raw(dfu)) {
+				if (stfub_dfu_begin_raw_image(dfu) < 0)
+					return -1;
+			} else if (stfub_dfu_bank_has_info_block(dfu) &&
+				   stfub_dfu_parse_info_block(dfu) < 0) {
+				return -1;
+			}
+
+			/* Only the size from the info block makes a
+			 * mass erase worth considering */
+			if (stfub_dfu_bank_has_info_block(dfu) &&
+			    !stfub_dfu_bank_is_raw(dfu) &&
+			    stfub_erase_plan((u32)start_address,
+					     (u32)dfu->block.end) ==
+			    STFUB_ERASE_MASS) {
+				stfub_trace(STFUB_TRACE_ERASE_START, 0);
+
+				flash_unlock();
+				ret = stfub_erase_mass((u32)start_address);
+				flash_lock();
+
+				stfub_trace(STFUB_TRACE_ERASE_END, 0);
+
+				if (ret < 0) {
+					stfub_dfu_set_status(dfu, DFU_STATUS_ERR_ERASE);
+					return -1;
+				}
+
+				/* Nothing left for the lazy erase to do */
+				dfu->block.erased = end_address;
+			}
+		} else {
+			ret = stfub_dfu_locate_block(dfu);
+			if (ret < 0)
+				return -1;
+
+			if (ret) {
+				dfu->pending.block_len = -1;
+				return 0;
+			}
+		}
 
 		stfub_printf("[%d] dfu->block.writeptr = %x\n",
 			     dfu->pending.block_no, dfu->block.writeptr);
 
+		/* The size of a raw image is whatever the host sends, and
+		 * only its last block may end in the middle of a word */
+		if (stfub_dfu_bank_is_raw(dfu) &&
+		    (dfu->pending.block_len > dfu->block.end - dfu->block.writeptr ||
+		     (u32)dfu->block.writeptr % 4)) {
+			stfub_dfu_set_status(dfu, DFU_STATUS_ERR_ADDRESS);
+			return -1;
+		}
+
+		/* Anything past the end of the image, like a DFU suffix
+		 * the host did not strip, is dropped */
 		write_len = MIN(dfu->pending.block_len,
-				end_address - dfu->block.writeptr);
+				dfu->block.end - dfu->block.writeptr);
+		if (write_len <= 0) {
+			stfub_dfu_commit_block(dfu, 0);
+			return 0;
+		}
+
+#ifdef STFUB_CRYPTO
+		if (stfub_dfu_bank_has_info_block(dfu) &&
+		    !stfub_dfu_bank_is_raw(dfu) && dfu->image.encrypted)
+			stfub_dfu_decrypt_block(dfu, write_len);
+#endif
+
+		if (stfub_dfu_block_is_unchanged(dfu, write_len)) {
+			stfub_stats.pages_skipped++;
+			if (stfub_dfu_bank_is_raw(dfu))
+				stfub_dfu_crc_raw_block(dfu, write_len);
+#ifdef STFUB_CRYPTO
+			else if (stfub_dfu_bank_has_info_block(dfu))
+				stfub_dfu_hash_block(dfu, write_len);
+#endif
+			dfu->block.erased += write_len;
+			stfub_dfu_commit_block(dfu, write_len);
+			return 0;
+		}
 
 		flash_unlock();
 		flash_unlock_option_bytes();
 
-		flash_erase_page((u32)dfu->block.writeptr);
-
-		for (i = 0; i < write_len; i += 2)
-			flash_program_half_word((u32)(dfu->block.writeptr + i),
-						*(u16 *)(dfu->pending.block + i));
+		/*
+		   Sectors are erased as the data reaches them, so no
+		   single request has to wait for more than one or two
+		   erases and a transfer size smaller than a sector does
+		   not wipe what the previous blocks wrote: the blocks
+		   that follow into a sector larger than the transfer
+		   size find it erased already. Nothing past the end of
+		   the image is touched.
+		 */
+		cycles = stfub_dwt_cycles();
+		stfub_trace(STFUB_TRACE_ERASE_START, (u32)dfu->block.erased);
+		pages = 0;
+		while (dfu->block.erased < dfu->block.writeptr + write_len) {
+			/* The sector counts as not erased, a resent block
+			 * tries again */
+			if (stfub_flash_erase_sector((u32)dfu->block.erased) !=
+			    STFUB_FLASH_OK) {
+				flash_lock();
+				stfub_dfu_set_status(dfu, DFU_STATUS_ERR_ERASE);
+				return -1;
+			}
+			stfub_wear_record_erase((u32)dfu->block.erased);
+			dfu->block.erased +=
+				stfub_flash_sector_size((u32)dfu->block.erased);
+			stfub_stats.pages_erased++;
+			pages++;
+		}
+		stfub_trace(STFUB_TRACE_ERASE_END, pages);
+		stfub_stats.erase_cycles += stfub_dwt_cycles() - cycles;
+
+		/* The info block is written at the end of manifestation */
+		i = 0;
+		if (stfub_dfu_bank_has_info_block(dfu) &&
+		    !stfub_dfu_bank_is_raw(dfu) &&
+		    dfu->pending.block_no == 0)
+			i = sizeof(struct stfub_firmware_info);
+
+		stfub_stats.bytes_programmed += write_len - i;
+
+		cycles = stfub_dwt_cycles();
+		stfub_trace(STFUB_TRACE_PROGRAM_START,
+			    (u32)(dfu->block.writeptr + i));
+		status = stfub_flash_program((u32)(dfu->block.writeptr + i),
+					     dfu->pending.block + i,
+					     write_len - i);
+		stfub_trace(STFUB_TRACE_PROGRAM_END, write_len);
+		stfub_stats.program_cycles += stfub_dwt_cycles() - cycles;
 
 		flash_lock();
 
-		dfu->block.writeptr += write_len;
+		if (status != STFUB_FLASH_OK) {
+			/* A block that starts a sector has it to itself,
+			 * erase it again should the block be resent */
+			if (stfub_flash_sector_start((u32)dfu->block.writeptr) ==
+			    (u32)dfu->block.writeptr)
+				dfu->block.erased = dfu->block.writeptr;
 
+			stfub_dfu_set_status(dfu, status == STFUB_FLASH_PROTECTED ?
+					     DFU_STATUS_ERR_WRITE :
+					     DFU_STATUS_ERR_CHECK_ERASED);
+			return -1;
+		}
 
-		dfu->pending.block_len = -1;
+		/* Only what made it to flash is hashed, a block that is
+		 * resent does not go into the digest twice */
+		if (stfub_dfu_bank_is_raw(dfu))
+			stfub_dfu_crc_raw_block(dfu, write_len);
+#ifdef STFUB_CRYPTO
+		else if (stfub_dfu_bank_has_info_block(dfu))
+			stfub_dfu_hash_block(dfu, write_len);
+#endif
+
+		stfub_dfu_commit_block(dfu, write_len);
 		return 0;
 	}
 }
 
-static bool stfub_dfu_attribute_is_set(struct stfub_dfu *dfu, u8 attribute)
+/*
+   Worst case time the pending block spends erasing the sectors it
+   reaches into, nothing if they have been erased already.
+ */
+static u32 stfub_dfu_erase_time_ms(struct stfub_dfu *dfu)
 {
-	return dfu->descr->bmAttributes & attribute;
-}
+	const struct stfub_firmware_info *info;
+	u32 erased, end;
 
-static enum dfu_state stfub_dfu_get_state(struct stfub_dfu *dfu)
-{
-	return dfu->state;
-}
+	if (dfu->pending.block_len <= 0 || !dfu->bank->start ||
+	    stfub_dfu_bank_is_ram(dfu))
+		return 0;
 
-static void stfub_dfu_set_state(struct stfub_dfu *dfu,
-				 enum dfu_state state)
-{
-	dfu->state = state;
-}
+	if (dfu->pending.block_no == 0) {
+		erased = dfu->bank->start;
+		end    = erased + dfu->pending.block_len;
+
+		if (stfub_dfu_bank_is_raw(dfu))
+			return stfub_flash_erase_ms(erased, end +
+				sizeof(struct stfub_firmware_info));
+
+		/* The info block at the front tells how the image will be
+		 * erased, it is checked properly once the block is written */
+		info = (const struct stfub_firmware_info *)dfu->pending.block;
+		if (stfub_dfu_bank_has_info_block(dfu) &&
+		    dfu->pending.block_len >= (int)sizeof(*info) &&
+		    stfub_erase_plan(erased, erased + sizeof(*info) + info->size) ==
+		    STFUB_ERASE_MASS)
+			return stfub_erase_mass_ms();
+	} else {
+		erased = (u32)dfu->block.erased;
+		end    = (u32)dfu->block.writeptr + dfu->pending.block_len;
+	}
 
-static enum dfu_status stfub_dfu_get_status(struct stfub_dfu *dfu)
-{
-	return dfu->status;
+	return end > erased ? stfub_flash_erase_ms(erased, end) : 0;
 }
 
-static void stfub_dfu_set_status(struct stfub_dfu *dfu,
-				  enum dfu_status status)
+static u32 stfub_dfu_manifest_time_left(struct stfub_dfu *dfu)
 {
-	dfu->status = status;
+	const struct stfub_firmware_info *info = &dfu->image.info;
+	enum stfub_manifest_step step = dfu->manifest.step;
+	u32 ms = 1;
+
+	if (step == STFUB_MANIFEST_DONE)
+		return 0;
+
+	if (step == STFUB_MANIFEST_FLUSH)
+		ms += MAX(STFUB_DFU_MANIFEST_PAGE_MS,
+			  stfub_dfu_erase_time_ms(dfu));
+
+	if (!stfub_dfu_bank_has_info_block(dfu))
+		return ms;
+
+	if (step < STFUB_MANIFEST_CHECK_CRC)
+		ms += info->size / 4 / STFUB_DFU_MANIFEST_CRC_WORDS_PER_MS;
+	else if (step == STFUB_MANIFEST_CHECK_CRC)
+		ms += dfu->manifest.crc_words_left /
+			STFUB_DFU_MANIFEST_CRC_WORDS_PER_MS;
+
+#ifdef STFUB_CRYPTO
+	if (step <= STFUB_MANIFEST_CHECK_SIGNATURE &&
+	    (info->flags & STFUB_FW_SIGNED))
+		ms += stfub_dfu_signature_ms_left(dfu);
+#endif
+
+	return ms + STFUB_DFU_MANIFEST_INFO_BLOCK_MS;
 }
 
 static u32 stfub_dfu_get_poll_timeout(struct stfub_dfu *dfu)
 {
-	return dfu->timeout;
+	switch (stfub_dfu_get_state(dfu)) {
+	case STATE_DFU_MANIFEST_SYNC:
+	case STATE_DFU_MANIFEST:
+		return stfub_dfu_manifest_time_left(dfu);
+	case STATE_DFU_DNBUSY:
+		if (dfu->bank->query_ms)
+			return MAX(dfu->timeout,
+				   dfu->bank->query_ms(dfu->pending.block,
+						       dfu->pending.block_len));
+		return MAX(dfu->timeout, stfub_dfu_erase_time_ms(dfu));
+	default:
+		return dfu->timeout;
+	}
 }
 
+/* Whether the host may be back for the status by now */
 static bool stfub_dfu_timeout_elapsed(struct stfub_dfu *dfu)
 {
-	/* FIXME: Implement proper timeout support */
-	return true;
+	return stfub_timebase_ms() - dfu->poll.timestamp >= dfu->poll.timeout;
 }
 
 static int stfub_dfu_handle_get_status_request(struct stfub_dfu *dfu, u8 *buf,
@@ -204,6 +1118,8 @@ static int stfub_dfu_handle_get_status_request(struct stfub_dfu *dfu, u8 *buf,
 {
 	u32 timeout = stfub_dfu_get_poll_timeout(dfu);
 
+	dfu->poll.timeout = timeout;
+
 	buf[0] = stfub_dfu_get_status(dfu);
 	buf[1] = timeout & 0xFF;
 	buf[2] = (timeout >> 8) & 0xFF;
@@ -226,6 +1142,7 @@ static int stfub_dfu_handle_get_state_request(struct stfub_dfu *dfu, u8 *buf,
 
 static void stfub_dfu_timestamp_poll_request(struct stfub_dfu *dfu)
 {
+	dfu->poll.timestamp = stfub_timebase_ms();
 }
 
 static int stfub_dfu_queue_firmware_block(struct stfub_dfu *dfu,
@@ -238,6 +1155,7 @@ static int stfub_dfu_queue_firmware_block(struct stfub_dfu *dfu,
 
 	dfu->pending.block_no = block_no;
 	memcpy(dfu->pending.block, buf, len);
+	stfub_stats.blocks_received++;
 
 	dfu->pending.block_len = len;
 
@@ -249,10 +1167,147 @@ static bool stfub_dfu_write_pending(struct stfub_dfu *dfu)
 	return dfu->pending.block_len != -1;
 }
 
+/*
+   Run one step of the manifestation phase. Each call does a bounded
+   amount of work so the main loop keeps answering GETSTATUS in the
+   meantime. Returns 1 once manifestation is over, 0 if there is more to
+   do and -1 (with the status set) if the image has been rejected.
+ */
+static int stfub_dfu_manifest(struct stfub_dfu *dfu)
+{
+	struct stfub_firmware_info *info = &dfu->image.info;
+	enum stfub_manifest_step step = dfu->manifest.step;
+	u32 words;
+#ifdef STFUB_CRYPTO
+	int ret;
+#endif
+
+	switch (dfu->manifest.step) {
+	case STFUB_MANIFEST_FLUSH:
+		if (stfub_dfu_write_pending(dfu) &&
+		    stfub_dfu_write_firmware_block(dfu) < 0) {
+			if (stfub_dfu_get_status(dfu) == DFU_STATUS_OK)
+				stfub_dfu_set_status(dfu, DFU_STATUS_ERR_WRITE);
+			return -1;
+		}
+
+		/* Whatever manifestation makes of it, the download is
+		 * over and cannot be resumed */
+		dfu->block.committed = 0;
+
+		if (!stfub_dfu_bank_has_info_block(dfu)) {
+			dfu->manifest.step = STFUB_MANIFEST_DONE;
+			break;
+		}
 
+		/* The CRC of a raw image has been running since block 0 */
+		if (stfub_dfu_bank_is_raw(dfu)) {
+			dfu->manifest.crc_words_left = 0;
+			dfu->manifest.step = STFUB_MANIFEST_CHECK_CRC;
+			break;
+		}
+
+		dfu->manifest.crcptr = (const u32 *)(dfu->bank->start +
+						     sizeof(*info));
+		dfu->manifest.crc_words_left = info->size / 4;
+		stfub_crc_start(dfu->manifest.crcptr, 0);
+		dfu->manifest.step = STFUB_MANIFEST_CHECK_CRC;
+		break;
+	case STFUB_MANIFEST_CHECK_CRC:
+		/*
+		   Read back from flash, so this also catches bad writes.
+		   DMA feeds the CRC unit a chunk at a time while the main
+		   loop goes on serving USB.
+		 */
+		if (stfub_crc_busy())
+			break;
+
+		if (dfu->manifest.crc_words_left) {
+			words = MIN(dfu->manifest.crc_words_left,
+				    STFUB_CRC_DMA_MAX_WORDS);
+			stfub_crc_continue(dfu->manifest.crcptr, words);
+
+			dfu->manifest.crcptr         += words;
+			dfu->manifest.crc_words_left -= words;
+			break;
+		}
+
+		if (stfub_dfu_bank_is_raw(dfu)) {
+			info->crc.firmware   = stfub_crc_result();
+			info->crc.info_block =
+				stfub_crc_block(info, STFUB_INFO_BLOCK_CRC_WORDS);
+		} else if (stfub_crc_result() != info->crc.firmware) {
+			stfub_dfu_set_status(dfu, DFU_STATUS_ERR_VERIFY);
+			return -1;
+		}
+
+#ifdef STFUB_CRYPTO
+		dfu->manifest.verifying = false;
+#endif
+		dfu->manifest.step = STFUB_MANIFEST_CHECK_SIGNATURE;
+		break;
+	case STFUB_MANIFEST_CHECK_SIGNATURE:
+#ifdef STFUB_CRYPTO
+		if (!dfu->manifest.verifying) {
+			ret = stfub_dfu_start_signature_check(dfu);
+			if (ret > 0) {
+				dfu->manifest.verifying = true;
+				break;
+			}
+		} else {
+			ret = stfub_dfu_continue_signature_check(dfu);
+			if (!ret)
+				break;
+		}
+
+		if (ret < 0) {
+			stfub_dfu_set_status(dfu, DFU_STATUS_ERR_VERIFY);
+			return -1;
+		}
+#endif
+
+		dfu->manifest.step = STFUB_MANIFEST_WRITE_INFO_BLOCK;
+		break;
+	case STFUB_MANIFEST_WRITE_INFO_BLOCK:
+		if (stfub_dfu_write_info_block(dfu) < 0) {
+			stfub_dfu_set_status(dfu, DFU_STATUS_ERR_PROG);
+			return -1;
+		}
+
+		dfu->manifest.step = STFUB_MANIFEST_DONE;
+		break;
+	case STFUB_MANIFEST_DONE:
+		break;
+	}
+
+	if (dfu->manifest.step != step)
+		stfub_trace(STFUB_TRACE_MANIFEST_STEP, dfu->manifest.step);
+
+	return dfu->manifest.step == STFUB_MANIFEST_DONE;
+}
+
+static void stfub_dfu_manifest_complete(struct stfub_dfu *dfu)
+{
+	if (stfub_dfu_attribute_is_set(dfu, USB_DFU_MANIFEST_TOLERANT))
+		stfub_dfu_set_state(dfu, STATE_DFU_MANIFEST_SYNC);
+	else
+		stfub_dfu_set_state(dfu, STATE_DFU_MANIFEST_WAIT_RESET);
+}
+
+/*
+   Only the banks carrying an info block have a known size, anything
+   else is complete whenever the host says so. Raw images only need
+   some data.
+ */
 static bool dfu_all_data_is_received(struct stfub_dfu *dfu)
 {
-	return true;
+	if (!stfub_dfu_bank_has_info_block(dfu))
+		return true;
+
+	if (stfub_dfu_bank_is_raw(dfu))
+		return dfu->image.info.size;
+
+	return dfu->block.writeptr && dfu->block.writeptr == dfu->block.end;
 }
 
 void stfub_dfu_tick(void)
@@ -267,29 +1322,131 @@ void stfub_dfu_tick(void)
 
 		stfub_dfu_set_state(&dfu, STATE_DFU_DNLOAD_SYNC);
 		break;
-#if 0
+	case STATE_DFU_MANIFEST_SYNC:
 	case STATE_DFU_MANIFEST:
-		if (stfub_dfu_timeout_elapsed(&dfu)){
-			if (stfub_dfu_attribute_is_set(&dfu, USB_DFU_MANIFEST_TOLERANT))
-				stfub_dfu_set_state(&dfu, STATE_DFU_MANIFEST_SYNC);
-			else
-				stfub_dfu_set_state(&dfu, STATE_DFU_MANIFEST_WAIT_RESET);
+		/* Manifestation starts as soon as the download is over,
+		 * the host polling GETSTATUS only reports on it */
+		if (stfub_dfu_manifest(&dfu) < 0) {
+			stfub_dfu_set_state(&dfu, STATE_DFU_ERROR);
+			break;
 		}
+
+		if (stfub_dfu_get_state(&dfu) == STATE_DFU_MANIFEST &&
+		    dfu.manifest.step == STFUB_MANIFEST_DONE &&
+		    stfub_dfu_timeout_elapsed(&dfu))
+			stfub_dfu_manifest_complete(&dfu);
 		break;
-#endif
 	default:
 		break;
 
 	}
 }
 
-int stfub_dfu_handle_control_request(usbd_device *udbddev, struct usb_setup_data *req, u8 **buf,
-				     u16 *len, void (**complete)(usbd_device *udbddev, struct usb_setup_data *req))
+/*
+   Downloads that arrive by other means than DFU requests (see bulk.c)
+   go through the functions below. They drive the same state machine,
+   so for DFU such a stream looks like a download in progress, and they
+   share the info block handling, decryption, erasing and manifestation
+   with it. The stream's bank stays in use until the state machine is
+   back in dfuIDLE, so leaving from dfuMANIFEST-WAIT-RESET starts what
+   was streamed, whatever altsetting the DFU interface has.
+ */
+int stfub_dfu_stream_begin(u16 altsetting)
 {
-	int read_size, requested_size;
+	if (stfub_dfu_get_state(&dfu) != STATE_DFU_IDLE ||
+	    altsetting >= STFUB_AS_NUM || altsetting == STFUB_AS_RAM ||
+	    stfub_memory_banks[altsetting].snapshot ||
+	    stfub_memory_banks[altsetting].compressed)
+		return -1;
 
-	if ((req->bmRequestType & 0x7F) != 0x21)
-		return USBD_REQ_NOTSUPP; /* Only accept class request. */
+	dfu.bank = &stfub_memory_banks[altsetting];
+	stfub_dfu_set_state(&dfu, STATE_DFU_DNLOAD_IDLE);
+
+	return 0;
+}
+
+int stfub_dfu_stream_write(u16 block_no, const u8 *buf, int len)
+{
+	if (stfub_dfu_get_state(&dfu) != STATE_DFU_DNLOAD_IDLE)
+		return -1;
+
+	if (stfub_dfu_queue_firmware_block(&dfu, block_no, buf, len) < 0 ||
+	    stfub_dfu_write_firmware_block(&dfu) < 0) {
+		if (stfub_dfu_get_status(&dfu) == DFU_STATUS_OK)
+			stfub_dfu_set_status(&dfu, DFU_STATUS_ERR_WRITE);
+		stfub_dfu_set_state(&dfu, STATE_DFU_ERROR);
+		return -1;
+	}
+
+	return 0;
+}
+
+int stfub_dfu_stream_end(void)
+{
+	if (stfub_dfu_get_state(&dfu) != STATE_DFU_DNLOAD_IDLE)
+		return -1;
+
+	if (!dfu_all_data_is_received(&dfu)) {
+		stfub_dfu_set_status(&dfu, DFU_STATUS_ERR_NOTDONE);
+		stfub_dfu_set_state(&dfu, STATE_DFU_ERROR);
+		return -1;
+	}
+
+	/* stfub_dfu_tick() takes it from here */
+	dfu.manifest.step = STFUB_MANIFEST_FLUSH;
+	stfub_dfu_set_state(&dfu, STATE_DFU_MANIFEST_SYNC);
+
+	return 0;
+}
+
+/*
+   Returns 1 once the streamed image is manifested, 0 while that is
+   still going on and -1 if it has failed.
+ */
+int stfub_dfu_stream_poll(void)
+{
+	switch (stfub_dfu_get_state(&dfu)) {
+	case STATE_DFU_ERROR:
+		return -1;
+	case STATE_DFU_MANIFEST_SYNC:
+		if (dfu.manifest.step != STFUB_MANIFEST_DONE)
+			return 0;
+
+		if (stfub_dfu_attribute_is_set(&dfu, USB_DFU_MANIFEST_TOLERANT))
+			stfub_dfu_set_state(&dfu, STATE_DFU_IDLE);
+		else
+			stfub_dfu_set_state(&dfu, STATE_DFU_MANIFEST_WAIT_RESET);
+		return 1;
+	default:
+		return -1;
+	}
+}
+
+enum dfu_status stfub_dfu_stream_status(void)
+{
+	return stfub_dfu_get_status(&dfu);
+}
+
+void stfub_dfu_stream_abort(void)
+{
+	switch (stfub_dfu_get_state(&dfu)) {
+	case STATE_DFU_DNLOAD_IDLE:
+	case STATE_DFU_ERROR:
+		stfub_dfu_set_status(&dfu, DFU_STATUS_OK);
+		stfub_dfu_set_state(&dfu, STATE_DFU_IDLE);
+		dfu.pending.block_len = -1;
+		break;
+	default:
+		break;
+	}
+}
+
+static int stfub_dfu_process_control_request(struct usb_setup_data *req,
+					      u8 **buf, u16 *len,
+					      void (**complete)(usbd_device *usbddev,
+								struct usb_setup_data *req))
+{
+	int read_size, requested_size;
 
 	stfub_dfu_timestamp_poll_request(&dfu);
 
@@ -363,6 +1520,7 @@ int stfub_dfu_handle_control_request(usbd_device *udbddev, struct usb_setup_data
 		case DFU_DNLOAD:
 			if ((len == NULL) || (*len == 0)) {
 				if (dfu_all_data_is_received(&dfu)) {
+					dfu.manifest.step = STFUB_MANIFEST_FLUSH;
 					stfub_dfu_set_state(&dfu, STATE_DFU_MANIFEST_SYNC);
 					return USBD_REQ_HANDLED;
 				} else {
@@ -401,14 +1559,16 @@ int stfub_dfu_handle_control_request(usbd_device *udbddev, struct usb_setup_data
 		case DFU_GETSTATE:
 			return stfub_dfu_handle_get_state_request(&dfu, *buf, len);
 		case DFU_GETSTATUS:
-			if (stfub_dfu_attribute_is_set(&dfu, USB_DFU_MANIFEST_TOLERANT)) {
-				/* Since we are working in a polling mode the
-				 * manifestation will always be complete by the
-				 * time this request is served */
+			if (dfu.manifest.step != STFUB_MANIFEST_DONE) {
+				stfub_dfu_set_state(&dfu, STATE_DFU_MANIFEST);
+			} else if (stfub_dfu_attribute_is_set(&dfu, USB_DFU_MANIFEST_TOLERANT)) {
 				stfub_dfu_set_state(&dfu, STATE_DFU_IDLE);
 			} else {
 				stfub_dfu_set_state(&dfu, STATE_DFU_MANIFEST_WAIT_RESET);
+				if (stfub_dfu_bank_is_startable(&dfu))
+					*complete = stfub_dfu_exit_complete;
 			}
+
 			return stfub_dfu_handle_get_status_request(&dfu, *buf, len);
 		default:	/* FALLTHROUGH */
 			break;
@@ -416,11 +1576,34 @@ int stfub_dfu_handle_control_request(usbd_device *udbddev, struct usb_setup_data
 		break;
 	/* Table A.2.8 */
 	case STATE_DFU_MANIFEST:
-		/* Should never get here */
+		/* Strictly speaking the host should stay quiet until
+		 * bwPollTimeout runs out, but answering status requests
+		 * lets it watch the progress */
+		switch (req->bRequest) {
+		case DFU_GETSTATUS:
+			return stfub_dfu_handle_get_status_request(&dfu, *buf, len);
+		case DFU_GETSTATE:
+			return stfub_dfu_handle_get_state_request(&dfu, *buf, len);
+		default:
+			break;
+		}
 		break;
 	/* Table A.2.9 */
 	case STATE_DFU_MANIFEST_WAIT_RESET:
-		return USBD_REQ_HANDLED;
+		switch (req->bRequest) {
+		case DFU_GETSTATUS:
+			/* Leave once the host has the status in hand */
+			if (stfub_dfu_bank_is_startable(&dfu))
+				*complete = stfub_dfu_exit_complete;
+			return stfub_dfu_handle_get_status_request(&dfu, *buf, len);
+		case DFU_GETSTATE:
+			return stfub_dfu_handle_get_state_request(&dfu, *buf, len);
+		case DFU_DETACH:
+			*complete = stfub_dfu_exit_complete;
+			return USBD_REQ_HANDLED;
+		default:
+			return USBD_REQ_HANDLED;
+		}
 
 	case STATE_DFU_UPLOAD_IDLE:
 		switch (req->bRequest) {
@@ -472,3 +1655,25 @@ int stfub_dfu_handle_control_request(usbd_device *udbddev, struct usb_setup_data
 	stfub_dfu_set_state(&dfu, STATE_DFU_ERROR);
 	return USBD_REQ_NOTSUPP;
 }
+
+int stfub_dfu_handle_control_request(usbd_device *udbddev, struct usb_setup_data *req, u8 **buf,
+				     u16 *len, void (**complete)(usbd_device *udbddev, struct usb_setup_data *req))
+{
+	int ret;
+
+	if ((req->bmRequestType & 0x7F) != 0x21)
+		return USBD_REQ_NOTSUPP; /* Only accept class request. */
+
+	stfub_trace(STFUB_TRACE_REQUEST, req->bRequest << 16 | req->wValue);
+
+	if (!stfub_stats.boot.first_request)
+		stfub_stats.boot.first_request = stfub_dwt_cycles();
+	if (req->bRequest < STFUB_STATISTICS_REQUESTS)
+		stfub_stats.requests[req->bRequest]++;
+
+	ret = stfub_dfu_process_control_request(req, buf, len, complete);
+	if (ret == USBD_REQ_NOTSUPP)
+		stfub_stats.stalls++;
+
+	return ret;
+}
@@ -23,15 +23,44 @@
 #ifndef __DFU_DEVICE_H__
 #define __DFU_DEVICE_H__
 
+#include <stdbool.h>
+
 #include <libopencm3/usb/dfu.h>
 #include <libopencm3/usb/usbd.h>
 
 #include "printf.h"
 
+/*
+   wTransferSize. It does not have to match the flash geometry, sectors
+   are erased as the data reaches them whatever their size.
+ */
+#define STFUB_DFU_TRANSFER_SIZE		2048
+
+/* Interfaces of the optional functions follow DFU in the order below */
+#define STFUB_DFU_INTERFACE_NUMBER	0
+#ifdef STFUB_BULK
+#define STFUB_BULK_INTERFACE_NUMBER	(STFUB_DFU_INTERFACE_NUMBER + 1)
+#define STFUB_CDC_COMM_INTERFACE_NUMBER	(STFUB_BULK_INTERFACE_NUMBER + 1)
+#else
+#define STFUB_CDC_COMM_INTERFACE_NUMBER	(STFUB_DFU_INTERFACE_NUMBER + 1)
+#endif
+#define STFUB_CDC_DATA_INTERFACE_NUMBER	(STFUB_CDC_COMM_INTERFACE_NUMBER + 1)
+
 enum stfub_memory_region_altsetting {
 	STFUB_AS_MAIN_MEMORY = 0,
 	STFUB_AS_SYSTEM_MEMORY,
 	STFUB_AS_OPTION_BYTES,
+	STFUB_AS_WEAR_COUNTERS,
+	STFUB_AS_STATISTICS,
+	STFUB_AS_RAM,
+	STFUB_AS_FAULT_RECORD,
+	STFUB_AS_VERIFY,
+	STFUB_AS_RAW_FIRMWARE,
+#ifdef STFUB_RLE
+	STFUB_AS_MAIN_MEMORY_RLE,
+#endif
+
+	STFUB_AS_NUM
 };
 
 int stfub_dfu_handle_control_request(usbd_device *udbddev,
@@ -42,5 +71,16 @@ int stfub_dfu_handle_control_request(usbd_device *udbddev,
 void stfub_dfu_tick(void);
 void stfub_dfu_init(const struct usb_dfu_descriptor *descr);
 void stfub_dfu_switch_altsetting(usbd_device *usbd_dev, u16 interface, u16 altsetting);
+void *stfub_dfu_exit_requested(void);
+bool stfub_dfu_busy(void);
+void stfub_dfu_bus_reset(void);
+void stfub_dfu_bank_range(u16 altsetting, u32 *start, u32 *end);
+
+int stfub_dfu_stream_begin(u16 altsetting);
+int stfub_dfu_stream_write(u16 block_no, const u8 *buf, int len);
+int stfub_dfu_stream_end(void);
+int stfub_dfu_stream_poll(void);
+enum dfu_status stfub_dfu_stream_status(void);
+void stfub_dfu_stream_abort(void);
 
 #endif
@@ -0,0 +1,73 @@
+/*
+ * This file is part of the stfuboot project.
+ *
+ * Copyright (C) 2012 Innovative Converged Devices (ICD)
+ *
+ * Author(s):
+ *          Andrey Smirnov <andrey.smirnov@convergeddevices.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __DWT_H__
+#define __DWT_H__
+
+#include <libopencm3/cm3/common.h>
+
+/*
+   The DWT cycle counter, used for timing. The version of libopencm3
+   used here has no definitions for it.
+ */
+#define STFUB_DEMCR		MMIO32(0xE000EDFC)
+#define STFUB_DEMCR_TRCENA	(1 << 24)
+
+#define STFUB_DWT_CTRL		MMIO32(0xE0001000)
+#define STFUB_DWT_CTRL_CYCCNTENA (1 << 0)
+#define STFUB_DWT_CYCCNT	MMIO32(0xE0001004)
+
+/* The bootloader always runs at 48MHz */
+#define STFUB_DWT_CYCLES_PER_MS	48000
+
+#ifdef STFUB_HOST
+#include <time.h>
+
+/* tools/stfub-sim.c: the host clock, counted as the core would */
+static inline void stfub_dwt_enable(void)
+{
+}
+
+static inline u32 stfub_dwt_cycles(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((u64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000) *
+		(STFUB_DWT_CYCLES_PER_MS / 1000);
+}
+#else
+static inline void stfub_dwt_enable(void)
+{
+	STFUB_DEMCR	|= STFUB_DEMCR_TRCENA;
+	STFUB_DWT_CYCCNT = 0;
+	STFUB_DWT_CTRL	|= STFUB_DWT_CTRL_CYCCNTENA;
+}
+
+static inline u32 stfub_dwt_cycles(void)
+{
+	return STFUB_DWT_CYCCNT;
+}
+#endif
+
+#endif	/* __DWT_H__ */
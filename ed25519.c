@@ -0,0 +1,747 @@
+/*
+ * This file is part of the stfuboot project.
+ *
+ * Copyright (C) 2012 Innovative Converged Devices (ICD)
+ *
+ * Author(s):
+ *          Andrey Smirnov <andrey.smirnov@convergeddevices.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Ed25519 signature verification (RFC 8032).
+ *
+ * Field elements are sixteen 16-bit limbs held in 64-bit integers, the
+ * same representation TweetNaCl uses: it keeps every product within a
+ * single SMLAL on Cortex-M3 and needs no carry tricks. Verification
+ * handles public data only, so instead of a constant time ladder the
+ * two scalar multiplications share one doubling chain (Straus), which
+ * halves the work.
+ *
+ * Signing is only built for the host tools.
+ */
+
+#include <string.h>
+
+#include "ed25519.h"
+
+typedef int64_t gf[16];
+typedef gf ge[4];		/* Extended coordinates X, Y, Z, T */
+
+static const gf gf0;
+static const gf gf1 = { 1 };
+
+/* d = -121665 / 121666 */
+static const gf ed_d = {
+	0x78a3, 0x1359, 0x4dca, 0x75eb, 0xd8ab, 0x4141, 0x0a4d, 0x0070,
+	0xe898, 0x7779, 0x4079, 0x8cc7, 0xfe73, 0x2b6f, 0x6cee, 0x5203,
+};
+
+static const gf ed_d2 = {
+	0xf159, 0x26b2, 0x9b94, 0xebd6, 0xb156, 0x8283, 0x149a, 0x00e0,
+	0xd130, 0xeef3, 0x80f2, 0x198e, 0xfce7, 0x56df, 0xd9dc, 0x2406,
+};
+
+/* Base point */
+static const gf ed_bx = {
+	0xd51a, 0x8f25, 0x2d60, 0xc956, 0xa7b2, 0x9525, 0xc760, 0x692c,
+	0xdc5c, 0xfdd6, 0xe231, 0xc0a4, 0x53fe, 0xcd6e, 0x36d3, 0x2169,
+};
+
+static const gf ed_by = {
+	0x6658, 0x6666, 0x6666, 0x6666, 0x6666, 0x6666, 0x6666, 0x6666,
+	0x6666, 0x6666, 0x6666, 0x6666, 0x6666, 0x6666, 0x6666, 0x6666,
+};
+
+/* sqrt(-1) */
+static const gf ed_i = {
+	0xa0b0, 0x4a0e, 0x1b27, 0xc4ee, 0xe478, 0xad2f, 0x1806, 0x2f43,
+	0xd7a7, 0x3dfb, 0x0099, 0x2b4d, 0xdf0b, 0x4fc1, 0x2480, 0x2b83,
+};
+
+/* Group order L, little-endian */
+static const uint8_t ed_l[32] = {
+	0xed, 0xd3, 0xf5, 0x5c, 0x1a, 0x63, 0x12, 0x58,
+	0xd6, 0x9c, 0xf7, 0xa2, 0xde, 0xf9, 0xde, 0x14,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x10,
+};
+
+/* SHA-512, only ever used on short messages here */
+
+struct sha512_ctx {
+	uint64_t state[8];
+	uint64_t length;
+	uint8_t  buf[128];
+};
+
+static const uint64_t sha512_k[80] = {
+	0x428a2f98d728ae22ULL, 0x7137449123ef65cdULL,
+	0xb5c0fbcfec4d3b2fULL, 0xe9b5dba58189dbbcULL,
+	0x3956c25bf348b538ULL, 0x59f111f1b605d019ULL,
+	0x923f82a4af194f9bULL, 0xab1c5ed5da6d8118ULL,
+	0xd807aa98a3030242ULL, 0x12835b0145706fbeULL,
+	0x243185be4ee4b28cULL, 0x550c7dc3d5ffb4e2ULL,
+	0x72be5d74f27b896fULL, 0x80deb1fe3b1696b1ULL,
+	0x9bdc06a725c71235ULL, 0xc19bf174cf692694ULL,
+	0xe49b69c19ef14ad2ULL, 0xefbe4786384f25e3ULL,
+	0x0fc19dc68b8cd5b5ULL, 0x240ca1cc77ac9c65ULL,
+	0x2de92c6f592b0275ULL, 0x4a7484aa6ea6e483ULL,
+	0x5cb0a9dcbd41fbd4ULL, 0x76f988da831153b5ULL,
+	0x983e5152ee66dfabULL, 0xa831c66d2db43210ULL,
+	0xb00327c898fb213fULL, 0xbf597fc7beef0ee4ULL,
+	0xc6e00bf33da88fc2ULL, 0xd5a79147930aa725ULL,
+	0x06ca6351e003826fULL, 0x142929670a0e6e70ULL,
+	0x27b70a8546d22ffcULL, 0x2e1b21385c26c926ULL,
+	0x4d2c6dfc5ac42aedULL, 0x53380d139d95b3dfULL,
+	0x650a73548baf63deULL, 0x766a0abb3c77b2a8ULL,
+	0x81c2c92e47edaee6ULL, 0x92722c851482353bULL,
+	0xa2bfe8a14cf10364ULL, 0xa81a664bbc423001ULL,
+	0xc24b8b70d0f89791ULL, 0xc76c51a30654be30ULL,
+	0xd192e819d6ef5218ULL, 0xd69906245565a910ULL,
+	0xf40e35855771202aULL, 0x106aa07032bbd1b8ULL,
+	0x19a4c116b8d2d0c8ULL, 0x1e376c085141ab53ULL,
+	0x2748774cdf8eeb99ULL, 0x34b0bcb5e19b48a8ULL,
+	0x391c0cb3c5c95a63ULL, 0x4ed8aa4ae3418acbULL,
+	0x5b9cca4f7763e373ULL, 0x682e6ff3d6b2b8a3ULL,
+	0x748f82ee5defb2fcULL, 0x78a5636f43172f60ULL,
+	0x84c87814a1f0ab72ULL, 0x8cc702081a6439ecULL,
+	0x90befffa23631e28ULL, 0xa4506cebde82bde9ULL,
+	0xbef9a3f7b2c67915ULL, 0xc67178f2e372532bULL,
+	0xca273eceea26619cULL, 0xd186b8c721c0c207ULL,
+	0xeada7dd6cde0eb1eULL, 0xf57d4f7fee6ed178ULL,
+	0x06f067aa72176fbaULL, 0x0a637dc5a2c898a6ULL,
+	0x113f9804bef90daeULL, 0x1b710b35131c471bULL,
+	0x28db77f523047d84ULL, 0x32caab7b40c72493ULL,
+	0x3c9ebe0a15c9bebcULL, 0x431d67c49c100d4cULL,
+	0x4cc5d4becb3e42b6ULL, 0x597f299cfc657e2aULL,
+	0x5fcb6fab3ad6faecULL, 0x6c44198c4a475817ULL,
+};
+
+#define ROTR64(x, n)	(((x) >> (n)) | ((x) << (64 - (n))))
+
+static uint64_t load_be64(const uint8_t *p)
+{
+	uint64_t v = 0;
+	int i;
+
+	for (i = 0; i < 8; i++)
+		v = (v << 8) | p[i];
+
+	return v;
+}
+
+static void store_be64(uint8_t *p, uint64_t v)
+{
+	int i;
+
+	for (i = 7; i >= 0; i--, v >>= 8)
+		p[i] = v;
+}
+
+static void sha512_transform(uint64_t *state, const uint8_t *block)
+{
+	uint64_t w[16], s[8], t1, t2;
+	int i, j;
+
+	for (j = 0; j < 8; j++)
+		s[j] = state[j];
+
+	for (i = 0; i < 80; i++) {
+		if (i < 16) {
+			w[i] = load_be64(block + 8 * i);
+		} else {
+			uint64_t w15 = w[(i - 15) & 15], w2 = w[(i - 2) & 15];
+
+			w[i & 15] += (ROTR64(w15, 1) ^ ROTR64(w15, 8) ^ (w15 >> 7)) +
+				     (ROTR64(w2, 19) ^ ROTR64(w2, 61) ^ (w2 >> 6)) +
+				     w[(i - 7) & 15];
+		}
+
+		t1 = s[7] + (ROTR64(s[4], 14) ^ ROTR64(s[4], 18) ^ ROTR64(s[4], 41)) +
+		     ((s[4] & s[5]) ^ (~s[4] & s[6])) + sha512_k[i] + w[i & 15];
+		t2 = (ROTR64(s[0], 28) ^ ROTR64(s[0], 34) ^ ROTR64(s[0], 39)) +
+		     ((s[0] & s[1]) ^ (s[0] & s[2]) ^ (s[1] & s[2]));
+
+		for (j = 7; j > 0; j--)
+			s[j] = s[j - 1];
+		s[4] += t1;
+		s[0]  = t1 + t2;
+	}
+
+	for (j = 0; j < 8; j++)
+		state[j] += s[j];
+}
+
+static void sha512_init(struct sha512_ctx *ctx)
+{
+	static const uint64_t iv[8] = {
+		0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL,
+		0x3c6ef372fe94f82bULL, 0xa54ff53a5f1d36f1ULL,
+		0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL,
+		0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL,
+	};
+
+	memcpy(ctx->state, iv, sizeof(iv));
+	ctx->length = 0;
+}
+
+static void sha512_update(struct sha512_ctx *ctx, const uint8_t *p, size_t len)
+{
+	while (len--) {
+		ctx->buf[ctx->length++ % 128] = *p++;
+		if (ctx->length % 128 == 0)
+			sha512_transform(ctx->state, ctx->buf);
+	}
+}
+
+static void sha512_final(struct sha512_ctx *ctx, uint8_t *digest)
+{
+	size_t used = ctx->length % 128;
+	uint64_t bits = ctx->length * 8;
+	int i;
+
+	ctx->buf[used++] = 0x80;
+	if (used > 112) {
+		memset(ctx->buf + used, 0, 128 - used);
+		sha512_transform(ctx->state, ctx->buf);
+		used = 0;
+	}
+
+	memset(ctx->buf + used, 0, 120 - used);
+	store_be64(ctx->buf + 120, bits);
+	sha512_transform(ctx->state, ctx->buf);
+
+	for (i = 0; i < 8; i++)
+		store_be64(digest + 8 * i, ctx->state[i]);
+}
+
+/* Arithmetic modulo p = 2^255 - 19 */
+
+static void fe_copy(gf o, const gf a)
+{
+	memcpy(o, a, sizeof(gf));
+}
+
+static void fe_carry(gf o)
+{
+	int64_t c;
+	int i;
+
+	for (i = 0; i < 16; i++) {
+		c = o[i] >> 16;
+		o[i] -= c * 65536;
+		if (i < 15)
+			o[i + 1] += c;
+		else
+			o[0] += 38 * c;	/* 2^256 = 38 (mod p) */
+	}
+}
+
+static void fe_add(gf o, const gf a, const gf b)
+{
+	int i;
+
+	for (i = 0; i < 16; i++)
+		o[i] = a[i] + b[i];
+}
+
+static void fe_sub(gf o, const gf a, const gf b)
+{
+	int i;
+
+	for (i = 0; i < 16; i++)
+		o[i] = a[i] - b[i];
+}
+
+static void fe_mul(gf o, const gf a, const gf b)
+{
+	int64_t t[31];
+	int i, j;
+
+	memset(t, 0, sizeof(t));
+
+	/* Limbs stay well within 32 bits, so each step is one SMLAL */
+	for (i = 0; i < 16; i++)
+		for (j = 0; j < 16; j++)
+			t[i + j] += (int64_t)(int32_t)a[i] * (int32_t)b[j];
+
+	for (i = 0; i < 15; i++)
+		t[i] += 38 * t[i + 16];
+
+	for (i = 0; i < 16; i++)
+		o[i] = t[i];
+
+	fe_carry(o);
+	fe_carry(o);
+}
+
+static void fe_sq(gf o, const gf a)
+{
+	fe_mul(o, a, a);
+}
+
+static void fe_invert(gf o, const gf x)
+{
+	gf c;
+	int i;
+
+	/* x^(p - 2) */
+	fe_copy(c, x);
+	for (i = 253; i >= 0; i--) {
+		fe_sq(c, c);
+		if (i != 2 && i != 4)
+			fe_mul(c, c, x);
+	}
+
+	fe_copy(o, c);
+}
+
+static void fe_pow2523(gf o, const gf x)
+{
+	gf c;
+	int i;
+
+	/* x^((p - 5) / 8) */
+	fe_copy(c, x);
+	for (i = 250; i >= 0; i--) {
+		fe_sq(c, c);
+		if (i != 1)
+			fe_mul(c, c, x);
+	}
+
+	fe_copy(o, c);
+}
+
+static void fe_pack(uint8_t *o, const gf n)
+{
+	gf t, m;
+	int i, j, borrow;
+
+	fe_copy(t, n);
+	fe_carry(t);
+	fe_carry(t);
+	fe_carry(t);
+
+	/* Subtract p at most twice to get the canonical value */
+	for (j = 0; j < 2; j++) {
+		m[0] = t[0] - 0xffed;
+		for (i = 1; i < 15; i++) {
+			m[i] = t[i] - 0xffff - ((m[i - 1] >> 16) & 1);
+			m[i - 1] &= 0xffff;
+		}
+		m[15] = t[15] - 0x7fff - ((m[14] >> 16) & 1);
+		m[14] &= 0xffff;
+
+		borrow = (m[15] >> 16) & 1;
+		if (!borrow)
+			fe_copy(t, m);
+	}
+
+	for (i = 0; i < 16; i++) {
+		o[2 * i]     = t[i] & 0xff;
+		o[2 * i + 1] = t[i] >> 8;
+	}
+}
+
+static void fe_unpack(gf o, const uint8_t *n)
+{
+	int i;
+
+	for (i = 0; i < 16; i++)
+		o[i] = n[2 * i] + ((int64_t)n[2 * i + 1] << 8);
+	o[15] &= 0x7fff;
+}
+
+static bool fe_equal(const gf a, const gf b)
+{
+	uint8_t pa[32], pb[32];
+
+	fe_pack(pa, a);
+	fe_pack(pb, b);
+
+	return !memcmp(pa, pb, sizeof(pa));
+}
+
+static int fe_parity(const gf a)
+{
+	uint8_t d[32];
+
+	fe_pack(d, a);
+
+	return d[0] & 1;
+}
+
+/* Group operations */
+
+/*
+ * p += q with the unified twisted Edwards addition formula, which is
+ * also valid for doubling. All inputs are read before p is written,
+ * so p and q may be the same point.
+ */
+static void ge_add(ge p, const ge q)
+{
+	gf a, b, c, d, t, e, f, g, h;
+
+	fe_sub(a, p[1], p[0]);
+	fe_sub(t, q[1], q[0]);
+	fe_mul(a, a, t);
+	fe_add(b, p[0], p[1]);
+	fe_add(t, q[0], q[1]);
+	fe_mul(b, b, t);
+	fe_mul(c, p[3], q[3]);
+	fe_mul(c, c, ed_d2);
+	fe_mul(d, p[2], q[2]);
+	fe_add(d, d, d);
+	fe_sub(e, b, a);
+	fe_sub(f, d, c);
+	fe_add(g, d, c);
+	fe_add(h, b, a);
+
+	fe_mul(p[0], e, f);
+	fe_mul(p[1], h, g);
+	fe_mul(p[2], g, f);
+	fe_mul(p[3], e, h);
+}
+
+static void ge_copy(ge o, const ge p)
+{
+	memcpy(o, p, sizeof(ge));
+}
+
+static void ge_identity(ge p)
+{
+	fe_copy(p[0], gf0);
+	fe_copy(p[1], gf1);
+	fe_copy(p[2], gf1);
+	fe_copy(p[3], gf0);
+}
+
+static void ge_base(ge p)
+{
+	fe_copy(p[0], ed_bx);
+	fe_copy(p[1], ed_by);
+	fe_copy(p[2], gf1);
+	fe_mul(p[3], ed_bx, ed_by);
+}
+
+static void ge_pack(uint8_t *r, const ge p)
+{
+	gf tx, ty, zi;
+
+	fe_invert(zi, p[2]);
+	fe_mul(tx, p[0], zi);
+	fe_mul(ty, p[1], zi);
+	fe_pack(r, ty);
+	r[31] ^= fe_parity(tx) << 7;
+}
+
+/* Decompress a point and negate it, as verification needs -A */
+static int ge_unpack_negate(ge r, const uint8_t *p)
+{
+	gf t, chk, num, den, den2, den4, den6;
+
+	fe_copy(r[2], gf1);
+	fe_unpack(r[1], p);
+	fe_sq(num, r[1]);
+	fe_mul(den, num, ed_d);
+	fe_sub(num, num, r[2]);
+	fe_add(den, r[2], den);
+
+	fe_sq(den2, den);
+	fe_sq(den4, den2);
+	fe_mul(den6, den4, den2);
+	fe_mul(t, den6, num);
+	fe_mul(t, t, den);
+
+	fe_pow2523(t, t);
+	fe_mul(t, t, num);
+	fe_mul(t, t, den);
+	fe_mul(t, t, den);
+	fe_mul(r[0], t, den);
+
+	fe_sq(chk, r[0]);
+	fe_mul(chk, chk, den);
+	if (!fe_equal(chk, num))
+		fe_mul(r[0], r[0], ed_i);
+
+	fe_sq(chk, r[0]);
+	fe_mul(chk, chk, den);
+	if (!fe_equal(chk, num))
+		return -1;
+
+	if (fe_parity(r[0]) == (p[31] >> 7))
+		fe_sub(r[0], gf0, r[0]);
+
+	fe_mul(r[3], r[0], r[1]);
+
+	return 0;
+}
+
+static int scalar_bit(const uint8_t *s, int i)
+{
+	return (s[i >> 3] >> (i & 7)) & 1;
+}
+
+/*
+   Rounds i down to i - n + 1 of r = [a]A + [b]B sharing a single chain
+   of doublings, sum being A + B. The rounds run from bit 255 down to bit
+   0, starting with r at the identity.
+ */
+static void ge_double_scalarmult_rounds(ge r, const uint8_t *a, const ge pa,
+					const uint8_t *b, const ge pb,
+					const ge sum, int i, int n)
+{
+	int ba, bb;
+
+	for (; n > 0; n--, i--) {
+		ge_add(r, r);
+
+		ba = scalar_bit(a, i);
+		bb = scalar_bit(b, i);
+
+		if (ba && bb)
+			ge_add(r, sum);
+		else if (ba)
+			ge_add(r, pa);
+		else if (bb)
+			ge_add(r, pb);
+	}
+}
+
+#ifdef STFUB_HOST
+static void ge_double_scalarmult(ge r, const uint8_t *a, const ge pa,
+				 const uint8_t *b, const ge pb)
+{
+	ge sum;
+
+	ge_copy(sum, pa);
+	ge_add(sum, pb);
+	ge_identity(r);
+
+	ge_double_scalarmult_rounds(r, a, pa, b, pb, sum,
+				    STFUB_ED25519_ROUNDS - 1,
+				    STFUB_ED25519_ROUNDS);
+}
+#endif
+
+/* Arithmetic modulo the group order L */
+
+static void sc_reduce_limbs(uint8_t *r, int64_t *x)
+{
+	int64_t carry;
+	int i, j;
+
+	for (i = 63; i >= 32; i--) {
+		carry = 0;
+		for (j = i - 32; j < i - 12; j++) {
+			x[j] += carry - 16 * x[i] * ed_l[j - (i - 32)];
+			carry = (x[j] + 128) >> 8;
+			x[j] -= carry * 256;
+		}
+		x[j] += carry;
+		x[i] = 0;
+	}
+
+	carry = 0;
+	for (j = 0; j < 32; j++) {
+		x[j] += carry - (x[31] >> 4) * ed_l[j];
+		carry = x[j] >> 8;
+		x[j] &= 255;
+	}
+
+	for (j = 0; j < 32; j++)
+		x[j] -= carry * ed_l[j];
+
+	for (i = 0; i < 32; i++) {
+		x[i + 1] += x[i] >> 8;
+		r[i] = x[i] & 255;
+	}
+}
+
+/* Reduce a 64 byte hash in place, the result is in its first half */
+static void sc_reduce(uint8_t *h)
+{
+	int64_t x[64];
+	int i;
+
+	for (i = 0; i < 64; i++)
+		x[i] = h[i];
+
+	memset(h, 0, 64);
+	sc_reduce_limbs(h, x);
+}
+
+static bool sc_is_canonical(const uint8_t *s)
+{
+	int i;
+
+	for (i = 31; i >= 0; i--) {
+		if (s[i] < ed_l[i])
+			return true;
+		if (s[i] > ed_l[i])
+			return false;
+	}
+
+	return false;
+}
+
+static void ed25519_challenge(uint8_t *h, const uint8_t *r,
+			      const uint8_t *public_key,
+			      const uint8_t *msg, size_t len)
+{
+	struct sha512_ctx ctx;
+
+	sha512_init(&ctx);
+	sha512_update(&ctx, r, 32);
+	sha512_update(&ctx, public_key, STFUB_ED25519_PUBLIC_KEY_SIZE);
+	sha512_update(&ctx, msg, len);
+	sha512_final(&ctx, h);
+
+	sc_reduce(h);
+}
+
+int stfub_ed25519_verify_start(struct stfub_ed25519_verify_ctx *ctx,
+			       const uint8_t *signature, const uint8_t *msg,
+			       size_t len, const uint8_t *public_key)
+{
+	uint8_t h[64];
+
+	if (!sc_is_canonical(signature + 32))
+		return -1;
+
+	if (ge_unpack_negate(ctx->a, public_key) < 0)
+		return -1;
+
+	ed25519_challenge(h, signature, public_key, msg, len);
+
+	/* R' = [h](-A) + [S]B has to match R */
+	memcpy(ctx->h, h, sizeof(ctx->h));
+	memcpy(ctx->s, signature + 32, sizeof(ctx->s));
+	memcpy(ctx->expected, signature, sizeof(ctx->expected));
+
+	ge_base(ctx->b);
+	ge_copy(ctx->sum, ctx->a);
+	ge_add(ctx->sum, ctx->b);
+	ge_identity(ctx->r);
+
+	ctx->rounds_left = STFUB_ED25519_ROUNDS;
+
+	return 0;
+}
+
+int stfub_ed25519_verify_continue(struct stfub_ed25519_verify_ctx *ctx,
+				  int rounds)
+{
+	uint8_t check[32];
+
+	if (rounds > ctx->rounds_left)
+		rounds = ctx->rounds_left;
+
+	ge_double_scalarmult_rounds(ctx->r, ctx->h, ctx->a, ctx->s, ctx->b,
+				    ctx->sum, ctx->rounds_left - 1, rounds);
+	ctx->rounds_left -= rounds;
+
+	if (ctx->rounds_left)
+		return 0;
+
+	ge_pack(check, ctx->r);
+
+	return memcmp(check, ctx->expected, sizeof(check)) ? -1 : 1;
+}
+
+bool stfub_ed25519_verify(const uint8_t *signature, const uint8_t *msg,
+			  size_t len, const uint8_t *public_key)
+{
+	struct stfub_ed25519_verify_ctx ctx;
+
+	if (stfub_ed25519_verify_start(&ctx, signature, msg, len,
+				       public_key) < 0)
+		return false;
+
+	return stfub_ed25519_verify_continue(&ctx, STFUB_ED25519_ROUNDS) > 0;
+}
+
+#ifdef STFUB_HOST
+
+static void ed25519_expand(uint8_t *d, const uint8_t *seed)
+{
+	struct sha512_ctx ctx;
+
+	sha512_init(&ctx);
+	sha512_update(&ctx, seed, STFUB_ED25519_SEED_SIZE);
+	sha512_final(&ctx, d);
+
+	d[0]  &= 248;
+	d[31] &= 127;
+	d[31] |= 64;
+}
+
+static void ge_scalarmult_base(ge r, const uint8_t *s)
+{
+	static const uint8_t zero[32];
+	ge b, identity;
+
+	ge_base(b);
+	ge_identity(identity);
+	ge_double_scalarmult(r, s, b, zero, identity);
+}
+
+void stfub_ed25519_public_key(uint8_t *public_key, const uint8_t *seed)
+{
+	uint8_t d[64];
+	ge p;
+
+	ed25519_expand(d, seed);
+	ge_scalarmult_base(p, d);
+	ge_pack(public_key, p);
+}
+
+void stfub_ed25519_sign(uint8_t *signature, const uint8_t *msg, size_t len,
+			const uint8_t *seed)
+{
+	uint8_t d[64], nonce[64], h[64], public_key[32];
+	struct sha512_ctx ctx;
+	int64_t x[64];
+	int i, j;
+	ge p;
+
+	ed25519_expand(d, seed);
+	ge_scalarmult_base(p, d);
+	ge_pack(public_key, p);
+
+	sha512_init(&ctx);
+	sha512_update(&ctx, d + 32, 32);
+	sha512_update(&ctx, msg, len);
+	sha512_final(&ctx, nonce);
+	sc_reduce(nonce);
+
+	ge_scalarmult_base(p, nonce);
+	ge_pack(signature, p);
+
+	ed25519_challenge(h, signature, public_key, msg, len);
+
+	/* S = r + h * a (mod L) */
+	memset(x, 0, sizeof(x));
+	for (i = 0; i < 32; i++)
+		x[i] = nonce[i];
+	for (i = 0; i < 32; i++)
+		for (j = 0; j < 32; j++)
+			x[i + j] += (int64_t)h[i] * d[j];
+
+	sc_reduce_limbs(signature + 32, x);
+}
+
+#endif	/* STFUB_HOST */
@@ -0,0 +1,73 @@
+/*
+ * This file is part of the stfuboot project.
+ *
+ * Copyright (C) 2012 Innovative Converged Devices (ICD)
+ *
+ * Author(s):
+ *          Andrey Smirnov <andrey.smirnov@convergeddevices.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __ED25519_H__
+#define __ED25519_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define STFUB_ED25519_PUBLIC_KEY_SIZE	32
+#define STFUB_ED25519_SEED_SIZE		32
+#define STFUB_ED25519_SIGNATURE_SIZE	64
+
+/* One round per bit of the scalars */
+#define STFUB_ED25519_ROUNDS		256
+
+/*
+   A verification split into rounds, for callers that cannot afford to
+   stop for the whole of it. _start() does the hashing and sets up the
+   points, every _continue() then runs at most the given number of
+   rounds.
+ */
+struct stfub_ed25519_verify_ctx {
+	int64_t a[4][16];
+	int64_t b[4][16];
+	int64_t sum[4][16];
+	int64_t r[4][16];
+	uint8_t h[32];
+	uint8_t s[32];
+	uint8_t expected[32];
+	int rounds_left;
+};
+
+/* Returns -1 if the signature or key is malformed */
+int stfub_ed25519_verify_start(struct stfub_ed25519_verify_ctx *ctx,
+			       const uint8_t *signature, const uint8_t *msg,
+			       size_t len, const uint8_t *public_key);
+/* Returns 0 while there are rounds left, then 1 if the signature is
+ * valid and -1 if it is not */
+int stfub_ed25519_verify_continue(struct stfub_ed25519_verify_ctx *ctx,
+				  int rounds);
+
+
+bool stfub_ed25519_verify(const uint8_t *signature, const uint8_t *msg,
+			  size_t len, const uint8_t *public_key);
+
+#ifdef STFUB_HOST
+void stfub_ed25519_public_key(uint8_t *public_key, const uint8_t *seed);
+void stfub_ed25519_sign(uint8_t *signature, const uint8_t *msg, size_t len,
+			const uint8_t *seed);
+#endif
+
+#endif	/* __ED25519_H__ */
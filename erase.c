@@ -0,0 +1,189 @@
+/*
+ * This file is part of the stfuboot project.
+ *
+ * Copyright (C) 2012 Innovative Converged Devices (ICD)
+ *
+ * Author(s):
+ *          Andrey Smirnov <andrey.smirnov@convergeddevices.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Erase planner.
+ *
+ * Erasing a page takes the same 20-40ms whatever else is going on, so
+ * a full image pays for every page of the application area one by one,
+ * about 118 of them on a 256K part. A mass erase clears the whole flash
+ * in a single such period, but takes the permanent handlers, the
+ * bootloader, the key slots and the wear log along with it; they are
+ * saved to the free RAM above the bootloader first and programmed back
+ * afterwards.
+ *
+ * The planner compares the two from the cycles the erases and writes
+ * since reset actually took (datasheet figures until there are any)
+ * and picks whichever is cheaper for the range about to be written.
+ * Losing power between the mass erase and the end of the restore
+ * leaves a part that only the factory bootloader or a debugger can
+ * recover, so the mass erase is only ever planned in builds with
+ * -DSTFUB_ALLOW_MASS_ERASE, meant for factory programming stations,
+ * and never while be_rom is write protected, which would leave the
+ * job half done.
+ */
+
+#include <string.h>
+
+#include <libopencm3/stm32/f1/flash.h>
+
+#include "dwt.h"
+#include "erase.h"
+#include "geometry.h"
+#include "reset.h"
+#include "stats.h"
+#include "wear.h"
+
+/* Worst case datasheet figures: tERASE, tME and tPROG */
+#define STFUB_ERASE_SECTOR_CYCLES	(40 * STFUB_DWT_CYCLES_PER_MS)
+#define STFUB_ERASE_MASS_CYCLES		(40 * STFUB_DWT_CYCLES_PER_MS)
+#define STFUB_ERASE_HALF_WORD_CYCLES	(70 * STFUB_DWT_CYCLES_PER_MS / 1000)
+
+extern unsigned _if_rom_start;
+extern unsigned _ri_ram_start, _ri_ram_end;
+
+/* Last mass erase and restore, they are not part of the statistics */
+static u32 stfub_erase_mass_measured;
+
+static bool stfub_erase_mass_forbidden;
+
+static u32 stfub_erase_sector_cycles(void)
+{
+	if (!stfub_stats.pages_erased)
+		return STFUB_ERASE_SECTOR_CYCLES;
+
+	return stfub_stats.erase_cycles / stfub_stats.pages_erased;
+}
+
+static u32 stfub_erase_half_word_cycles(void)
+{
+	if (stfub_stats.bytes_programmed < 2)
+		return STFUB_ERASE_HALF_WORD_CYCLES;
+
+	return stfub_stats.program_cycles / (stfub_stats.bytes_programmed / 2);
+}
+
+/* What a mass erase wipes besides the bank being downloaded */
+static u32 stfub_erase_saved_bytes(void)
+{
+	return ((u32)&_if_rom_start - STFUB_FLASH_BASE) +
+		(stfub_flash_end() - stfub_wear_log_start());
+}
+
+static bool stfub_erase_mass_is_possible(u32 start, u32 end)
+{
+#ifdef STFUB_ALLOW_MASS_ERASE
+	return !stfub_erase_mass_forbidden &&
+		!stfub_exception_handlers_pages_are_protected() &&
+		start == (u32)&_if_rom_start && end <= stfub_wear_log_start() &&
+		stfub_erase_saved_bytes() <=
+		(u32)&_ri_ram_end - (u32)&_ri_ram_start;
+#else
+	return false;
+#endif
+}
+
+static u32 stfub_erase_lazy_cycles(u32 start, u32 end)
+{
+	u32 sectors;
+
+	sectors = stfub_flash_sector_number(end - 1) -
+		stfub_flash_sector_number(start) + 1;
+
+	return sectors * stfub_erase_sector_cycles();
+}
+
+static u32 stfub_erase_mass_cycles(void)
+{
+	if (stfub_erase_mass_measured)
+		return stfub_erase_mass_measured;
+
+	return STFUB_ERASE_MASS_CYCLES +
+		stfub_erase_saved_bytes() / 2 * stfub_erase_half_word_cycles();
+}
+
+/* How to erase flash from start (a sector boundary) up to end */
+enum stfub_erase_strategy stfub_erase_plan(u32 start, u32 end)
+{
+	if (end <= start || !stfub_erase_mass_is_possible(start, end))
+		return STFUB_ERASE_LAZY;
+
+	if (stfub_erase_mass_cycles() < stfub_erase_lazy_cycles(start, end))
+		return STFUB_ERASE_MASS;
+
+	return STFUB_ERASE_LAZY;
+}
+
+/* Time a mass erase, restore included, is expected to take */
+u32 stfub_erase_mass_ms(void)
+{
+	return stfub_erase_mass_cycles() / STFUB_DWT_CYCLES_PER_MS + 1;
+}
+
+/*
+   Erase the whole flash, leaving everything but [start, wear log) the
+   way it was. Called with flash unlocked. Every page of the
+   application area counts as erased for the wear log, the statistics
+   only count pages erased one by one.
+ */
+int stfub_erase_mass(u32 start)
+{
+	u8 *save = (u8 *)&_ri_ram_start;
+	u32 log = stfub_wear_log_start();
+	u32 head = start - STFUB_FLASH_BASE;
+	u32 tail = stfub_flash_end() - log;
+	u32 address, cycles;
+	int ret = 0;
+
+	/* Write protection on be_rom gets in the way of the erase and
+	 * of the restore alike, better not to start */
+	if (stfub_exception_handlers_pages_are_protected())
+		return -1;
+
+	memcpy(save, (const void *)STFUB_FLASH_BASE, head);
+	memcpy(save + head, (const void *)log, tail);
+
+	cycles = stfub_dwt_cycles();
+	flash_erase_all_pages();
+	stfub_flash_program(STFUB_FLASH_BASE, save, head);
+	stfub_flash_program(log, save + head, tail);
+	stfub_erase_mass_measured = stfub_dwt_cycles() - cycles;
+
+	if (memcmp((const void *)STFUB_FLASH_BASE, save, head) ||
+	    memcmp((const void *)log, save + head, tail))
+		ret = -1;
+
+	for (address = start; address < log;
+	     address += stfub_flash_sector_size(address))
+		stfub_wear_record_erase(address);
+
+	return ret;
+}
+
+/*
+   Keep to sector erases until the next reset, for when the flash
+   outside of the download still holds something that is needed.
+ */
+void stfub_erase_forbid_mass(void)
+{
+	stfub_erase_mass_forbidden = true;
+}
@@ -0,0 +1,40 @@
+/*
+ * This file is part of the stfuboot project.
+ *
+ * Copyright (C) 2012 Innovative Converged Devices (ICD)
+ *
+ * Author(s):
+ *          Andrey Smirnov <andrey.smirnov@convergeddevices.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __ERASE_H__
+#define __ERASE_H__
+
+#include <libopencm3/cm3/common.h>
+
+enum stfub_erase_strategy {
+	/* Each sector as the data reaches it, see dfu.c */
+	STFUB_ERASE_LAZY,
+	/* Everything at once, what lies outside of the download restored */
+	STFUB_ERASE_MASS,
+};
+
+enum stfub_erase_strategy stfub_erase_plan(u32 start, u32 end);
+u32 stfub_erase_mass_ms(void);
+int stfub_erase_mass(u32 start);
+void stfub_erase_forbid_mass(void);
+
+#endif	/* __ERASE_H__ */
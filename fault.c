@@ -0,0 +1,86 @@
+/*
+ * This file is part of the stfuboot project.
+ *
+ * Copyright (C) 2012 Innovative Converged Devices (ICD)
+ *
+ * Author(s):
+ *          Andrey Smirnov <andrey.smirnov@convergeddevices.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Access to the fault record, see libstfub/fault.h. It is written by
+ * stfub_rom_record_fault() in reset.c.
+ */
+
+#include <stddef.h>
+#include <string.h>
+
+#include <libopencm3/stm32/crc.h>
+#include <libopencm3/stm32/f1/rcc.h>
+
+#include <libstfub/fault.h>
+#include <libstfub/handoff.h>
+
+#define STFUB_FAULT_CRC_WORDS						\
+	((sizeof(struct stfub_fault_record) - sizeof(uint32_t)) / 4)
+
+#define STR(x)		#x
+#define XSTR(x)		STR(x)
+
+extern unsigned _fault;
+
+/* The record, or NULL if there is none */
+const struct stfub_fault_record *stfub_fault_record(void)
+{
+	struct stfub_fault_record *record;
+
+	record = (struct stfub_fault_record *)&_fault;
+
+	if (record->magic != STFUB_FAULT_MAGIC)
+		return NULL;
+
+	rcc_peripheral_enable_clock(&RCC_AHBENR, RCC_AHBENR_CRCEN);
+	crc_reset();
+
+	if (crc_calculate_block((u32 *)record, STFUB_FAULT_CRC_WORDS) !=
+	    record->crc)
+		return NULL;
+
+	return record;
+}
+
+void stfub_fault_record_clear(void)
+{
+	memset(&_fault, 0, sizeof(struct stfub_fault_record));
+}
+
+/*
+   Jump to the handler in the handoff table with the registers and
+   stacks as the core left them on exception entry, which is why this
+   is naked and written in assembly.
+ */
+__attribute__ ((naked))
+void stfub_fault_handler(void)
+{
+	asm volatile ("ldr	r0, =" XSTR(STFUB_HANDOFF_TABLE_ADDRESS) "\n\t"
+		      "ldr	r1, [r0]		\n\t"
+		      "ldr	r2, =" XSTR(STFUB_HANDOFF_MAGIC) "\n\t"
+		      "cmp	r1, r2			\n\t"
+		      "bne	1f			\n\t"
+		      "ldr	r0, [r0, #8]		\n\t" /* fault */
+		      "bx	r0			\n\t"
+		      "1:	b	1b		\n\t");
+}
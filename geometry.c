@@ -0,0 +1,135 @@
+/*
+ * This file is part of the stfuboot project.
+ *
+ * Copyright (C) 2012 Innovative Converged Devices (ICD)
+ *
+ * Author(s):
+ *          Andrey Smirnov <andrey.smirnov@convergeddevices.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <libopencm3/stm32/desig.h>
+#include <libopencm3/stm32/f1/flash.h>
+
+#include "geometry.h"
+
+#define STFUB_FLASH_SIZE_KB	DESIG_FLASH_SIZE
+
+u32 stfub_flash_sector_number(u32 address)
+{
+	return (address - STFUB_FLASH_BASE) / STFUB_FLASH_PAGE_SIZE;
+}
+
+u32 stfub_flash_sector_start(u32 address)
+{
+	return address & ~(STFUB_FLASH_PAGE_SIZE - 1);
+}
+
+u32 stfub_flash_sector_size(u32 address)
+{
+	return STFUB_FLASH_PAGE_SIZE;
+}
+
+/* Called with flash unlocked, like stfub_flash_program() */
+enum stfub_flash_status stfub_flash_erase_sector(u32 address)
+{
+	u32 sr;
+
+	FLASH_SR = FLASH_PGERR | FLASH_WRPRTERR | FLASH_EOP;
+
+	flash_erase_page(address);
+
+	sr = FLASH_SR;
+	if (sr & FLASH_WRPRTERR)
+		return STFUB_FLASH_PROTECTED;
+	if (sr & FLASH_PGERR)
+		return STFUB_FLASH_NOT_ERASED;
+
+	return STFUB_FLASH_OK;
+}
+
+/* tERASE, the same for 1K and 2K pages */
+static u32 stfub_flash_sector_erase_ms(u32 size)
+{
+	return 40;
+}
+
+/*
+   Program len bytes (even, half-word aligned) with the flash unlocked.
+
+   flash_program_half_word() waits for BSY, sets PG, writes, waits
+   again and clears PG for every half-word. Here PG stays set for the
+   whole run, the loop only waits for BSY between writes, and the status
+   is checked once at the end: the error flags are sticky. Like the rest
+   of .text this runs from RAM, so polling BSY never stalls on a flash
+   read. Build with -DSTFUB_FLASH_PROGRAM_LIBOPENCM3 to go back to the
+   library loop and compare the cycle counts in the statistics.
+ */
+enum stfub_flash_status stfub_flash_program(u32 address, const void *data,
+					    u32 len)
+{
+	volatile u16 *dst = (volatile u16 *)address;
+	const u16 *src = data;
+	u32 sr;
+
+	while (FLASH_SR & FLASH_BSY)
+		;
+
+	FLASH_SR = FLASH_PGERR | FLASH_WRPRTERR | FLASH_EOP;
+
+#ifdef STFUB_FLASH_PROGRAM_LIBOPENCM3
+	for (; len; len -= 2)
+		flash_program_half_word((u32)dst++, *src++);
+#else
+	FLASH_CR |= FLASH_PG;
+
+	for (; len; len -= 2) {
+		*dst++ = *src++;
+		while (FLASH_SR & FLASH_BSY)
+			;
+	}
+
+	FLASH_CR &= ~FLASH_PG;
+#endif
+
+	sr = FLASH_SR;
+	if (sr & FLASH_WRPRTERR)
+		return STFUB_FLASH_PROTECTED;
+	if (sr & FLASH_PGERR)
+		return STFUB_FLASH_NOT_ERASED;
+
+	return STFUB_FLASH_OK;
+}
+
+u32 stfub_flash_end(void)
+{
+	return STFUB_FLASH_BASE + STFUB_FLASH_SIZE_KB * 1024;
+}
+
+/*
+   Longest it can take to erase every sector from the one at start up
+   to the one holding end - 1. Used to tell the host how long to wait
+   before polling again.
+ */
+u32 stfub_flash_erase_ms(u32 start, u32 end)
+{
+	u32 address, ms = 0;
+
+	for (address = stfub_flash_sector_start(start); address < end;
+	     address += stfub_flash_sector_size(address))
+		ms += stfub_flash_sector_erase_ms(stfub_flash_sector_size(address));
+
+	return ms;
+}
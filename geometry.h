@@ -0,0 +1,63 @@
+/*
+ * This file is part of the stfuboot project.
+ *
+ * Copyright (C) 2012 Innovative Converged Devices (ICD)
+ *
+ * Author(s):
+ *          Andrey Smirnov <andrey.smirnov@convergeddevices.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __GEOMETRY_H__
+#define __GEOMETRY_H__
+
+#include <libopencm3/cm3/common.h>
+
+/*
+   Flash geometry of the STM32F1 part the bootloader is built for. The
+   erase unit is called a sector throughout. Its size is chosen at build
+   time:
+
+     (default)              STM32F105/F107, high density F103: 2K pages
+     -DSTFUB_FLASH_F1_1K    low and medium density F103: 1K pages
+
+   while the size of the flash is read from the part itself.
+ */
+#define STFUB_FLASH_BASE	0x08000000
+
+#if defined(STFUB_FLASH_F1_1K)
+#define STFUB_FLASH_PAGE_SIZE	1024
+#else
+#define STFUB_FLASH_PAGE_SIZE	2048
+#endif
+
+enum stfub_flash_status {
+	STFUB_FLASH_OK = 0,
+	/* PGERR */
+	STFUB_FLASH_NOT_ERASED,
+	/* WRPRTERR */
+	STFUB_FLASH_PROTECTED,
+};
+
+u32 stfub_flash_end(void);
+u32 stfub_flash_sector_number(u32 address);
+u32 stfub_flash_sector_start(u32 address);
+u32 stfub_flash_sector_size(u32 address);
+enum stfub_flash_status stfub_flash_erase_sector(u32 address);
+u32 stfub_flash_erase_ms(u32 start, u32 end);
+enum stfub_flash_status stfub_flash_program(u32 address, const void *data,
+					    u32 len);
+
+#endif	/* __GEOMETRY_H__ */
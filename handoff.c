@@ -0,0 +1,69 @@
+/*
+ * This file is part of the stfuboot project.
+ *
+ * Copyright (C) 2012 Innovative Converged Devices (ICD)
+ *
+ * Author(s):
+ *          Andrey Smirnov <andrey.smirnov@convergeddevices.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Application side of the warm handoff, see libstfub/handoff.h.
+ */
+
+#include <libopencm3/cm3/nvic.h>
+#include <libopencm3/cm3/scb.h>
+#include <libopencm3/cm3/systick.h>
+
+#include <libstfub/handoff.h>
+#include <libstfub/scratch.h>
+
+/* Interrupt lines of the connectivity line parts, rounded up */
+#define STFUB_HANDOFF_NVIC_REGS		3
+
+void stfub_handoff_to_bootloader(uint8_t flags)
+{
+	const struct stfub_handoff_table *table;
+	int i;
+
+	table = (const struct stfub_handoff_table *)STFUB_HANDOFF_TABLE_ADDRESS;
+
+	/* Nothing the application set up may fire once the bootloader
+	 * owns the vector table */
+	asm volatile ("cpsid i");
+
+	systick_interrupt_disable();
+	systick_counter_disable();
+
+	for (i = 0; i < STFUB_HANDOFF_NVIC_REGS; i++) {
+		NVIC_ICER(i) = 0xffffffff;
+		NVIC_ICPR(i) = 0xffffffff;
+	}
+
+	if (table->magic != STFUB_HANDOFF_MAGIC) {
+		stfub_scratchpad_request_dfu_switch();
+		scb_reset_system();
+	}
+
+	stfub_scratchpad_request_handoff(flags);
+
+	asm volatile ("cpsie i");
+
+	table->enter();
+
+	for (;;)
+		asm volatile("nop");
+}
@@ -0,0 +1,63 @@
+#ifndef __LIBSTFUB_BULK_PROTOCOL_H__
+#define __LIBSTFUB_BULK_PROTOCOL_H__
+
+#include <stdint.h>
+
+/*
+   Bulk transfer mode, a faster alternative to DFU downloads that uses
+   the vendor specific interface 1 and its two bulk endpoints.
+
+   The host selects interface 1 (which resets any previous session) and
+   writes a START request to the OUT endpoint. The device answers with a
+   READY reply on the IN endpoint, after which the host sends the image
+   as a plain byte stream of the announced length. The stream is cut
+   into STFUB_BULK_BLOCK_SIZE blocks, each of them is handed to the same
+   code that programs DFU downloads, and committed blocks are
+   acknowledged with ACK replies. Every reply carries the number of
+   blocks committed so far, so acknowledgements are cumulative: one ACK
+   may stand for several blocks, and the host must not have more than
+   `window` blocks past that count in flight. Replies arrive in the
+   order they were made, none but superseded ACKs are ever dropped.
+   Once the last block is programmed the image is manifested and a DONE
+   reply reports the final DFU status code.
+
+   The window only saves the round trip between blocks. The device
+   programs flash and serves USB from one loop, so while a block is
+   being written the transfer of the next one stalls after a packet.
+
+   Any reply with a non-zero status ends the session; the host has to
+   select interface 1 again before it can start a new one.
+ */
+#define STFUB_BULK_MAGIC	0x42465453	/* "STFB" */
+#define STFUB_BULK_BLOCK_SIZE	2048
+#define STFUB_BULK_PACKET_SIZE	64
+
+enum stfub_bulk_opcode {
+	STFUB_BULK_START = 1,
+};
+
+enum stfub_bulk_reply_type {
+	STFUB_BULK_READY = 1,
+	STFUB_BULK_ACK,
+	STFUB_BULK_DONE,
+};
+
+struct stfub_bulk_request {
+	uint32_t magic;
+	uint8_t  opcode;
+	uint8_t  altsetting;	/* memory bank, as with DFU */
+	uint16_t __reserved;
+	uint32_t length;	/* bytes that follow the request */
+	uint32_t __reserved2;
+} __attribute__((packed));
+
+struct stfub_bulk_reply {
+	uint32_t magic;
+	uint8_t  type;
+	uint8_t  status;	/* enum dfu_status */
+	uint16_t window;	/* blocks the host may have in flight */
+	uint32_t blocks;	/* blocks committed to flash so far */
+	uint32_t __reserved;
+} __attribute__((packed));
+
+#endif	/* __LIBSTFUB_BULK_PROTOCOL_H__ */
@@ -0,0 +1,61 @@
+#ifndef __LIBSTFUB_FAULT_H__
+#define __LIBSTFUB_FAULT_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+   Record of the last HardFault, MemManage, BusFault or UsageFault.
+
+   The bootloader's fault handler fills it in before it retreats to the
+   factory DFU, in 256 bytes of RAM right below the scratchpad that no
+   one initializes, so it survives the resets that follow. Applications
+   must keep the top STFUB_FAULT_RESERVED_SIZE bytes of RAM out of their
+   linker script as they do with the scratchpad.
+
+   The handler is published in the handoff table (see handoff.h), so it
+   is the one of the bootloader that is installed now. Applications put
+   stfub_fault_handler() into their fault vectors, it passes the fault
+   on as it was taken. With a bootloader that publishes no handler it
+   stops right there.
+
+   It can be uploaded from the "Fault Record" altsetting of the
+   bootloader (and decoded with "stfub-image fault"), or read by the
+   application with the functions below (fault.c). Like the scratchpad
+   it is protected by a CRC over every word that precedes the crc field,
+   computed the way the STM32 CRC unit does.
+ */
+#define STFUB_FAULT_MAGIC		0x544c4146	/* "FALT" */
+#define STFUB_FAULT_STACK_WORDS		46
+/* Fault record and scratchpad */
+#define STFUB_FAULT_RESERVED_SIZE	(256 + 32)
+
+struct stfub_fault_record {
+	uint32_t magic;
+	uint32_t count;		/* faults since the record was cleared */
+	uint32_t exception;	/* 3 HardFault, 4 MemManage, 5 BusFault,
+				 * 6 UsageFault */
+	uint32_t exc_return;	/* LR on entry to the handler */
+	uint32_t sp;		/* before the exception */
+
+	uint32_t cfsr;
+	uint32_t hfsr;
+	uint32_t mmfar;
+	uint32_t bfar;
+
+	/* Pushed by the core on exception entry */
+	struct {
+		uint32_t r0, r1, r2, r3, r12, lr, pc, xpsr;
+	} frame;
+
+	/* Words above the frame, as far as RAM goes; the rest is 0 */
+	uint32_t stack[STFUB_FAULT_STACK_WORDS];
+
+	uint32_t crc;
+} __attribute__((packed));
+
+const struct stfub_fault_record *stfub_fault_record(void);
+void stfub_fault_record_clear(void);
+void stfub_fault_handler(void);
+
+#endif	/* __LIBSTFUB_FAULT_H__ */
@@ -0,0 +1,53 @@
+#ifndef __LIBSTFUB_HANDOFF_H__
+#define __LIBSTFUB_HANDOFF_H__
+
+#include <stdint.h>
+
+/*
+   Warm handoff from a running application to the bootloader.
+
+   stfub_handoff_to_bootloader() masks every interrupt, stops SysTick,
+   records the request in the scratchpad and jumps straight to the
+   entry point published in the handoff table at the start of the
+   bootloader ROM. There is no system reset, the bootloader does not
+   verify the application and only copies its own code to RAM before
+   it starts, so it is listening for DFU requests a few milliseconds
+   after the call.
+
+   STFUB_HANDOFF_KEEP_CLOCKS: the application runs from the PLL at
+   48MHz (as set up by rcc_clock_setup_in_hsi_out_48mhz()) and the
+   bootloader should keep that clock tree instead of bringing it up
+   again. It is ignored if the PLL is not the system clock.
+
+   STFUB_HANDOFF_KEEP_USB: do not reset the OTG core, so the D+ pull-up
+   stays on and the device does not drop off the bus. This is meant for
+   applications implementing the DFU run-time interface: after
+   DFU_DETACH the host resets the bus and the bootloader answers the
+   enumeration that follows. Without the flag the core is reset and the
+   host sees a disconnect followed by a fresh device.
+
+   The function has to be called from thread mode, not from an
+   interrupt handler.
+
+   A bootloader that predates the handoff table does not have the magic
+   in place, in that case the function falls back to requesting a DFU
+   switch and resetting the system.
+
+   scratchpad.c and handoff.c have to be linked into the application.
+ */
+#define STFUB_HANDOFF_KEEP_CLOCKS	(1 << 0)
+#define STFUB_HANDOFF_KEEP_USB		(1 << 1)
+
+#define STFUB_HANDOFF_MAGIC		0x4f444e48	/* "HNDO" */
+#define STFUB_HANDOFF_TABLE_ADDRESS	0x08001000
+
+struct stfub_handoff_table {
+	uint32_t magic;
+	void (*enter)(void);
+	/* Records a fault and retreats to the factory DFU, see fault.h */
+	void (*fault)(void);
+};
+
+void stfub_handoff_to_bootloader(uint8_t flags) __attribute__((noreturn));
+
+#endif	/* __LIBSTFUB_HANDOFF_H__ */
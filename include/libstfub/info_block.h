@@ -3,15 +3,36 @@
 
 #include <stdint.h>
 
+/* Firmware past the info block is encrypted with AES-128-CTR */
+#define STFUB_FW_ENCRYPTED	(1 << 0)
+/* signature.digest is the SHA-256 of the (plaintext) firmware and
+ * signature.value its Ed25519 signature */
+#define STFUB_FW_SIGNED		(1 << 1)
+
 /* Total size is 512 */
 struct stfub_firmware_info {
 	uint32_t size;
-	uint8_t  __reserved[500];
+	uint32_t flags;
+	struct {
+		uint8_t  key_slot;
+		uint8_t  __reserved[3];
+		uint8_t  nonce[12];
+	} cipher;
+	struct {
+		uint8_t  key_slot;
+		uint8_t  __reserved[3];
+		uint8_t  digest[32];
+		uint8_t  value[64];
+	} signature;
+	uint8_t  __reserved[380];
 	struct {
 		uint32_t firmware;
 		uint32_t info_block;
 	} crc;
 } __attribute__((packed));
 
+/* crc.info_block covers every word of the info block that precedes it */
+#define STFUB_INFO_BLOCK_CRC_WORDS				\
+	((sizeof(struct stfub_firmware_info) - sizeof(uint32_t)) / 4)
 
 #endif	/* __LIBSTFUB_INFO_BLOCK_H__ */
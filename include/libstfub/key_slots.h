@@ -0,0 +1,19 @@
+#ifndef __LIBSTFUB_KEY_SLOTS_H__
+#define __LIBSTFUB_KEY_SLOTS_H__
+
+#include <stdint.h>
+
+/*
+   Key slots occupy the last page of the bootloader area (ky_rom) and
+   are provisioned separately from the bootloader image. A slot that
+   reads as erased flash is unused.
+ */
+#define STFUB_KEY_SLOT_COUNT	4
+
+struct stfub_key_slot {
+	uint8_t aes[16];	/* image decryption key */
+	uint8_t ed25519[32];	/* image signing public key */
+	uint8_t __reserved[16];
+} __attribute__((packed));
+
+#endif	/* __LIBSTFUB_KEY_SLOTS_H__ */
@@ -0,0 +1,34 @@
+#ifndef __LIBSTFUB_RLE_H__
+#define __LIBSTFUB_RLE_H__
+
+#include <stdint.h>
+
+/*
+   Run-length encoded uploads from the "Main Memory (RLE)" altsetting.
+
+   The stream starts with a struct stfub_rle_header, then records
+   follow until `length` bytes are described. The memory is encoded as
+   32-bit little-endian words, each record starts with a 16-bit
+   little-endian control word:
+
+     0x0000 - 0x7FFF  literal: (control + 1) words follow as they are
+     0x8000 - 0xFFFF  run: one word follows, repeated
+                      ((control & 0x7FFF) + 1) times
+
+   so 128K of erased flash takes 6 bytes. Records may be split across
+   DFU transfers, the stream has to be decoded as a whole.
+ */
+#define STFUB_RLE_MAGIC		0x31454C52	/* "RLE1" */
+
+#define STFUB_RLE_RUN		0x8000
+#define STFUB_RLE_MAX_WORDS	0x8000
+/* Shorter runs are cheaper as part of a literal */
+#define STFUB_RLE_MIN_RUN	3
+
+struct stfub_rle_header {
+	uint32_t magic;
+	uint32_t start;		/* address of the first byte */
+	uint32_t length;	/* bytes once decoded */
+} __attribute__((packed));
+
+#endif	/* __LIBSTFUB_RLE_H__ */
@@ -1,9 +1,30 @@
 #ifndef __LIBSTFUB_SCRATCH_H__
 #define __LIBSTFUB_SCRATCH_H__
 
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+   Record shared between the application and the bootloader in the
+   last 32 bytes of RAM, which neither of them initializes. The CRC
+   covers every word that precedes it and is what tells a request
+   apart from whatever the RAM held after power-up.
+ */
+struct stfub_scratchpad {
+	uint8_t  boot_to_dfu;
+	uint8_t  handoff_flags;	/* STFUB_HANDOFF_*, see handoff.h */
+	uint8_t  install_staged;	/* see staging.h */
+	uint8_t  __reserved[25];
+	uint32_t crc;
+} __attribute__ ((packed));
+
 bool stfub_scratchpad_is_valid(void);
 bool stfub_scratchpad_dfu_switch_requested(void);
 void stfub_scratchpad_request_dfu_switch(void);
+void stfub_scratchpad_request_handoff(uint8_t flags);
+uint8_t stfub_scratchpad_handoff_flags(void);
+bool stfub_scratchpad_staged_update_requested(void);
+void stfub_scratchpad_request_staged_update(void);
 void stfub_scratchpad_init(void);
 
 #endif	/* __LIBSTFUB_SCRATCH_H__ */
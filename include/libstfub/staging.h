@@ -0,0 +1,75 @@
+#ifndef __LIBSTFUB_STAGING_H__
+#define __LIBSTFUB_STAGING_H__
+
+#include <stdint.h>
+
+/*
+   Updates staged by the application, for devices that get their
+   firmware over some other transport than USB.
+
+   The application receives a prepared image (the output of
+   "stfub-image pack", info block included) by its own means and hands
+   it to stfub_staging_write() in pieces of any size, in order. The
+   image goes to the staging area in the upper part of the application
+   ROM, which is erased sector by sector as the data reaches it.
+   stfub_staging_finish() checks the info block and, unless the image
+   is encrypted, the CRC of the firmware before it asks the bootloader
+   to install the image; the request is carried out at the next reset:
+
+     stfub_staging_begin(length);
+     while (...)
+             stfub_staging_write(buf, len);
+     if (stfub_staging_finish() == STFUB_STAGING_OK)
+             scb_reset_system();
+
+   The bootloader programs the staged image into place the same way it
+   would a DFU download, decrypting it and checking its signature as
+   needed, then resets again to start whatever firmware is valid. Once
+   the image is installed the bootloader zeroes the CRC of the staged
+   info block, the copy is no longer taken for an image to install.
+
+   The request does not survive a power loss, the staged copy does:
+   whenever the bootloader finds no valid firmware at reset and the
+   staging area holds an image with a good info block, it installs that
+   image again. This finishes an install that was cut short. An image
+   that fails to install this way leaves the bootloader in DFU mode
+   until the next reset. A staged image that did get installed is not
+   installed again, a later DFU download that is interrupted leaves the
+   bootloader in DFU mode rather than rolling back to it.
+
+   An application using this has to fit below STFUB_STAGING_START,
+   which is also the limit on the size of the images it can stage.
+   Flash is not readable while a sector is being erased, code running
+   from it (interrupt handlers included) stalls for the 20-40ms that
+   takes.
+
+   scratchpad.c, staging.c and geometry.c have to be linked into the
+   application. The addresses below come from the layout the bootloader
+   was linked with, the application's linker script has to INCLUDE the
+   same stfub-mem-layout*.ld.
+ */
+extern unsigned _ap_rom_start, _staging_start, _staging_end;
+
+#define STFUB_STAGING_AP_ROM_START	((uint32_t)&_ap_rom_start)
+#define STFUB_STAGING_START		((uint32_t)&_staging_start)
+#define STFUB_STAGING_END		((uint32_t)&_staging_end)
+
+#define STFUB_STAGING_MAX_FIRMWARE	\
+	(STFUB_STAGING_START - STFUB_STAGING_AP_ROM_START)
+
+enum stfub_staging_status {
+	STFUB_STAGING_OK = 0,
+	/* More than the announced length, or a firmware that would
+	 * not fit below the staging area */
+	STFUB_STAGING_TOO_LARGE,
+	/* Programming or erasing the staging area failed */
+	STFUB_STAGING_FLASH_ERROR,
+	/* Short image, bad info block or firmware CRC */
+	STFUB_STAGING_BAD_IMAGE,
+};
+
+enum stfub_staging_status stfub_staging_begin(uint32_t length);
+enum stfub_staging_status stfub_staging_write(const void *data, uint32_t len);
+enum stfub_staging_status stfub_staging_finish(void);
+
+#endif	/* __LIBSTFUB_STAGING_H__ */
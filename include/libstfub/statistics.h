@@ -0,0 +1,37 @@
+#ifndef __LIBSTFUB_STATISTICS_H__
+#define __LIBSTFUB_STATISTICS_H__
+
+#include <stdint.h>
+
+/*
+   Counters returned by an upload from the "Statistics" altsetting.
+   They count from the last reset; times are in CPU cycles.
+ */
+#define STFUB_STATISTICS_MAGIC		0x54415453	/* "STAT" */
+#define STFUB_STATISTICS_REQUESTS	7	/* DFU_DETACH ... DFU_ABORT */
+
+struct stfub_statistics {
+	uint32_t magic;
+
+	uint32_t blocks_received;
+	uint32_t bytes_programmed;
+	uint32_t pages_erased;
+	uint32_t pages_skipped;		/* left alone, contents unchanged */
+	uint32_t erase_cycles;
+	uint32_t program_cycles;
+
+	uint32_t requests[STFUB_STATISTICS_REQUESTS];	/* by bRequest */
+	uint32_t stalls;
+	uint32_t uart_drops;
+
+	/* Cycle counter readings since reset. The firmware check runs
+	 * at the reset clock, the rest at 48MHz */
+	struct {
+		uint32_t firmware_check;	/* duration */
+		uint32_t main;
+		uint32_t usb_ready;
+		uint32_t first_request;		/* first DFU request */
+	} boot;
+} __attribute__((packed));
+
+#endif	/* __LIBSTFUB_STATISTICS_H__ */
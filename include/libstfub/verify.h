@@ -0,0 +1,55 @@
+#ifndef __LIBSTFUB_VERIFY_H__
+#define __LIBSTFUB_VERIFY_H__
+
+#include <stdint.h>
+
+/*
+   Verification without reading the flash back, through the "Verify"
+   DFU altsetting.
+
+   The host downloads a query as block 0 and waits for the DNBUSY poll
+   timeout as with any other block, meanwhile the device runs every
+   sector of the range through the CRC unit. The host then sends
+   DFU_ABORT (the query is not a download, there is nothing to manifest)
+   and uploads the result.
+
+   A sector's CRC is the one the STM32 CRC unit gives for the words of
+   that sector alone, the same as tools/stm32-crc.c computes. Queries
+   that carry the expected CRC of every sector in the range also get
+   the number of sectors that differ; asking for STFUB_VERIFY_BITMAP
+   then returns just the bitmap of those sectors, a bit per sector,
+   instead of all the CRCs.
+ */
+#define STFUB_VERIFY_MAGIC	0x46495256	/* "VRIF" */
+
+/* So that a query and its result fit into a single DFU transfer */
+#define STFUB_VERIFY_MAX_SECTORS	504
+
+enum stfub_verify_reply {
+	STFUB_VERIFY_CRCS = 0,
+	STFUB_VERIFY_BITMAP,
+};
+
+struct stfub_verify_query {
+	uint32_t magic;
+	uint8_t  altsetting;	/* memory bank the range lies in */
+	uint8_t  reply;		/* enum stfub_verify_reply */
+	uint16_t count;		/* expected CRCs that follow, 0 or all */
+	uint32_t start;		/* sector aligned address */
+	uint32_t end;		/* exclusive */
+	uint32_t __reserved;
+	uint32_t expected[];
+} __attribute__((packed));
+
+struct stfub_verify_result {
+	uint32_t magic;
+	uint16_t sectors;	/* in the range */
+	uint16_t mismatches;	/* 0 unless expected CRCs were given */
+	uint32_t start;
+	uint32_t end;
+	/* sectors CRCs, or (sectors + 31) / 32 bitmap words, sector n
+	 * of the range is bit n % 32 of word n / 32 */
+	uint32_t data[];
+} __attribute__((packed));
+
+#endif	/* __LIBSTFUB_VERIFY_H__ */
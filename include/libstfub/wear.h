@@ -0,0 +1,23 @@
+#ifndef __LIBSTFUB_WEAR_H__
+#define __LIBSTFUB_WEAR_H__
+
+#include <stdint.h>
+
+/*
+   Erase counters of the info block and application pages, as returned
+   by an upload from the "Wear Counters" altsetting. erases[i] belongs
+   to the page at first_page + i * page_size.
+ */
+#define STFUB_WEAR_MAGIC	0x52414557	/* "WEAR" */
+#define STFUB_WEAR_MAX_PAGES	128
+
+struct stfub_wear_counters {
+	uint32_t magic;
+	uint32_t first_page;
+	uint16_t page_size;
+	uint16_t pages;
+	uint32_t compactions;	/* times the log has been rewritten */
+	uint32_t erases[STFUB_WEAR_MAX_PAGES];
+} __attribute__((packed));
+
+#endif	/* __LIBSTFUB_WEAR_H__ */
@@ -0,0 +1,130 @@
+/*
+ * This file is part of the stfuboot project.
+ *
+ * Copyright (C) 2012 Innovative Converged Devices (ICD)
+ *
+ * Author(s):
+ *          Andrey Smirnov <andrey.smirnov@convergeddevices.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Installation of an image the application has staged, see
+ * include/libstfub/staging.h.
+ *
+ * The staged image is fed to the same stream as a bulk download, so it
+ * gets the checks a download gets: the info block is parsed before
+ * anything is erased, the firmware is decrypted and hashed on its way
+ * to flash and the signature is checked at manifestation. Once the
+ * image is in, the CRC of the staged info block is programmed to zero
+ * so the copy is not taken for an install still to be finished.
+ */
+
+#include <libopencm3/stm32/f1/flash.h>
+
+#include <libstfub/info_block.h>
+#include <libstfub/staging.h>
+
+#include "crc.h"
+#include "dfu.h"
+#include "erase.h"
+#include "geometry.h"
+#include "install.h"
+#include "printf.h"
+
+#define MIN(a, b) ((a)<(b) ? (a) : (b))
+
+/*
+   Whether the staging area holds an image to install, which is all an
+   install cut short by a power loss leaves behind: the request went
+   with the scratchpad, and the firmware is half written.
+ */
+bool stfub_install_staged_image_is_present(void)
+{
+	const struct stfub_firmware_info *info;
+
+	info = (const struct stfub_firmware_info *)STFUB_STAGING_START;
+
+	return stfub_crc_block(info, STFUB_INFO_BLOCK_CRC_WORDS) ==
+		info->crc.info_block &&
+		info->size <= STFUB_STAGING_MAX_FIRMWARE;
+}
+
+/*
+   Zero can be programmed over any half-word without an erase, which
+   leaves the rest of the copy alone. Should it fail the copy stays
+   "present", which only matters once the firmware has gone bad.
+ */
+static void stfub_install_retire_staged_image(void)
+{
+	const struct stfub_firmware_info *info;
+	static const u32 zero;
+
+	info = (const struct stfub_firmware_info *)STFUB_STAGING_START;
+
+	flash_unlock();
+	stfub_flash_program((u32)&info->crc.info_block, &zero, sizeof(zero));
+	flash_lock();
+}
+
+/* Returns 0 once the image is installed */
+int stfub_install_staged_image(void)
+{
+	const u8 *image = (const u8 *)STFUB_STAGING_START;
+	const struct stfub_firmware_info *info;
+	u32 offset, length;
+	u16 block_no;
+	int len, ret;
+
+	info = (const struct stfub_firmware_info *)image;
+
+	/* The firmware may not reach into the copy it is made from, the
+	 * info block itself is checked by the DFU code */
+	if (info->size > STFUB_STAGING_MAX_FIRMWARE)
+		return -1;
+
+	length = sizeof(*info) + info->size;
+
+	/* A mass erase would take the staging area along */
+	stfub_erase_forbid_mass();
+
+	if (stfub_dfu_stream_begin(STFUB_AS_MAIN_MEMORY) < 0)
+		return -1;
+
+	for (offset = 0, block_no = 0; offset < length;
+	     offset += len, block_no++) {
+		len = MIN(STFUB_DFU_TRANSFER_SIZE, length - offset);
+
+		if (stfub_dfu_stream_write(block_no, image + offset, len) < 0)
+			goto failed;
+	}
+
+	if (stfub_dfu_stream_end() < 0)
+		goto failed;
+
+	while (!(ret = stfub_dfu_stream_poll()))
+		stfub_dfu_tick();
+
+	if (ret < 0)
+		goto failed;
+
+	stfub_install_retire_staged_image();
+	return 0;
+
+failed:
+	stfub_printf("staged image rejected: %d\n", stfub_dfu_stream_status());
+	stfub_dfu_stream_abort();
+	return -1;
+}
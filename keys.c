@@ -0,0 +1,70 @@
+/*
+ * This file is part of the stfuboot project.
+ *
+ * Copyright (C) 2012 Innovative Converged Devices (ICD)
+ *
+ * Author(s):
+ *          Andrey Smirnov <andrey.smirnov@convergeddevices.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "keys.h"
+
+extern unsigned _ky_rom_start;
+
+static bool stfub_key_is_erased(const uint8_t *key, unsigned int len)
+{
+	while (len--)
+		if (*key++ != 0xFF)
+			return false;
+
+	return true;
+}
+
+static const struct stfub_key_slot *stfub_key_slot_get(unsigned int slot)
+{
+	const struct stfub_key_slot *slots;
+
+	slots = (const struct stfub_key_slot *)&_ky_rom_start;
+
+	return slot < STFUB_KEY_SLOT_COUNT ? &slots[slot] : NULL;
+}
+
+/*
+   Lookups may happen before .data and .bss are set up (verified boot
+   runs from the reset handler), so nothing here may rely on them.
+ */
+const uint8_t *stfub_key_slot_aes(unsigned int slot)
+{
+	const struct stfub_key_slot *key = stfub_key_slot_get(slot);
+
+	if (!key || stfub_key_is_erased(key->aes, sizeof(key->aes)))
+		return NULL;
+
+	return key->aes;
+}
+
+const uint8_t *stfub_key_slot_ed25519(unsigned int slot)
+{
+	const struct stfub_key_slot *key = stfub_key_slot_get(slot);
+
+	if (!key || stfub_key_is_erased(key->ed25519, sizeof(key->ed25519)))
+		return NULL;
+
+	return key->ed25519;
+}
@@ -0,0 +1,45 @@
+/*
+ * This file is part of the stfuboot project.
+ *
+ * Copyright (C) 2012 Innovative Converged Devices (ICD)
+ *
+ * Author(s):
+ *          Andrey Smirnov <andrey.smirnov@convergeddevices.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __KEYS_H__
+#define __KEYS_H__
+
+#include <libstfub/key_slots.h>
+
+/*
+   An image started straight after manifestation never sees the reset
+   handler, so verified boot is only worth anything if manifestation
+   refuses unsigned images too.
+ */
+#if (defined(STFUB_VERIFIED_BOOT) || defined(STFUB_REQUIRE_SIGNED_IMAGES)) && \
+	!defined(STFUB_CRYPTO)
+#error "signed images need a build with STFUB_CRYPTO"
+#endif
+
+#if defined(STFUB_VERIFIED_BOOT) && !defined(STFUB_REQUIRE_SIGNED_IMAGES)
+#define STFUB_REQUIRE_SIGNED_IMAGES
+#endif
+
+const uint8_t *stfub_key_slot_aes(unsigned int slot);
+const uint8_t *stfub_key_slot_ed25519(unsigned int slot);
+
+#endif	/* __KEYS_H__ */
@@ -25,6 +25,7 @@
 #include <string.h>
 #include <alloca.h>
 
+#include <libopencm3/cm3/nvic.h>
 #include <libopencm3/cm3/scb.h>
 
 #include <libopencm3/stm32/f1/rcc.h>
@@ -35,24 +36,49 @@
 
 #include <libopencm3/stm32/crc.h>
 
+#include <libopencm3/usb/cdc.h>
 #include <libopencm3/usb/usbd.h>
 
+#include <libstfub/bulk_protocol.h>
+#include <libstfub/handoff.h>
+#include <libstfub/scratch.h>
+
+#include "bulk.h"
+#include "cdc.h"
 #include "dfu.h"
+#include "dwt.h"
+#include "install.h"
+#include "reset.h"
+#include "stats.h"
+#include "timebase.h"
+#include "trace.h"
 #include "uart.h"
 #include "printf.h"
 
 #define MIN(a, b) ((a)<(b) ? (a) : (b))
 
+/*
+   With no USB activity for this long, and no transfer under way, the
+   bootloader resets to go back to the firmware, if the reset handler
+   found a valid one. 0, the default, turns this off: the bootloader
+   stays in DFU mode until told otherwise.
+ */
+#ifndef STFUB_IDLE_TIMEOUT_MS
+#define STFUB_IDLE_TIMEOUT_MS	0
+#endif
+
 /* We need a special large control buffer for this device: */
-u8 usbd_control_buffer[2048];
+u8 usbd_control_buffer[STFUB_DFU_TRANSFER_SIZE];
 
 const struct usb_device_descriptor stfub_dev_descr = {
 	.bLength		= USB_DT_DEVICE_SIZE,
 	.bDescriptorType	= USB_DT_DEVICE,
 	.bcdUSB			= 0x0200,
-	.bDeviceClass		= 0,
-	.bDeviceSubClass	= 0,
-	.bDeviceProtocol	= 0,
+	/* Composite device, the functions are described by interface
+	 * association descriptors */
+	.bDeviceClass		= 0xEF,
+	.bDeviceSubClass	= 2,
+	.bDeviceProtocol	= 1,
 	.bMaxPacketSize0	= 64,
 	.idVendor		= 0x0483,
 	.idProduct		= 0xDF11,
@@ -68,7 +94,7 @@ const struct usb_dfu_descriptor stfub_dfu_descr = {
 	.bDescriptorType	= DFU_FUNCTIONAL,
 	.bmAttributes		= USB_DFU_CAN_DOWNLOAD | USB_DFU_CAN_UPLOAD | USB_DFU_WILL_DETACH,
 	.wDetachTimeout		= 255,
-	.wTransferSize		= 2048, /* STM32 flash page size */
+	.wTransferSize		= STFUB_DFU_TRANSFER_SIZE,
 	.bcdDFUVersion		= 0x0110,
 };
 
@@ -92,20 +118,189 @@ const struct usb_interface_descriptor stfub_interface_descriptors[] ={
 		STFUB_DFU_INTERFACE(STFUB_AS_MAIN_MEMORY, stfub_dfu_descr),
 		STFUB_DFU_INTERFACE(STFUB_AS_SYSTEM_MEMORY, stfub_dfu_descr),
 		STFUB_DFU_INTERFACE(STFUB_AS_OPTION_BYTES, stfub_dfu_descr),
+		STFUB_DFU_INTERFACE(STFUB_AS_WEAR_COUNTERS, stfub_dfu_descr),
+		STFUB_DFU_INTERFACE(STFUB_AS_STATISTICS, stfub_dfu_descr),
+		STFUB_DFU_INTERFACE(STFUB_AS_RAM, stfub_dfu_descr),
+		STFUB_DFU_INTERFACE(STFUB_AS_FAULT_RECORD, stfub_dfu_descr),
+		STFUB_DFU_INTERFACE(STFUB_AS_VERIFY, stfub_dfu_descr),
+		STFUB_DFU_INTERFACE(STFUB_AS_RAW_FIRMWARE, stfub_dfu_descr),
+#ifdef STFUB_RLE
+		STFUB_DFU_INTERFACE(STFUB_AS_MAIN_MEMORY_RLE, stfub_dfu_descr),
+#endif
+};
+
+#ifdef STFUB_BULK
+
+const struct usb_endpoint_descriptor stfub_bulk_endpoints[] = {
+	{
+		.bLength		= USB_DT_ENDPOINT_SIZE,
+		.bDescriptorType	= USB_DT_ENDPOINT,
+		.bEndpointAddress	= STFUB_BULK_EP_OUT,
+		.bmAttributes		= USB_ENDPOINT_ATTR_BULK,
+		.wMaxPacketSize		= STFUB_BULK_PACKET_SIZE,
+		.bInterval		= 0,
+	},
+	{
+		.bLength		= USB_DT_ENDPOINT_SIZE,
+		.bDescriptorType	= USB_DT_ENDPOINT,
+		.bEndpointAddress	= STFUB_BULK_EP_IN,
+		.bmAttributes		= USB_ENDPOINT_ATTR_BULK,
+		.wMaxPacketSize		= STFUB_BULK_PACKET_SIZE,
+		.bInterval		= 0,
+	},
+};
+
+const struct usb_interface_descriptor stfub_bulk_interface_descriptor = {
+	.bLength		= USB_DT_INTERFACE_SIZE,
+	.bDescriptorType	= USB_DT_INTERFACE,
+	.bInterfaceNumber	= STFUB_BULK_INTERFACE_NUMBER,
+	.bAlternateSetting	= 0,
+	.bNumEndpoints		= 2,
+	.bInterfaceClass	= 0xFF,
+	.bInterfaceSubClass	= 0,
+	.bInterfaceProtocol	= 0,
+	.iInterface		= STFUB_AS_ISTRING(STFUB_AS_NUM),
+	.endpoint		= stfub_bulk_endpoints,
+};
+#endif
+
+#ifdef STFUB_CDC
+
+const struct usb_endpoint_descriptor stfub_cdc_notify_endpoint = {
+	.bLength		= USB_DT_ENDPOINT_SIZE,
+	.bDescriptorType	= USB_DT_ENDPOINT,
+	.bEndpointAddress	= STFUB_CDC_EP_NOTIFY,
+	.bmAttributes		= USB_ENDPOINT_ATTR_INTERRUPT,
+	.wMaxPacketSize		= 16,
+	.bInterval		= 255,
+};
+
+const struct usb_endpoint_descriptor stfub_cdc_data_endpoints[] = {
+	{
+		.bLength		= USB_DT_ENDPOINT_SIZE,
+		.bDescriptorType	= USB_DT_ENDPOINT,
+		.bEndpointAddress	= STFUB_CDC_EP_OUT,
+		.bmAttributes		= USB_ENDPOINT_ATTR_BULK,
+		.wMaxPacketSize		= 64,
+		.bInterval		= 0,
+	},
+	{
+		.bLength		= USB_DT_ENDPOINT_SIZE,
+		.bDescriptorType	= USB_DT_ENDPOINT,
+		.bEndpointAddress	= STFUB_CDC_EP_IN,
+		.bmAttributes		= USB_ENDPOINT_ATTR_BULK,
+		.wMaxPacketSize		= 64,
+		.bInterval		= 0,
+	},
+};
+
+static const struct {
+	struct usb_cdc_header_descriptor header;
+	struct usb_cdc_call_management_descriptor call_mgmt;
+	struct usb_cdc_acm_descriptor acm;
+	struct usb_cdc_union_descriptor cdc_union;
+} __attribute__((packed)) stfub_cdc_functional_descriptors = {
+	.header = {
+		.bFunctionLength	= sizeof(struct usb_cdc_header_descriptor),
+		.bDescriptorType	= CS_INTERFACE,
+		.bDescriptorSubtype	= USB_CDC_TYPE_HEADER,
+		.bcdCDC			= 0x0110,
+	},
+	.call_mgmt = {
+		.bFunctionLength	=
+			sizeof(struct usb_cdc_call_management_descriptor),
+		.bDescriptorType	= CS_INTERFACE,
+		.bDescriptorSubtype	= USB_CDC_TYPE_CALL_MANAGEMENT,
+		.bmCapabilities		= 0,
+		.bDataInterface		= STFUB_CDC_DATA_INTERFACE_NUMBER,
+	},
+	.acm = {
+		.bFunctionLength	= sizeof(struct usb_cdc_acm_descriptor),
+		.bDescriptorType	= CS_INTERFACE,
+		.bDescriptorSubtype	= USB_CDC_TYPE_ACM,
+		/* SET_LINE_CODING and SET_CONTROL_LINE_STATE */
+		.bmCapabilities		= 2,
+	},
+	.cdc_union = {
+		.bFunctionLength	= sizeof(struct usb_cdc_union_descriptor),
+		.bDescriptorType	= CS_INTERFACE,
+		.bDescriptorSubtype	= USB_CDC_TYPE_UNION,
+		.bControlInterface	= STFUB_CDC_COMM_INTERFACE_NUMBER,
+		.bSubordinateInterface0	= STFUB_CDC_DATA_INTERFACE_NUMBER,
+	},
+};
+
+const struct usb_interface_descriptor stfub_cdc_comm_interface_descriptor = {
+	.bLength		= USB_DT_INTERFACE_SIZE,
+	.bDescriptorType	= USB_DT_INTERFACE,
+	.bInterfaceNumber	= STFUB_CDC_COMM_INTERFACE_NUMBER,
+	.bAlternateSetting	= 0,
+	.bNumEndpoints		= 1,
+	.bInterfaceClass	= USB_CLASS_CDC,
+	.bInterfaceSubClass	= USB_CDC_SUBCLASS_ACM,
+	/* Keeps modem managers from probing the console with AT commands */
+	.bInterfaceProtocol	= USB_CDC_PROTOCOL_NONE,
+	.iInterface		= STFUB_AS_ISTRING(STFUB_AS_NUM + 1),
+	.endpoint		= &stfub_cdc_notify_endpoint,
+	.extra			= &stfub_cdc_functional_descriptors,
+	.extralen		= sizeof(stfub_cdc_functional_descriptors),
 };
 
+const struct usb_interface_descriptor stfub_cdc_data_interface_descriptor = {
+	.bLength		= USB_DT_INTERFACE_SIZE,
+	.bDescriptorType	= USB_DT_INTERFACE,
+	.bInterfaceNumber	= STFUB_CDC_DATA_INTERFACE_NUMBER,
+	.bAlternateSetting	= 0,
+	.bNumEndpoints		= 2,
+	.bInterfaceClass	= USB_CLASS_DATA,
+	.bInterfaceSubClass	= 0,
+	.bInterfaceProtocol	= 0,
+	.iInterface		= 0,
+	.endpoint		= stfub_cdc_data_endpoints,
+};
+
+const struct usb_iface_assoc_descriptor stfub_cdc_iface_assoc = {
+	.bLength		= USB_DT_INTERFACE_ASSOCIATION_SIZE,
+	.bDescriptorType	= USB_DT_INTERFACE_ASSOCIATION,
+	.bFirstInterface	= STFUB_CDC_COMM_INTERFACE_NUMBER,
+	.bInterfaceCount	= 2,
+	.bFunctionClass		= USB_CLASS_CDC,
+	.bFunctionSubClass	= USB_CDC_SUBCLASS_ACM,
+	.bFunctionProtocol	= USB_CDC_PROTOCOL_NONE,
+	.iFunction		= STFUB_AS_ISTRING(STFUB_AS_NUM + 1),
+};
+#endif
+
 struct usb_interface stfub_interfaces[] = {
 	{
-		.num_altsetting = 3,
+		.num_altsetting = STFUB_AS_NUM,
 		.altsetting	= stfub_interface_descriptors,
 	},
+#ifdef STFUB_BULK
+	{
+		.num_altsetting = 1,
+		.altsetting	= &stfub_bulk_interface_descriptor,
+	},
+#endif
+#ifdef STFUB_CDC
+	{
+		.num_altsetting = 1,
+		.iface_assoc	= &stfub_cdc_iface_assoc,
+		.altsetting	= &stfub_cdc_comm_interface_descriptor,
+	},
+	{
+		.num_altsetting = 1,
+		.altsetting	= &stfub_cdc_data_interface_descriptor,
+	},
+#endif
 };
 
 struct usb_config_descriptor config = {
 	.bLength		= USB_DT_CONFIGURATION_SIZE,
 	.bDescriptorType	= USB_DT_CONFIGURATION,
 	.wTotalLength		= 0,
-	.bNumInterfaces		= 1,
+	.bNumInterfaces		= sizeof(stfub_interfaces) /
+				  sizeof(stfub_interfaces[0]),
 	.bConfigurationValue	= 1,
 	.iConfiguration		= 0,
 	.bmAttributes		= 0xC0,
@@ -114,17 +309,46 @@ struct usb_config_descriptor config = {
 	.interface		= stfub_interfaces,
 };
 
+static const char *stfub_bank_names[STFUB_AS_NUM] = {
+	[STFUB_AS_MAIN_MEMORY]		= "Main Memory",
+	[STFUB_AS_SYSTEM_MEMORY]	= "System Memory",
+	[STFUB_AS_OPTION_BYTES]		= "Option Bytes",
+	[STFUB_AS_WEAR_COUNTERS]	= "Wear Counters",
+	[STFUB_AS_STATISTICS]		= "Statistics",
+	[STFUB_AS_RAM]			= "RAM",
+	[STFUB_AS_FAULT_RECORD]		= "Fault Record",
+	[STFUB_AS_VERIFY]		= "Verify",
+	[STFUB_AS_RAW_FIRMWARE]		= "Raw Firmware",
+#ifdef STFUB_RLE
+	[STFUB_AS_MAIN_MEMORY_RLE]	= "Main Memory (RLE)",
+#endif
+};
+
 static char serial_number_string[30];
+/* Filled in from the memory banks the DFU code sets up */
+static char bank_strings[STFUB_AS_NUM][sizeof("Main Memory (RLE) [0x00000000 - 0x00000000]")];
 static const char *usb_strings[] = {
 	"Device with STFUBoot",
 	serial_number_string,
-	/* This string is used by ST Microelectronics' DfuSe utility. */
-	"Main Memory [0x08004800 - 0x08040000]",
-	"System Memory [0x08001000 - 0x08004800]",
-	"Option Bytes [0x1FFFF800 - 0x1FFFF810]",
+	/* These strings are used by ST Microelectronics' DfuSe utility. */
+	bank_strings[STFUB_AS_MAIN_MEMORY],
+	bank_strings[STFUB_AS_SYSTEM_MEMORY],
+	bank_strings[STFUB_AS_OPTION_BYTES],
+	bank_strings[STFUB_AS_WEAR_COUNTERS],
+	bank_strings[STFUB_AS_STATISTICS],
+	bank_strings[STFUB_AS_RAM],
+	bank_strings[STFUB_AS_FAULT_RECORD],
+	bank_strings[STFUB_AS_VERIFY],
+	bank_strings[STFUB_AS_RAW_FIRMWARE],
+#ifdef STFUB_RLE
+	bank_strings[STFUB_AS_MAIN_MEMORY_RLE],
+#endif
+	/* Both always follow the banks, see STFUB_AS_ISTRING() */
+	"Bulk Transfer",
+	"Log Console",
 };
 
-static void stfub_clocks_init(void)
+static void stfub_clocks_init(u8 handoff)
 {
 	/*
 	   TODO: For some reason the device would not be able to
@@ -132,7 +356,15 @@ static void stfub_clocks_init(void)
 	   bootloader (not due to flashing). Power-cycling the board will solve the issue.
 	   Using HSE instead doesn't have this issuer
 	 */
-	rcc_clock_setup_in_hsi_out_48mhz();
+	if ((handoff & STFUB_HANDOFF_KEEP_CLOCKS) &&
+	    rcc_system_clock_source() == RCC_CFGR_SWS_SYSCLKSEL_PLLCLK) {
+		/* What rcc_clock_setup_in_hsi_out_48mhz() would have
+		 * recorded, the UART baud rate depends on it */
+		rcc_ppre1_frequency = 24000000;
+		rcc_ppre2_frequency = 48000000;
+	} else {
+		rcc_clock_setup_in_hsi_out_48mhz();
+	}
 	rcc_peripheral_enable_clock(&RCC_APB2ENR, RCC_APB2ENR_AFIOEN);
 
 	rcc_peripheral_enable_clock(&RCC_APB2ENR, RCC_APB2ENR_IOPDEN);
@@ -140,6 +372,8 @@ static void stfub_clocks_init(void)
 
 	rcc_peripheral_enable_clock(&RCC_APB2ENR, RCC_APB2ENR_IOPAEN);
 	rcc_peripheral_enable_clock(&RCC_AHBENR,  RCC_AHBENR_OTGFSEN);
+	/* Used to verify the image during manifestation */
+	rcc_peripheral_enable_clock(&RCC_AHBENR,  RCC_AHBENR_CRCEN);
 }
 
 static void stfub_gpio_init(void)
@@ -151,37 +385,189 @@ static void stfub_gpio_init(void)
 	gpio_primary_remap(AFIO_MAPR_SWJ_CFG_FULL_SWJ, AFIO_MAPR_USART2_REMAP);
 }
 
+static u32 stfub_last_activity;
+
+static void stfub_usb_activity(void)
+{
+	stfub_last_activity = stfub_timebase_ms();
+}
+
+static void stfub_usb_set_config(usbd_device *usbddev, u16 wValue)
+{
+	stfub_usb_activity();
+
+#ifdef STFUB_BULK
+	stfub_bulk_set_config(usbddev);
+#endif
+#ifdef STFUB_CDC
+	stfub_cdc_set_config(usbddev);
+#endif
+}
+
+static void stfub_usb_reset(void)
+{
+	stfub_usb_activity();
+
+#ifdef STFUB_CDC
+	stfub_cdc_reset();
+#endif
+	stfub_dfu_bus_reset();
+}
+
+/* Class requests go to the function that owns the interface */
+static int stfub_usb_control_request(usbd_device *usbddev,
+				     struct usb_setup_data *req,
+				     u8 **buf, u16 *len,
+				     void (**complete)(usbd_device *usbddev,
+						       struct usb_setup_data *req))
+{
+	stfub_usb_activity();
+
+	switch (req->wIndex) {
+	case STFUB_DFU_INTERFACE_NUMBER:
+		return stfub_dfu_handle_control_request(usbddev, req, buf,
+							len, complete);
+#ifdef STFUB_CDC
+	case STFUB_CDC_COMM_INTERFACE_NUMBER:
+		return stfub_cdc_handle_control_request(usbddev, req, buf,
+							len, complete);
+#endif
+	default:
+		return USBD_REQ_NOTSUPP;
+	}
+}
+
+static void stfub_usb_set_altsetting(usbd_device *usbddev, u16 interface,
+				     u16 altsetting)
+{
+	stfub_usb_activity();
+
+	switch (interface) {
+	case STFUB_DFU_INTERFACE_NUMBER:
+		stfub_dfu_switch_altsetting(usbddev, interface, altsetting);
+		break;
+#ifdef STFUB_BULK
+	case STFUB_BULK_INTERFACE_NUMBER:
+		stfub_bulk_reset();
+		break;
+#endif
+	}
+}
+
 static usbd_device *stfub_usb_init(void)
 {
 	static usbd_device *usbddev;
 
+	u32 start, end;
+	int i;
+
 	desig_get_unique_id_as_string(serial_number_string,
 				      sizeof(serial_number_string));
 
-	stfub_dfu_init(&stfub_dfu_descr);
+	for (i = 0; i < STFUB_AS_NUM; i++) {
+		stfub_dfu_bank_range(i, &start, &end);
+
+		if (start == end)
+			strcpy(bank_strings[i], stfub_bank_names[i]);
+		else
+			stfub_sprintf(bank_strings[i], "%s [0x%08X - 0x%08X]",
+				      stfub_bank_names[i], start, end);
+	}
 
 	usbddev = usbd_init(&stm32f107_usb_driver, &stfub_dev_descr,
 			    &config, usb_strings,
 			    (sizeof(usb_strings) / sizeof(usb_strings[0])));
 	usbd_set_control_buffer_size(usbddev, sizeof(usbd_control_buffer));
 
+	usbd_register_reset_callback(usbddev, stfub_usb_reset);
+	usbd_register_set_config_callback(usbddev, stfub_usb_set_config);
 	usbd_register_set_altsetting_callback(usbddev,
-					      stfub_dfu_switch_altsetting);
+					      stfub_usb_set_altsetting);
 	usbd_register_control_callback(usbddev,
 				       USB_REQ_TYPE_CLASS | USB_REQ_TYPE_INTERFACE,
 				       USB_REQ_TYPE_TYPE | USB_REQ_TYPE_RECIPIENT,
-				       stfub_dfu_handle_control_request);
+				       stfub_usb_control_request);
 
 	return usbddev;
 }
 
+/* Resetting the core also drops the D+ pull-up, so the host sees the
+ * device go away */
+static void stfub_usb_detach(void)
+{
+	rcc_peripheral_reset(&RCC_AHBRSTR, RCC_AHBRSTR_OTGFSRST);
+	rcc_peripheral_clear_reset(&RCC_AHBRSTR, RCC_AHBRSTR_OTGFSRST);
+}
+
+/*
+   Hand the chip over to a downloaded image in the state it would find
+   it in after a reset, as far as the bootloader has touched it.
+ */
+static void stfub_exit(void *table)
+{
+	nvic_disable_irq(NVIC_USART2_IRQ);
+	stfub_timebase_stop();
+
+	stfub_usb_detach();
+	rcc_peripheral_disable_clock(&RCC_AHBENR, RCC_AHBENR_OTGFSEN);
+
+	stfub_reset_stop_clocks();
+
+	stfub_start_with_vector_table_at_offset(table);
+}
+
+/*
+   The request that brought the device here was cleared at start, so a
+   reset starts the firmware. Checking it is left to the reset handler,
+   which brings the device back to DFU mode if there is none, rather
+   than done here with USB left unserved for as long as that takes.
+ */
+static void stfub_idle_check(void)
+{
+#if STFUB_IDLE_TIMEOUT_MS
+	/* Without firmware a reset would only come back here */
+	if (!stfub_reset_firmware_was_valid || stfub_dfu_busy() ||
+	    stfub_timebase_ms() - stfub_last_activity < STFUB_IDLE_TIMEOUT_MS)
+		return;
+
+	stfub_printf("No host for %u ms, resetting\n", STFUB_IDLE_TIMEOUT_MS);
+	scb_reset_system();
+#endif
+}
+
 int main(void)
 {
 	static usbd_device *usbddev;
+	bool usb_attached, staged;
+	u32 start;
+	u8 handoff;
+
+	stfub_stats.boot.main = stfub_dwt_cycles();
+
+	/* A request is honoured once, the next reset starts the firmware */
+	handoff = stfub_scratchpad_handoff_flags();
+	staged	= stfub_scratchpad_is_valid() &&
+		stfub_scratchpad_staged_update_requested();
+	stfub_scratchpad_init();
+
+	/* Only the case after a warm handoff from an application using USB */
+	usb_attached = RCC_AHBENR & RCC_AHBENR_OTGFSEN;
+
+	stfub_clocks_init(handoff);
+	stfub_timebase_init();
+
+	if (usb_attached && !(handoff & STFUB_HANDOFF_KEEP_USB)) {
+		stfub_usb_detach();
+
+		/* Long enough for the host to notice the disconnect */
+		start = stfub_dwt_cycles();
+		while (stfub_dwt_cycles() - start < 10 * STFUB_DWT_CYCLES_PER_MS)
+			;
+	}
 
-	stfub_clocks_init();
 	stfub_gpio_init();
 	stfub_uart_init();
+	stfub_trace_init();
 
 	/*
 	   TODO: For some reason he first character of this banner is
@@ -191,10 +577,44 @@ int main(void)
 	stfub_printf("= stfuboot -- Insert smart tagline here =\n");
 	stfub_printf("=========================================\n");
 
+	stfub_dfu_init(&stfub_dfu_descr);
+
+	/*
+	   Whether the staged image went in or not, the reset handler
+	   starts whichever firmware is valid now, or comes back here
+	   for DFU if there is none.
+
+	   Without valid firmware a staged image that is still there is
+	   installed again, that is how an install interrupted by a power
+	   loss is finished. If it fails once more the bootloader stays
+	   in DFU mode instead of trying on every reset.
+	 */
+	if (staged) {
+		stfub_install_staged_image();
+		scb_reset_system();
+	} else if (!stfub_reset_firmware_was_valid &&
+		   stfub_install_staged_image_is_present()) {
+		stfub_printf("No valid firmware, installing the staged image\n");
+		if (!stfub_install_staged_image())
+			scb_reset_system();
+	}
+
 	usbddev = stfub_usb_init();
+	stfub_stats.boot.usb_ready = stfub_dwt_cycles();
+	stfub_usb_activity();
 
 	while (1) {
 		usbd_poll(usbddev);
 		stfub_dfu_tick();
+#ifdef STFUB_BULK
+		stfub_bulk_tick();
+#endif
+#ifdef STFUB_CDC
+		stfub_cdc_tick();
+#endif
+		stfub_idle_check();
+
+		if (stfub_dfu_exit_requested())
+			stfub_exit(stfub_dfu_exit_requested());
 	}
 }
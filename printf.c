@@ -22,9 +22,22 @@
 	define. If the function should be called something else,
 	replace outbyte(c) by your own function call.
 */
+#include "cdc.h"
 #include "uart.h"
 
-#define putchar(c) stfub_uart_putchar(c)
+/* The USB console takes over while a terminal has it open */
+static void stfub_console_putchar(char c)
+{
+#ifdef STFUB_CDC
+	if (stfub_cdc_connected()) {
+		stfub_cdc_putchar(c);
+		return;
+	}
+#endif
+	stfub_uart_putchar(c);
+}
+
+#define putchar(c) stfub_console_putchar(c)
 
 static void printchar(char **str, int c)
 {
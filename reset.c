@@ -33,29 +33,80 @@
  *   fw information block
  *  ---- 0x08004a00 ----
  *   application code
+ *  ---- 0x0803f000 ----
+ *   erase counter log
+ *
+ * Built with STFUB_CRYPTO the bootloader code ends at 0x08009000 and
+ * is followed by the key slots, the information block is at 0x08009800
+ * and the application starts at 0x08009a00.
  */
 
+#include <string.h>
+
 #include <libopencm3/cm3/vector.h>
 #include <libopencm3/cm3/scb.h>
 #include <libopencm3/stm32/usart.h>
 #include <libopencm3/stm32/crc.h>
+#include <libopencm3/stm32/f1/flash.h>
 #include <libopencm3/stm32/f1/rcc.h>
 
+#include <libstfub/fault.h>
+#include <libstfub/handoff.h>
 #include <libstfub/scratch.h>
 #include <libstfub/info_block.h>
 
+#include "crc.h"
+#include "dwt.h"
+#include "ed25519.h"
+#include "keys.h"
+#include "reset.h"
+#include "sha256.h"
+#include "stats.h"
 #include "uart.h"
 
 extern unsigned _data_loadaddr, _data, _edata, _ebss, _stack;
 extern unsigned _text_loadaddr, _text, _etext;
-extern unsigned _ram_start;
+extern unsigned _ram_start, _sram_end, _fault;
 
 extern int main(void);
 
 extern unsigned _if_rom_start;
-extern unsigned _ap_rom_start;
+extern unsigned _ap_rom_start, _ap_rom_end;
 extern unsigned _sy_rom_start;
 
+#ifdef STFUB_VERIFIED_BOOT
+/*
+   The CRCs only catch accidents, anyone who can write flash can make
+   other firmware match them. So the firmware is hashed again, as it is
+   in flash now, and that digest has to be the one the signature is for.
+ */
+static bool stfub_firmware_signature_is_valid(struct stfub_firmware_info *info_block)
+{
+	u8 digest[STFUB_SHA256_DIGEST_SIZE];
+	struct stfub_sha256_ctx sha;
+	const uint8_t *public_key;
+
+	if (!(info_block->flags & STFUB_FW_SIGNED) ||
+	    info_block->size > (u32)&_ap_rom_end - (u32)&_ap_rom_start)
+		return false;
+
+	stfub_sha256_init(&sha);
+	stfub_sha256_update(&sha, &_ap_rom_start, info_block->size);
+	stfub_sha256_final(&sha, digest);
+
+	if (memcmp(digest, info_block->signature.digest, sizeof(digest)))
+		return false;
+
+	public_key = stfub_key_slot_ed25519(info_block->signature.key_slot);
+	if (!public_key)
+		return false;
+
+	return stfub_ed25519_verify(info_block->signature.value,
+				    info_block->signature.digest,
+				    STFUB_SHA256_DIGEST_SIZE, public_key);
+}
+#endif
+
 static bool stfub_firmware_is_valid(void)
 {
 	u32 crc;
@@ -64,16 +115,21 @@ static bool stfub_firmware_is_valid(void)
 	info_block = (struct stfub_firmware_info *)&_if_rom_start;
 
 #if 1
-	crc = crc_calculate_block((u32 *) info_block,
-				  (sizeof(*info_block) / 4) - 4);
+	crc = stfub_crc_block(info_block, STFUB_INFO_BLOCK_CRC_WORDS);
 
 	if (crc != info_block->crc.info_block)
 		return false;
 #endif
-	crc = crc_calculate_block((u32 *)&_ap_rom_start,
-				  info_block->size / 4);
+	crc = stfub_crc_block(&_ap_rom_start, info_block->size / 4);
 
-	return crc == info_block->crc.firmware;
+	if (crc != info_block->crc.firmware)
+		return false;
+
+#ifdef STFUB_VERIFIED_BOOT
+	return stfub_firmware_signature_is_valid(info_block);
+#else
+	return true;
+#endif
 	/* force to dfu mode if previous line commented */
 	return false;
 }
@@ -115,22 +171,42 @@ static void stfub_reset_start_clocks(void)
 	rcc_peripheral_enable_clock(&RCC_AHBENR, RCC_AHBENR_CRCEN);
 }
 
-static void stfub_reset_stop_clocks(void)
+void stfub_reset_stop_clocks(void)
 {
-	rcc_peripheral_disable_clock(&RCC_AHBENR, RCC_AHBENR_CRCEN);
+	rcc_peripheral_disable_clock(&RCC_AHBENR,
+				     RCC_AHBENR_CRCEN | RCC_AHBENR_DMA1EN);
 	rcc_set_sysclk_source(RCC_CFGR_SW_SYSCLKSEL_HSICLK);
 	rcc_osc_off(PLL);
 }
 
-__attribute__ ((section(".exception_handlers"), naked))
-static void stfub_start_with_vector_table_at_offset(void *table)
+/*
+   Start the image whose vector table is at table, with the stack the
+   table asks for. Written in assembly as nothing may be kept on the
+   old stack once MSP is switched (and the function is naked).
+
+   It lives in bl_rom with the rest of the reset code rather than in
+   be_rom: stfuboot.bin leaves be_rom out, so after a field update be_rom
+   still holds whatever the part was bootstrapped with, and the code
+   that is updated must not depend on anything in there.
+ */
+__attribute__ ((section(".reset_code"), naked, noreturn))
+void stfub_start_with_vector_table_at_offset(void *table)
 {
-	vector_table_t *vtable = table;
-	SCB_VTOR = (u32)vtable;
-	vtable->reset();
+	asm volatile ("movw	r1, #0xED08		\n\t" /* SCB_VTOR */
+		      "movt	r1, #0xE000		\n\t"
+		      "str	r0, [r1]		\n\t"
+		      "ldr	r1, [r0]		\n\t" /* initial SP */
+		      "msr	msp, r1			\n\t"
+		      "ldr	r1, [r0, #4]		\n\t" /* reset vector */
+		      "bx	r1			\n\t");
 }
 
 	volatile bool scratchpad_is_valid, firmware_is_valid;
+
+/* Set before the startup code runs, see .noinit in bootloader.ld */
+__attribute__ ((section(".noinit")))
+bool stfub_reset_firmware_was_valid;
+
 __attribute__ ((section(".reset_code"), naked, noreturn, interrupt))
 void stfub_rom_reset_handler(void)
 {
@@ -146,12 +222,20 @@ void stfub_rom_reset_handler(void)
 	for (src = &_text_loadaddr, dest = &_text; dest < &_etext; src++, dest++)
 		*dest = *src;
 
+	stfub_dwt_enable();
+
 	stfub_reset_start_clocks();
 	scratchpad_is_valid	= stfub_scratchpad_is_valid();
 	firmware_is_valid	= stfub_firmware_is_valid();
 	stfub_reset_stop_clocks();
 
-	if ((scratchpad_is_valid && stfub_scratchpad_dfu_switch_requested())
+	stfub_reset_firmware_was_valid = firmware_is_valid;
+
+	stfub_stats_firmware_check_cycles = stfub_dwt_cycles();
+
+	if ((scratchpad_is_valid &&
+	     (stfub_scratchpad_dfu_switch_requested() ||
+	      stfub_scratchpad_staged_update_requested()))
 	    || !firmware_is_valid) {
 		/* Patch vector table so it would point to correct handlers
 		 * located in RAM */
@@ -164,8 +248,142 @@ void stfub_rom_reset_handler(void)
 	}
 }
 
-__attribute__ ((section(".exception_handlers")))
-bool stfub_exception_handlers_pages_are_protected(void)
+/*
+   Entry point of the warm handoff (see libstfub/handoff.h), called by
+   the application on its own stack with interrupts masked and the
+   request already in the scratchpad. The application has been running,
+   so there is nothing to verify; only the bootloader code has to be
+   brought to RAM before starting it the same way a reset would.
+ */
+__attribute__ ((section(".reset_code"), noreturn))
+static void stfub_rom_handoff(void)
+{
+	volatile unsigned *src, *dest;
+	vector_table_t *vtable;
+
+	for (src = &_text_loadaddr, dest = &_text; dest < &_etext; src++, dest++)
+		*dest = *src;
+
+	stfub_dwt_enable();
+	stfub_stats_firmware_check_cycles = 0;
+	stfub_reset_firmware_was_valid = true;
+
+	vtable = (vector_table_t *)&_ram_start;
+	vtable->reset	= stfub_ram_reset_handler;
+
+	stfub_start_with_vector_table_at_offset(&_ram_start);
+}
+
+__attribute__ ((section(".reset_code")))
+static bool stfub_rom_address_is_in_ram(const u32 *addr)
+{
+	return addr >= (const u32 *)&_ram_start && addr < (const u32 *)&_sram_end;
+}
+
+/*
+   Fill in the fault record (see libstfub/fault.h) and have the
+   exception return to the factory DFU. This runs from bl_rom on behalf
+   of whatever code faulted, the bootloader or an application, so it
+   may not call anything outside of .reset_code, not even memcpy().
+ */
+__attribute__ ((section(".reset_code"), used))
+static void stfub_rom_save_fault(u32 *frame, u32 exc_return)
+{
+	volatile struct stfub_fault_record *record;
+	volatile u32 *word;
+	vector_table_t *vtable;
+	u32 *sp, ipsr;
+	int i;
+
+	record = (volatile struct stfub_fault_record *)&_fault;
+
+	if (record->magic != STFUB_FAULT_MAGIC)
+		record->count = 0;
+
+	asm volatile ("mrs %0, ipsr" : "=r"(ipsr));
+
+	record->magic		= STFUB_FAULT_MAGIC;
+	record->count++;
+	record->exception	= ipsr & 0x1ff;
+	record->exc_return	= exc_return;
+	record->cfsr		= SCB_CFSR;
+	record->hfsr		= SCB_HFSR;
+	record->mmfar		= SCB_MMFAR;
+	record->bfar		= SCB_BFAR;
+
+	/* With a broken stack pointer there is nothing more to save */
+	if (stfub_rom_address_is_in_ram(frame) &&
+	    stfub_rom_address_is_in_ram(frame + 7)) {
+		word = &record->frame.r0;
+		for (i = 0; i < 8; i++)
+			word[i] = frame[i];
+
+		/* xPSR bit 9: the core padded the frame to 8 bytes */
+		sp = frame + 8 + ((frame[7] >> 9) & 1);
+		record->sp = (u32)sp;
+
+		for (i = 0; i < STFUB_FAULT_STACK_WORDS; i++)
+			record->stack[i] = stfub_rom_address_is_in_ram(sp + i) ?
+				sp[i] : 0;
+	} else {
+		word = &record->frame.r0;
+		for (i = 0; i < 8 + STFUB_FAULT_STACK_WORDS; i++)
+			word[i] = 0;
+		record->sp = (u32)frame;
+	}
+
+	RCC_AHBENR |= RCC_AHBENR_CRCEN;
+	CRC_CR = CRC_CR_RESET;
+	for (word = &record->magic; word < &record->crc; word++)
+		CRC_DR = *word;
+	record->crc = CRC_DR;
+
+	vtable		= (vector_table_t *)&_sy_rom_start;
+	SCB_VTOR	= (u32)vtable;
+
+	if (stfub_rom_address_is_in_ram(frame))
+		((struct scb_exception_stack_frame *)frame)->pc =
+			(u32)vtable->reset;
+}
+
+/*
+   Pass the frame from the stack that was in use when the exception
+   was taken, and EXC_RETURN, on to stfub_rom_save_fault(). It returns
+   with the EXC_RETURN still in LR, which ends the exception.
+
+   This is the fault handler of the bootloader's own vector table, and
+   the one the handoff table publishes for applications. be_rom keeps
+   its plain stfub_rom_retreat_to_factory_dfu(), which only covers the
+   first steps of a reset.
+ */
+__attribute__ ((section(".reset_code"), naked, interrupt))
+void stfub_rom_record_fault(void)
+{
+	asm volatile ("tst	lr, #4			\n\t"
+		      "ite	eq			\n\t"
+		      "mrseq	r0, msp			\n\t"
+		      "mrsne	r0, psp			\n\t"
+		      "mov	r1, lr			\n\t"
+		      "b	stfub_rom_save_fault	\n\t");
+}
+
+/* Placed at the very start of the bootloader ROM, where applications
+ * look for it */
+__attribute__ ((section(".handoff"), used))
+const struct stfub_handoff_table stfub_handoff_table = {
+	.magic	= STFUB_HANDOFF_MAGIC,
+	.enter	= stfub_rom_handoff,
+	.fault	= stfub_rom_record_fault,
+};
+
+/*
+   be_rom's own check, inlined into its early reset. It still claims
+   the pages are protected whatever the option bytes say: with the test
+   fixed every part without write protection would end up in the system
+   bootloader at reset.
+ */
+static inline __attribute__ ((always_inline))
+bool __stfub_exception_handlers_pages_are_protected(void)
 {
 	extern unsigned _op_rom_start;
 	struct option_bytes *obytes = (struct option_bytes *) &_op_rom_start;
@@ -179,6 +397,16 @@ bool stfub_exception_handlers_pages_are_protected(void)
 #endif
 }
 
+/*
+   What the flash controller actually enforces. A cleared WRPR bit
+   write protects the pages it covers, and bit 0 covers the first 4K,
+   be_rom, on every F1 part.
+ */
+bool stfub_exception_handlers_pages_are_protected(void)
+{
+	return !(FLASH_WRPR & 1);
+}
+
 __attribute__ ((section(".exception_handlers")))
 bool stfub_bootloader_update_failed(void)
 {
@@ -196,14 +424,23 @@ bool stfub_bootloader_update_failed(void)
 
 }
 
+/* be_rom's own, as it has always been */
+__attribute__ ((section(".exception_handlers"), naked))
+static void stfub_rom_start_with_vector_table_at_offset(void *table)
+{
+	vector_table_t *vtable = table;
+	SCB_VTOR = (u32)vtable;
+	vtable->reset();
+}
+
 __attribute__ ((section(".exception_handlers"), naked, interrupt))
 void stfub_rom_early_reset(void)
 {
-	if (!stfub_exception_handlers_pages_are_protected() ||
+	if (!__stfub_exception_handlers_pages_are_protected() ||
 	    stfub_bootloader_update_failed())
-		stfub_start_with_vector_table_at_offset(&_sy_rom_start);
+		stfub_rom_start_with_vector_table_at_offset(&_sy_rom_start);
 	else
-		stfub_start_with_vector_table_at_offset(&_text_loadaddr);
+		stfub_rom_start_with_vector_table_at_offset(&_text_loadaddr);
 }
 
 __attribute__ ((section(".exception_handlers"), naked, interrupt))
@@ -250,13 +487,10 @@ vector_table_t pvector_table = {
 
 #define ALIAS(name) __attribute__((alias (#name)))
 
+/* Nothing in here may point into be_rom, see
+ * stfub_start_with_vector_table_at_offset() */
 void reset_handler(void)		ALIAS(stfub_rom_reset_handler);
-void nmi_handler(void)			ALIAS(stfub_rom_null_handler);
-void hard_fault_handler(void)		ALIAS(stfub_rom_retreat_to_factory_dfu);
-void mem_manage_handler(void)		ALIAS(stfub_rom_retreat_to_factory_dfu);
-void bus_fault_handler(void)		ALIAS(stfub_rom_retreat_to_factory_dfu);
-void usage_fault_handler(void)		ALIAS(stfub_rom_retreat_to_factory_dfu);
-void sv_call_handler(void)		ALIAS(stfub_rom_null_handler);
-void debug_monitor_handler(void)	ALIAS(stfub_rom_null_handler);
-void pend_sv_handler(void)		ALIAS(stfub_rom_null_handler);
-void sys_tick_handler(void)		ALIAS(stfub_rom_null_handler);
+void hard_fault_handler(void)		ALIAS(stfub_rom_record_fault);
+void mem_manage_handler(void)		ALIAS(stfub_rom_record_fault);
+void bus_fault_handler(void)		ALIAS(stfub_rom_record_fault);
+void usage_fault_handler(void)		ALIAS(stfub_rom_record_fault);
@@ -0,0 +1,35 @@
+/*
+ * This file is part of the stfuboot project.
+ *
+ * Copyright (C) 2012 Innovative Converged Devices (ICD)
+ *
+ * Author(s):
+ *          Andrey Smirnov <andrey.smirnov@convergeddevices.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __RESET_H__
+#define __RESET_H__
+
+#include <stdbool.h>
+
+/* What the reset handler found, true after a warm handoff */
+extern bool stfub_reset_firmware_was_valid;
+void stfub_reset_stop_clocks(void);
+bool stfub_exception_handlers_pages_are_protected(void);
+void stfub_start_with_vector_table_at_offset(void *table)
+	__attribute__ ((noreturn));
+
+#endif	/* __RESET_H__ */
@@ -0,0 +1,151 @@
+/*
+ * This file is part of the stfuboot project.
+ *
+ * Copyright (C) 2012 Innovative Converged Devices (ICD)
+ *
+ * Author(s):
+ *          Andrey Smirnov <andrey.smirnov@convergeddevices.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Run-length encoder for compressed uploads, see libstfub/rle.h.
+ *
+ * The stream is produced a DFU transfer at a time. A record is made of
+ * its control word (and run value) kept here, followed for literals by
+ * the words themselves, copied straight from memory; either part may
+ * be cut short by the end of a transfer and is picked up by the next
+ * call. Only a transfer shorter than asked for ends an upload, so every
+ * transfer but the last has to be filled completely.
+ *
+ * The file is also compiled for the host, where stfub-image checks the
+ * decoder against it.
+ */
+
+#include <string.h>
+
+#include <libstfub/rle.h>
+
+#include "rle.h"
+
+#define MIN(a, b) ((a)<(b) ? (a) : (b))
+
+static struct {
+	const uint32_t *next, *end;	/* words not encoded yet */
+
+	/* The part of the current record still to be sent */
+	uint8_t head[sizeof(struct stfub_rle_header)];
+	unsigned int head_len, head_sent;
+	const uint8_t *literal;
+	uint32_t literal_len;
+} rle;
+
+static uint32_t stfub_rle_run_length(const uint32_t *p, const uint32_t *end)
+{
+	const uint32_t *q = p;
+
+	while (q < end && *q == *p && q - p < STFUB_RLE_MAX_WORDS)
+		q++;
+
+	return q - p;
+}
+
+static void stfub_rle_put_head(uint16_t control, const uint32_t *value)
+{
+	rle.head[0] = control;
+	rle.head[1] = control >> 8;
+	rle.head_len = 2;
+	rle.head_sent = 0;
+
+	if (value) {
+		memcpy(rle.head + 2, value, sizeof(*value));
+		rle.head_len += sizeof(*value);
+	}
+}
+
+/* Set up the next record, returns 0 once everything is encoded */
+static int stfub_rle_next_record(void)
+{
+	const uint32_t *p = rle.next;
+	uint32_t n;
+
+	if (p >= rle.end)
+		return 0;
+
+	n = stfub_rle_run_length(p, rle.end);
+	if (n >= STFUB_RLE_MIN_RUN) {
+		stfub_rle_put_head(STFUB_RLE_RUN | (n - 1), p);
+		rle.next += n;
+		return 1;
+	}
+
+	/* A literal goes on up to where a run worth encoding starts */
+	for (n = 0; p + n < rle.end && n < STFUB_RLE_MAX_WORDS; n++)
+		if (stfub_rle_run_length(p + n, rle.end) >= STFUB_RLE_MIN_RUN)
+			break;
+
+	stfub_rle_put_head(n - 1, NULL);
+	rle.literal	= (const uint8_t *)p;
+	rle.literal_len	= n * sizeof(uint32_t);
+	rle.next += n;
+
+	return 1;
+}
+
+/* Both are word aligned, the length is a multiple of 4 */
+void stfub_rle_begin(const void *start, const void *end)
+{
+	struct stfub_rle_header header = {
+		.magic	= STFUB_RLE_MAGIC,
+		.start	= (uint32_t)(uintptr_t)start,
+		.length	= (const uint8_t *)end - (const uint8_t *)start,
+	};
+
+	rle.next = start;
+	rle.end	 = end;
+
+	memcpy(rle.head, &header, sizeof(header));
+	rle.head_len	= sizeof(header);
+	rle.head_sent	= 0;
+	rle.literal_len	= 0;
+}
+
+/* Fill buf with up to len bytes of the stream, returns how many */
+int stfub_rle_read(uint8_t *buf, int len)
+{
+	int done = 0, n;
+
+	while (done < len) {
+		if (rle.head_sent < rle.head_len) {
+			n = MIN((unsigned int)(len - done),
+				rle.head_len - rle.head_sent);
+			memcpy(buf + done, rle.head + rle.head_sent, n);
+			rle.head_sent += n;
+		} else if (rle.literal_len) {
+			n = MIN((uint32_t)(len - done), rle.literal_len);
+			memcpy(buf + done, rle.literal, n);
+			rle.literal	+= n;
+			rle.literal_len	-= n;
+		} else if (stfub_rle_next_record()) {
+			continue;
+		} else {
+			break;
+		}
+
+		done += n;
+	}
+
+	return done;
+}
@@ -3,40 +3,43 @@
 #include <string.h>
 
 #include <libopencm3/stm32/crc.h>
+#include <libopencm3/stm32/f1/rcc.h>
+
+#include <libstfub/scratch.h>
+
 /* 
    Total size of scratch area is 32 bytes
  */
+#define STFUB_SCRATCHPAD_CRC_WORDS				\
+	((sizeof(struct stfub_scratchpad) - sizeof(uint32_t)) / 4)
 
+extern unsigned _scratch;
 
-struct stfub_scratchpad {
-	uint8_t  boot_to_dfu;
-	uint8_t  __reserved[27];
-	uint32_t crc;
-} __attribute__ ((packed));
+static u32 stfub_scratchpad_calculate_crc(struct stfub_scratchpad *scratchpad)
+{
+	/* The application may not have the CRC unit clocked */
+	rcc_peripheral_enable_clock(&RCC_AHBENR, RCC_AHBENR_CRCEN);
+	crc_reset();
 
-extern unsigned _scratch;
+	return crc_calculate_block((uint32_t *)scratchpad,
+				   STFUB_SCRATCHPAD_CRC_WORDS);
+}
 
 static void stfub_scratchpad_recalculate_crc(void)
 {
 	struct stfub_scratchpad *scratchpad;
 
 	scratchpad = (struct stfub_scratchpad *)&_scratch;
-	scratchpad->crc = 0;
-	scratchpad->crc = crc_calculate_block((uint32_t *)scratchpad,
-					      sizeof(*scratchpad) / 4);
+	scratchpad->crc = stfub_scratchpad_calculate_crc(scratchpad);
 }
 
 bool stfub_scratchpad_is_valid(void)
 {
-	u32 crc;
 	struct stfub_scratchpad *scratchpad;
 
 	scratchpad = (struct stfub_scratchpad *)&_scratch;
 
-	crc = crc_calculate_block((uint32_t *)scratchpad,
-				  sizeof(*scratchpad) / 4);
-
-	return crc == scratchpad->crc;
+	return stfub_scratchpad_calculate_crc(scratchpad) == scratchpad->crc;
 }
 
 bool stfub_scratchpad_dfu_switch_requested(void)
@@ -58,6 +61,49 @@ void stfub_scratchpad_request_dfu_switch(void)
 	stfub_scratchpad_recalculate_crc();
 }
 
+void stfub_scratchpad_request_handoff(uint8_t flags)
+{
+	struct stfub_scratchpad *scratchpad;
+
+	scratchpad = (struct stfub_scratchpad *)&_scratch;
+
+	scratchpad->boot_to_dfu   = true;
+	scratchpad->handoff_flags = flags;
+	stfub_scratchpad_recalculate_crc();
+}
+
+/* Flags of a valid handoff request, 0 when there is none */
+uint8_t stfub_scratchpad_handoff_flags(void)
+{
+	struct stfub_scratchpad *scratchpad;
+
+	scratchpad = (struct stfub_scratchpad *)&_scratch;
+
+	if (!stfub_scratchpad_is_valid())
+		return 0;
+
+	return scratchpad->handoff_flags;
+}
+
+bool stfub_scratchpad_staged_update_requested(void)
+{
+	struct stfub_scratchpad *scratchpad;
+
+	scratchpad = (struct stfub_scratchpad *)&_scratch;
+
+	return scratchpad->install_staged;
+}
+
+void stfub_scratchpad_request_staged_update(void)
+{
+	struct stfub_scratchpad *scratchpad;
+
+	scratchpad = (struct stfub_scratchpad *)&_scratch;
+
+	scratchpad->install_staged = true;
+	stfub_scratchpad_recalculate_crc();
+}
+
 void stfub_scratchpad_init(void)
 {
 	struct stfub_scratchpad *scratchpad;
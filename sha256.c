@@ -0,0 +1,184 @@
+/*
+ * This file is part of the stfuboot project.
+ *
+ * Copyright (C) 2012 Innovative Converged Devices (ICD)
+ *
+ * Author(s):
+ *          Andrey Smirnov <andrey.smirnov@convergeddevices.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * SHA-256 (FIPS 180-4), fed incrementally as firmware blocks are
+ * programmed so no second pass over flash is needed. Also compiled
+ * for the host tools.
+ */
+
+#include <string.h>
+
+#include "sha256.h"
+
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROTR(x, n)	(((x) >> (n)) | ((x) << (32 - (n))))
+
+static inline uint32_t load_be32(const uint8_t *p)
+{
+	return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+	       (uint32_t)p[2] << 8  | (uint32_t)p[3];
+}
+
+static inline void store_be32(uint8_t *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static void stfub_sha256_transform(uint32_t *state, const uint8_t *block)
+{
+	uint32_t w[16], a, b, c, d, e, f, g, h, t1, t2;
+	int i;
+
+	a = state[0];
+	b = state[1];
+	c = state[2];
+	d = state[3];
+	e = state[4];
+	f = state[5];
+	g = state[6];
+	h = state[7];
+
+	/* The message schedule is kept as a 16 word ring */
+	for (i = 0; i < 64; i++) {
+		if (i < 16) {
+			w[i] = load_be32(block + 4 * i);
+		} else {
+			uint32_t w15 = w[(i - 15) & 15], w2 = w[(i - 2) & 15];
+
+			w[i & 15] += (ROTR(w15, 7) ^ ROTR(w15, 18) ^ (w15 >> 3)) +
+				     (ROTR(w2, 17) ^ ROTR(w2, 19) ^ (w2 >> 10)) +
+				     w[(i - 7) & 15];
+		}
+
+		t1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) +
+		     ((e & f) ^ (~e & g)) + sha256_k[i] + w[i & 15];
+		t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) +
+		     ((a & b) ^ (a & c) ^ (b & c));
+
+		h = g;
+		g = f;
+		f = e;
+		e = d + t1;
+		d = c;
+		c = b;
+		b = a;
+		a = t1 + t2;
+	}
+
+	state[0] += a;
+	state[1] += b;
+	state[2] += c;
+	state[3] += d;
+	state[4] += e;
+	state[5] += f;
+	state[6] += g;
+	state[7] += h;
+}
+
+void stfub_sha256_init(struct stfub_sha256_ctx *ctx)
+{
+	ctx->state[0] = 0x6a09e667;
+	ctx->state[1] = 0xbb67ae85;
+	ctx->state[2] = 0x3c6ef372;
+	ctx->state[3] = 0xa54ff53a;
+	ctx->state[4] = 0x510e527f;
+	ctx->state[5] = 0x9b05688c;
+	ctx->state[6] = 0x1f83d9ab;
+	ctx->state[7] = 0x5be0cd19;
+	ctx->length   = 0;
+}
+
+void stfub_sha256_update(struct stfub_sha256_ctx *ctx, const void *data,
+			 size_t len)
+{
+	const uint8_t *p = data;
+	size_t used = ctx->length % STFUB_SHA256_BLOCK_SIZE;
+	size_t n;
+
+	ctx->length += len;
+
+	if (used) {
+		n = STFUB_SHA256_BLOCK_SIZE - used;
+		if (n > len)
+			n = len;
+
+		memcpy(ctx->buf + used, p, n);
+		p   += n;
+		len -= n;
+
+		if (used + n < STFUB_SHA256_BLOCK_SIZE)
+			return;
+
+		stfub_sha256_transform(ctx->state, ctx->buf);
+	}
+
+	for (; len >= STFUB_SHA256_BLOCK_SIZE; len -= STFUB_SHA256_BLOCK_SIZE,
+		     p += STFUB_SHA256_BLOCK_SIZE)
+		stfub_sha256_transform(ctx->state, p);
+
+	memcpy(ctx->buf, p, len);
+}
+
+void stfub_sha256_final(struct stfub_sha256_ctx *ctx, uint8_t *digest)
+{
+	uint64_t bits = ctx->length * 8;
+	size_t used = ctx->length % STFUB_SHA256_BLOCK_SIZE;
+	int i;
+
+	ctx->buf[used++] = 0x80;
+
+	if (used > STFUB_SHA256_BLOCK_SIZE - 8) {
+		memset(ctx->buf + used, 0, STFUB_SHA256_BLOCK_SIZE - used);
+		stfub_sha256_transform(ctx->state, ctx->buf);
+		used = 0;
+	}
+
+	memset(ctx->buf + used, 0, STFUB_SHA256_BLOCK_SIZE - 8 - used);
+	store_be32(ctx->buf + 56, bits >> 32);
+	store_be32(ctx->buf + 60, bits);
+	stfub_sha256_transform(ctx->state, ctx->buf);
+
+	for (i = 0; i < 8; i++)
+		store_be32(digest + 4 * i, ctx->state[i]);
+}
@@ -0,0 +1,43 @@
+/*
+ * This file is part of the stfuboot project.
+ *
+ * Copyright (C) 2012 Innovative Converged Devices (ICD)
+ *
+ * Author(s):
+ *          Andrey Smirnov <andrey.smirnov@convergeddevices.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SHA256_H__
+#define __SHA256_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define STFUB_SHA256_DIGEST_SIZE	32
+#define STFUB_SHA256_BLOCK_SIZE		64
+
+struct stfub_sha256_ctx {
+	uint32_t state[8];
+	uint64_t length;
+	uint8_t  buf[STFUB_SHA256_BLOCK_SIZE];
+};
+
+void stfub_sha256_init(struct stfub_sha256_ctx *ctx);
+void stfub_sha256_update(struct stfub_sha256_ctx *ctx, const void *data,
+			 size_t len);
+void stfub_sha256_final(struct stfub_sha256_ctx *ctx, uint8_t *digest);
+
+#endif	/* __SHA256_H__ */
@@ -0,0 +1,168 @@
+/*
+ * This file is part of the stfuboot project.
+ *
+ * Copyright (C) 2012 Innovative Converged Devices (ICD)
+ *
+ * Author(s):
+ *          Andrey Smirnov <andrey.smirnov@convergeddevices.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Application side of staged updates, see libstfub/staging.h.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <libopencm3/stm32/crc.h>
+#include <libopencm3/stm32/f1/rcc.h>
+#include <libopencm3/stm32/f1/flash.h>
+
+#include <libstfub/info_block.h>
+#include <libstfub/scratch.h>
+#include <libstfub/staging.h>
+
+#include "geometry.h"
+
+static struct {
+	u32 writeptr;
+	u32 end;
+	/* Everything below this address has been erased */
+	u32 erased;
+	/* A byte left over from a write of odd length */
+	u8   odd_byte;
+	bool has_odd_byte;
+} staging;
+
+enum stfub_staging_status stfub_staging_begin(uint32_t length)
+{
+	staging.writeptr	= STFUB_STAGING_START;
+	staging.erased		= STFUB_STAGING_START;
+	staging.has_odd_byte	= false;
+
+	/* Leave no room to write, so a rejected image stays rejected */
+	if (length > STFUB_STAGING_END - STFUB_STAGING_START ||
+	    length > sizeof(struct stfub_firmware_info) +
+	    STFUB_STAGING_MAX_FIRMWARE) {
+		staging.end = staging.writeptr;
+		return STFUB_STAGING_TOO_LARGE;
+	}
+
+	staging.end		= STFUB_STAGING_START + length;
+
+	return STFUB_STAGING_OK;
+}
+
+/* Program an even number of bytes at the write pointer */
+static enum stfub_staging_status stfub_staging_program(const void *data,
+							u32 len)
+{
+	enum stfub_flash_status status;
+
+	flash_unlock();
+
+	while (staging.erased < staging.writeptr + len) {
+		if (stfub_flash_erase_sector(staging.erased) !=
+		    STFUB_FLASH_OK) {
+			flash_lock();
+			return STFUB_STAGING_FLASH_ERROR;
+		}
+		staging.erased += stfub_flash_sector_size(staging.erased);
+	}
+
+	status = stfub_flash_program(staging.writeptr, data, len);
+
+	flash_lock();
+
+	if (status != STFUB_FLASH_OK)
+		return STFUB_STAGING_FLASH_ERROR;
+
+	staging.writeptr += len;
+
+	return STFUB_STAGING_OK;
+}
+
+enum stfub_staging_status stfub_staging_write(const void *data, uint32_t len)
+{
+	enum stfub_staging_status status;
+	const u8 *p = data;
+	u8 half_word[2];
+
+	if (staging.writeptr + staging.has_odd_byte + len > staging.end)
+		return STFUB_STAGING_TOO_LARGE;
+
+	if (staging.has_odd_byte && len) {
+		half_word[0] = staging.odd_byte;
+		half_word[1] = *p++;
+		len--;
+
+		status = stfub_staging_program(half_word, sizeof(half_word));
+		if (status != STFUB_STAGING_OK)
+			return status;
+
+		staging.has_odd_byte = false;
+	}
+
+	if (len >= 2) {
+		status = stfub_staging_program(p, len & ~1);
+		if (status != STFUB_STAGING_OK)
+			return status;
+	}
+
+	if (len & 1) {
+		staging.odd_byte     = p[len - 1];
+		staging.has_odd_byte = true;
+	}
+
+	return STFUB_STAGING_OK;
+}
+
+static u32 stfub_staging_crc(u32 address, u32 words)
+{
+	/* The application may not have the CRC unit clocked */
+	rcc_peripheral_enable_clock(&RCC_AHBENR, RCC_AHBENR_CRCEN);
+	crc_reset();
+
+	return crc_calculate_block((u32 *)address, words);
+}
+
+enum stfub_staging_status stfub_staging_finish(void)
+{
+	const struct stfub_firmware_info *info;
+
+	info = (const struct stfub_firmware_info *)STFUB_STAGING_START;
+
+	/* Images are made of whole words */
+	if (staging.has_odd_byte || staging.writeptr != staging.end ||
+	    staging.end - STFUB_STAGING_START < sizeof(*info))
+		return STFUB_STAGING_BAD_IMAGE;
+
+	if (stfub_staging_crc((u32)info, STFUB_INFO_BLOCK_CRC_WORDS) !=
+	    info->crc.info_block || info->size % 4 ||
+	    sizeof(*info) + info->size != staging.end - STFUB_STAGING_START)
+		return STFUB_STAGING_BAD_IMAGE;
+
+	/* The CRC is that of the plaintext, only the bootloader has the
+	 * key to check an encrypted image */
+	if (!(info->flags & STFUB_FW_ENCRYPTED) &&
+	    stfub_staging_crc((u32)(info + 1), info->size / 4) !=
+	    info->crc.firmware)
+		return STFUB_STAGING_BAD_IMAGE;
+
+	stfub_scratchpad_request_staged_update();
+
+	return STFUB_STAGING_OK;
+}
@@ -0,0 +1,36 @@
+/*
+ * This file is part of the stfuboot project.
+ *
+ * Copyright (C) 2012 Innovative Converged Devices (ICD)
+ *
+ * Author(s):
+ *          Andrey Smirnov <andrey.smirnov@convergeddevices.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "stats.h"
+
+struct stfub_statistics stfub_stats;
+
+__attribute__ ((section(".noinit")))
+u32 stfub_stats_firmware_check_cycles;
+
+const struct stfub_statistics *stfub_stats_snapshot(void)
+{
+	stfub_stats.magic		= STFUB_STATISTICS_MAGIC;
+	stfub_stats.boot.firmware_check	= stfub_stats_firmware_check_cycles;
+
+	return &stfub_stats;
+}
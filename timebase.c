@@ -0,0 +1,60 @@
+/*
+ * This file is part of the stfuboot project.
+ *
+ * Copyright (C) 2012 Innovative Converged Devices (ICD)
+ *
+ * Author(s):
+ *          Andrey Smirnov <andrey.smirnov@convergeddevices.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Millisecond time base for the bootloader, from SysTick. The core
+ * always runs at 48MHz here (see dwt.h), SysTick counts the AHB clock.
+ */
+
+#include <libopencm3/cm3/systick.h>
+
+#include "dwt.h"
+#include "timebase.h"
+
+static volatile u32 stfub_timebase_ticks;
+
+void sys_tick_handler(void)
+{
+	stfub_timebase_ticks++;
+}
+
+void stfub_timebase_init(void)
+{
+	stfub_timebase_ticks = 0;
+
+	systick_set_clocksource(STK_CTRL_CLKSOURCE_AHB);
+	systick_set_reload(STFUB_DWT_CYCLES_PER_MS - 1);
+	systick_interrupt_enable();
+	systick_counter_enable();
+}
+
+/* Leaves SysTick as a reset would, for the image started next */
+void stfub_timebase_stop(void)
+{
+	systick_interrupt_disable();
+	systick_counter_disable();
+}
+
+u32 stfub_timebase_ms(void)
+{
+	return stfub_timebase_ticks;
+}
@@ -0,0 +1,479 @@
+/*
+ * This file is part of the stfuboot project.
+ *
+ * Copyright (C) 2012 Innovative Converged Devices (ICD)
+ *
+ * Author(s):
+ *          Andrey Smirnov <andrey.smirnov@convergeddevices.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * stfub-bulk -- download an image over the bootloader's bulk transfer
+ * interface, see include/libstfub/bulk_protocol.h, or check one that is
+ * already in flash with the "Verify" altsetting, see
+ * include/libstfub/verify.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libusb.h>
+
+#include <libstfub/bulk_protocol.h>
+#include <libstfub/verify.h>
+
+#include "stm32-crc.h"
+
+#define STFUB_DFU_INTERFACE	0
+#define STFUB_BULK_INTERFACE	1
+#define STFUB_BULK_EP_OUT	0x01
+#define STFUB_BULK_EP_IN	0x81
+
+#define STFUB_DFU_TRANSFER_SIZE	2048
+#define STFUB_AS_VERIFY		7
+
+#define DFU_DETACH		0
+#define DFU_DNLOAD		1
+#define DFU_UPLOAD		2
+#define DFU_GETSTATUS		3
+#define DFU_CLRSTATUS		4
+#define DFU_ABORT		6
+
+#define STATE_DFU_DNLOAD_IDLE	5
+#define STATE_DFU_ERROR		10
+
+#define OUT_TIMEOUT_MS		5000
+/* Long enough for the signature check during manifestation */
+#define REPLY_TIMEOUT_MS	10000
+
+#define MIN(a, b) ((a)<(b) ? (a) : (b))
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: stfub-bulk [-d <vid>:<pid>] [-a <altsetting>] [-R] <image>\n"
+		"       stfub-bulk [-d <vid>:<pid>] [-a <altsetting>] -V [-P <size>] <image>\n"
+		"\n"
+		"  -d  USB device to talk to (default: 0483:df11)\n"
+		"  -a  memory bank, numbered as the DFU altsettings (default: 0)\n"
+		"  -R  leave the bootloader once the image is written\n"
+		"  -V  compare the image with the bank instead of writing it\n"
+		"  -P  flash page size (default: 2048)\n");
+	exit(2);
+}
+
+static void usb_die(const char *what, int ret)
+{
+	fprintf(stderr, "%s: %s\n", what, libusb_error_name(ret));
+	exit(1);
+}
+
+static uint8_t *read_image(const char *path, size_t *len)
+{
+	uint8_t *data = NULL;
+	size_t size = 0, ret;
+	FILE *f;
+
+	f = fopen(path, "rb");
+	if (!f) {
+		perror(path);
+		exit(1);
+	}
+
+	do {
+		data = realloc(data, size + STFUB_BULK_BLOCK_SIZE);
+		if (!data) {
+			perror("realloc");
+			exit(1);
+		}
+
+		ret   = fread(data + size, 1, STFUB_BULK_BLOCK_SIZE, f);
+		size += ret;
+	} while (ret == STFUB_BULK_BLOCK_SIZE);
+
+	if (ferror(f)) {
+		perror(path);
+		exit(1);
+	}
+
+	fclose(f);
+	*len = size;
+	return data;
+}
+
+static void bulk_out(libusb_device_handle *dev, const void *buf, int len)
+{
+	int done, ret;
+
+	ret = libusb_bulk_transfer(dev, STFUB_BULK_EP_OUT, (unsigned char *)buf,
+				   len, &done, OUT_TIMEOUT_MS);
+	if (ret < 0)
+		usb_die("bulk OUT", ret);
+	if (done != len) {
+		fprintf(stderr, "bulk OUT: short write (%d of %d)\n", done, len);
+		exit(1);
+	}
+}
+
+static void read_reply(libusb_device_handle *dev,
+		       struct stfub_bulk_reply *reply)
+{
+	unsigned char buf[STFUB_BULK_PACKET_SIZE];
+	int done, ret;
+
+	ret = libusb_bulk_transfer(dev, STFUB_BULK_EP_IN, buf, sizeof(buf),
+				   &done, REPLY_TIMEOUT_MS);
+	if (ret < 0)
+		usb_die("bulk IN", ret);
+
+	if (done != sizeof(*reply)) {
+		fprintf(stderr, "bulk IN: unexpected reply length %d\n", done);
+		exit(1);
+	}
+
+	memcpy(reply, buf, sizeof(*reply));
+	if (reply->magic != STFUB_BULK_MAGIC) {
+		fprintf(stderr, "bulk IN: bad reply magic\n");
+		exit(1);
+	}
+
+	if (reply->status) {
+		fprintf(stderr, "device reported DFU status %u after %u blocks\n",
+			reply->status, reply->blocks);
+		exit(1);
+	}
+}
+
+static void dfu_request(libusb_device_handle *dev, int in, uint8_t request,
+			void *buf, int len)
+{
+	int ret;
+
+	ret = libusb_control_transfer(dev, LIBUSB_REQUEST_TYPE_CLASS |
+				      LIBUSB_RECIPIENT_INTERFACE |
+				      (in ? LIBUSB_ENDPOINT_IN : 0), request,
+				      0, STFUB_DFU_INTERFACE, buf, len,
+				      OUT_TIMEOUT_MS);
+	if (ret < 0)
+		usb_die("DFU request", ret);
+}
+
+/* Address range of a bank, from the name of its altsetting */
+static void bank_range(libusb_device_handle *dev, unsigned int altsetting,
+		       uint32_t *start, uint32_t *end)
+{
+	struct libusb_config_descriptor *config;
+	const struct libusb_interface *intf;
+	unsigned char name[128];
+	const char *range;
+	int ret;
+
+	ret = libusb_get_active_config_descriptor(libusb_get_device(dev),
+						  &config);
+	if (ret < 0)
+		usb_die("config descriptor", ret);
+
+	intf = &config->interface[STFUB_DFU_INTERFACE];
+	if ((int)altsetting >= intf->num_altsetting) {
+		fprintf(stderr, "no altsetting %u\n", altsetting);
+		exit(1);
+	}
+
+	ret = libusb_get_string_descriptor_ascii(dev,
+			intf->altsetting[altsetting].iInterface,
+			name, sizeof(name));
+	if (ret < 0)
+		usb_die("altsetting name", ret);
+
+	libusb_free_config_descriptor(config);
+
+	range = strchr((const char *)name, '[');
+	if (!range || sscanf(range, "[0x%x - 0x%x]", start, end) != 2) {
+		fprintf(stderr, "\"%s\" is not a bank in flash\n", name);
+		exit(1);
+	}
+}
+
+/*
+   One query per call, the caller keeps the pages in range. Returns the
+   number of mismatching pages and prints them.
+ */
+static int verify_pages(libusb_device_handle *dev, unsigned int altsetting,
+			uint32_t start, const uint8_t *image, uint32_t npages,
+			uint32_t page_size)
+{
+	uint8_t buf[STFUB_DFU_TRANSFER_SIZE];
+	struct stfub_verify_query *query = (struct stfub_verify_query *)buf;
+	struct stfub_verify_result *result = (struct stfub_verify_result *)buf;
+	uint8_t status[6];
+	uint32_t i;
+	int len;
+
+	memset(query, 0, sizeof(*query));
+	query->magic	  = STFUB_VERIFY_MAGIC;
+	query->altsetting = altsetting;
+	query->reply	  = STFUB_VERIFY_BITMAP;
+	query->count	  = npages;
+	query->start	  = start;
+	query->end	  = start + npages * page_size;
+
+	for (i = 0; i < npages; i++)
+		query->expected[i] = stm32_crc_block(image + i * page_size,
+						     page_size / 4);
+
+	len = sizeof(*query) + npages * sizeof(uint32_t);
+	dfu_request(dev, 0, DFU_DNLOAD, buf, len);
+
+	/* The CRCs are computed while the device is in dfuDNBUSY */
+	do {
+		dfu_request(dev, 1, DFU_GETSTATUS, status, sizeof(status));
+		usleep((status[1] | status[2] << 8 | status[3] << 16) * 1000);
+	} while (status[4] != STATE_DFU_DNLOAD_IDLE &&
+		 status[4] != STATE_DFU_ERROR);
+
+	if (status[4] == STATE_DFU_ERROR) {
+		dfu_request(dev, 0, DFU_CLRSTATUS, NULL, 0);
+		fprintf(stderr, "device rejected the query, DFU status %u\n",
+			status[0]);
+		exit(1);
+	}
+
+	dfu_request(dev, 0, DFU_ABORT, NULL, 0);
+
+	len = libusb_control_transfer(dev, LIBUSB_REQUEST_TYPE_CLASS |
+				      LIBUSB_RECIPIENT_INTERFACE |
+				      LIBUSB_ENDPOINT_IN, DFU_UPLOAD, 0,
+				      STFUB_DFU_INTERFACE, buf, sizeof(buf),
+				      OUT_TIMEOUT_MS);
+	if (len < 0)
+		usb_die("DFU upload", len);
+
+	if ((size_t)len < sizeof(*result) ||
+	    result->magic != STFUB_VERIFY_MAGIC || result->sectors != npages) {
+		fprintf(stderr, "unexpected verify result\n");
+		exit(1);
+	}
+
+	for (i = 0; i < npages && result->mismatches; i++)
+		if (result->data[i / 32] & (1U << (i % 32)))
+			printf("0x%08x differs\n", start + i * page_size);
+
+	return result->mismatches;
+}
+
+static int verify(libusb_device_handle *dev, unsigned int altsetting,
+		  const uint8_t *image, size_t len, uint32_t page_size)
+{
+	uint32_t start, end, npages, n, i;
+	int ret, mismatches = 0;
+	uint8_t *pages;
+
+	bank_range(dev, altsetting, &start, &end);
+
+	npages = (len + page_size - 1) / page_size;
+	if (npages * page_size > end - start) {
+		fprintf(stderr, "image does not fit into 0x%08x - 0x%08x\n",
+			start, end);
+		exit(1);
+	}
+
+	/* The rest of the last page is left erased */
+	pages = malloc(npages * page_size);
+	if (!pages) {
+		perror("malloc");
+		exit(1);
+	}
+	memcpy(pages, image, len);
+	memset(pages + len, 0xFF, npages * page_size - len);
+
+	ret = libusb_claim_interface(dev, STFUB_DFU_INTERFACE);
+	if (ret < 0)
+		usb_die("claim interface", ret);
+
+	ret = libusb_set_interface_alt_setting(dev, STFUB_DFU_INTERFACE,
+					       STFUB_AS_VERIFY);
+	if (ret < 0)
+		usb_die("set interface", ret);
+
+	for (i = 0; i < npages; i += n) {
+		n = MIN(npages - i, STFUB_VERIFY_MAX_SECTORS);
+		mismatches += verify_pages(dev, altsetting,
+					   start + i * page_size,
+					   pages + i * page_size, n,
+					   page_size);
+	}
+
+	free(pages);
+
+	libusb_set_interface_alt_setting(dev, STFUB_DFU_INTERFACE, altsetting);
+	libusb_release_interface(dev, STFUB_DFU_INTERFACE);
+
+	fprintf(stderr, "%d of %u pages differ\n", mismatches, npages);
+
+	return mismatches ? 1 : 0;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int vid = 0x0483, pid = 0xDF11, altsetting = 0;
+	struct stfub_bulk_request req;
+	struct stfub_bulk_reply reply;
+	libusb_device_handle *dev;
+	uint32_t sent, nblocks;
+	double start, elapsed;
+	uint8_t *image;
+	size_t len, offset;
+	int opt, ret, detach = 0, check = 0;
+	uint32_t page_size = 2048;
+
+	while ((opt = getopt(argc, argv, "d:a:RVP:")) != -1) {
+		switch (opt) {
+		case 'd':
+			if (sscanf(optarg, "%x:%x", &vid, &pid) != 2)
+				usage();
+			break;
+		case 'a':
+			altsetting = strtoul(optarg, NULL, 0);
+			break;
+		case 'R':
+			detach = 1;
+			break;
+		case 'V':
+			check = 1;
+			break;
+		case 'P':
+			page_size = strtoul(optarg, NULL, 0);
+			if (!page_size || page_size % 4)
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (optind != argc - 1)
+		usage();
+
+	image = read_image(argv[optind], &len);
+	nblocks = (len + STFUB_BULK_BLOCK_SIZE - 1) / STFUB_BULK_BLOCK_SIZE;
+
+	ret = libusb_init(NULL);
+	if (ret < 0)
+		usb_die("libusb_init", ret);
+
+	dev = libusb_open_device_with_vid_pid(NULL, vid, pid);
+	if (!dev) {
+		fprintf(stderr, "no device %04x:%04x found\n", vid, pid);
+		return 1;
+	}
+
+	if (check) {
+		ret = verify(dev, altsetting, image, len, page_size);
+
+		libusb_close(dev);
+		libusb_exit(NULL);
+		free(image);
+
+		return ret;
+	}
+
+	ret = libusb_claim_interface(dev, STFUB_BULK_INTERFACE);
+	if (ret < 0)
+		usb_die("claim interface", ret);
+
+	/* Selecting the interface drops any session left behind */
+	ret = libusb_set_interface_alt_setting(dev, STFUB_BULK_INTERFACE, 0);
+	if (ret < 0)
+		usb_die("set interface", ret);
+
+	memset(&req, 0, sizeof(req));
+	req.magic	= STFUB_BULK_MAGIC;
+	req.opcode	= STFUB_BULK_START;
+	req.altsetting	= altsetting;
+	req.length	= len;
+
+	start = now();
+
+	bulk_out(dev, &req, sizeof(req));
+	read_reply(dev, &reply);
+	if (reply.type != STFUB_BULK_READY) {
+		fprintf(stderr, "device did not accept the download\n");
+		return 1;
+	}
+
+	/*
+	   Acknowledgements are cumulative: reply.blocks is the number of
+	   blocks in flash, and no more than reply.window blocks may be
+	   sent past it.
+	 */
+	reply.blocks = 0;
+	for (sent = 0, offset = 0; sent < nblocks; sent++) {
+		while (sent - reply.blocks >= reply.window) {
+			read_reply(dev, &reply);
+			if (reply.type == STFUB_BULK_DONE) {
+				fprintf(stderr, "device ended the download early\n");
+				return 1;
+			}
+		}
+
+		bulk_out(dev, image + offset,
+			 MIN(len - offset, STFUB_BULK_BLOCK_SIZE));
+		offset += STFUB_BULK_BLOCK_SIZE;
+
+		fprintf(stderr, "\r%u/%u blocks", reply.blocks, nblocks);
+	}
+
+	while (reply.type != STFUB_BULK_DONE)
+		read_reply(dev, &reply);
+
+	if (reply.status) {
+		fprintf(stderr, "\ndownload failed, DFU status %u\n",
+			reply.status);
+		return 1;
+	}
+
+	elapsed = now() - start;
+	fprintf(stderr, "\r%u/%u blocks, %zu bytes in %.2f s (%.1f KiB/s)\n",
+		reply.blocks, nblocks, len, elapsed, len / elapsed / 1024);
+
+	libusb_release_interface(dev, STFUB_BULK_INTERFACE);
+
+	/* The device drops off the bus right after the request, so the
+	 * result does not tell anything */
+	if (detach)
+		libusb_control_transfer(dev, LIBUSB_REQUEST_TYPE_CLASS |
+					LIBUSB_RECIPIENT_INTERFACE, DFU_DETACH,
+					0, STFUB_DFU_INTERFACE, NULL, 0,
+					OUT_TIMEOUT_MS);
+
+	libusb_close(dev);
+	libusb_exit(NULL);
+	free(image);
+
+	return 0;
+}
@@ -0,0 +1,738 @@
+/*
+ * This file is part of the stfuboot project.
+ *
+ * Copyright (C) 2012 Innovative Converged Devices (ICD)
+ *
+ * Author(s):
+ *          Andrey Smirnov <andrey.smirnov@convergeddevices.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * stfub-flash -- download one image to every stfuboot device attached,
+ * all at once, for production runs.
+ *
+ * The image is read, and its info block and CRC checked, once; every
+ * device then gets a thread of its own that goes through the DFU
+ * download block by block, waiting out bwPollTimeout after each
+ * DNLOAD, and through manifestation. The device checks the firmware
+ * CRC (and the signature, if there is one) before it writes the info
+ * block, so a download that manifests is a verified one. A block the
+ * device fails to take is sent again after DFU_CLRSTATUS, the
+ * bootloader acknowledges blocks it already has without writing them.
+ *
+ * With -S the devices are instances of stfub-sim, the bootloader's DFU
+ * code built for the host, see tools/stfub-sim.c.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <libusb.h>
+
+#include <libstfub/info_block.h>
+
+#include "stfub-sim.h"
+#include "stm32-crc.h"
+
+#define STFUB_DFU_INTERFACE	0
+#define STFUB_DFU_TRANSFER_SIZE	2048
+#define STFUB_AS_RAW_FIRMWARE	8
+
+#define DFU_DNLOAD		1
+#define DFU_GETSTATUS		3
+#define DFU_CLRSTATUS		4
+
+#define STATE_DFU_IDLE			2
+#define STATE_DFU_DNBUSY		4
+#define STATE_DFU_DNLOAD_IDLE		5
+#define STATE_DFU_MANIFEST		7
+#define STATE_DFU_MANIFEST_WAIT_RESET	8
+#define STATE_DFU_ERROR			10
+
+#define REQUEST_TIMEOUT_MS	5000
+#define MAX_DEVICES		128
+
+#define MIN(a, b) ((a)<(b) ? (a) : (b))
+
+struct device;
+
+/* What the scheduler needs from a device, real or simulated */
+struct backend_ops {
+	/* Returns the bytes transferred, negative on a stall or error */
+	int  (*control)(struct device *dev, int in, uint8_t request,
+			uint16_t value, void *buf, uint16_t len);
+	int  (*set_altsetting)(struct device *dev, unsigned int altsetting);
+	void (*close)(struct device *dev);
+};
+
+struct device {
+	const struct backend_ops *ops;
+	char name[64];
+
+	libusb_device_handle *handle;
+	int fd;
+	pid_t pid;
+
+	pthread_t thread;
+
+	/* Filled in by the thread */
+	unsigned int blocks, retries;
+	double download, manifest;
+	char error[96];
+};
+
+static struct {
+	const uint8_t *data;
+	size_t len;
+	unsigned int blocks;
+} image;
+
+static unsigned int altsetting;
+static unsigned int max_retries = 3;
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: stfub-flash [-d <vid>:<pid>] [-a <altsetting>] [-r <retries>] <image>\n"
+		"       stfub-flash -S <devices> [-X <stfub-sim>] [-t <percent>] [-k <key slots>]\n"
+		"                   [-e <n>] [-a <altsetting>] [-r <retries>] <image>\n"
+		"\n"
+		"  -d  USB devices to flash, every one attached (default: 0483:df11)\n"
+		"  -a  memory bank, numbered as the DFU altsettings (default: 0)\n"
+		"  -r  times a block is sent again before a device is given up (default: 3)\n"
+		"  -S  flash that many simulated devices instead\n"
+		"  -X  simulator to run (default: stfub-sim next to stfub-flash)\n"
+		"  -t  simulated flash timing, in percent of the datasheet figures\n"
+		"  -k  key slot page the simulated devices start with\n"
+		"  -e  make every n-th flash write of a simulated device fail\n");
+	exit(2);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void device_fail(struct device *dev, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(dev->error, sizeof(dev->error), fmt, ap);
+	va_end(ap);
+}
+
+static uint8_t *read_image(const char *path, size_t *len)
+{
+	uint8_t *data = NULL;
+	size_t size = 0, ret;
+	FILE *f;
+
+	f = fopen(path, "rb");
+	if (!f) {
+		perror(path);
+		exit(1);
+	}
+
+	do {
+		data = realloc(data, size + STFUB_DFU_TRANSFER_SIZE);
+		if (!data) {
+			perror("realloc");
+			exit(1);
+		}
+
+		ret   = fread(data + size, 1, STFUB_DFU_TRANSFER_SIZE, f);
+		size += ret;
+	} while (ret == STFUB_DFU_TRANSFER_SIZE);
+
+	if (ferror(f)) {
+		perror(path);
+		exit(1);
+	}
+
+	fclose(f);
+	*len = size;
+	return data;
+}
+
+/*
+   Rather find out about a broken image here than from every device.
+   Only images with an info block can be checked, the bootloader takes
+   anything else as it is.
+ */
+static void check_image(const char *path)
+{
+	const struct stfub_firmware_info *info;
+
+	if (altsetting != 0 && altsetting != STFUB_AS_RAW_FIRMWARE)
+		return;
+
+	if (altsetting == STFUB_AS_RAW_FIRMWARE) {
+		if (image.len % 4) {
+			fprintf(stderr, "%s: not a whole number of words\n",
+				path);
+			exit(1);
+		}
+		return;
+	}
+
+	info = (const struct stfub_firmware_info *)image.data;
+	if (image.len < sizeof(*info) ||
+	    stm32_crc_block(info, STFUB_INFO_BLOCK_CRC_WORDS) !=
+	    info->crc.info_block) {
+		fprintf(stderr, "%s: no valid info block, not packed?\n", path);
+		exit(1);
+	}
+
+	if (info->size % 4 || info->size > image.len - sizeof(*info)) {
+		fprintf(stderr, "%s: truncated\n", path);
+		exit(1);
+	}
+
+	/* Encrypted firmware is only checked by the device, decrypted */
+	if (!(info->flags & STFUB_FW_ENCRYPTED) &&
+	    stm32_crc_block(info + 1, info->size / 4) != info->crc.firmware) {
+		fprintf(stderr, "%s: firmware CRC mismatch\n", path);
+		exit(1);
+	}
+}
+
+static int dfu_status(struct device *dev, uint8_t status[6])
+{
+	int ret;
+
+	ret = dev->ops->control(dev, 1, DFU_GETSTATUS, 0, status, 6);
+	if (ret != 6) {
+		device_fail(dev, "GETSTATUS failed");
+		return -1;
+	}
+
+	return 0;
+}
+
+static void dfu_poll_wait(const uint8_t status[6])
+{
+	usleep((status[1] | status[2] << 8 | status[3] << 16) * 1000);
+}
+
+/*
+   Sends a block and waits until the device is done with it. Returns 0
+   if the block made it, 1 if the device wants it again and -1 if the
+   device is not to be talked to any more.
+ */
+static int download_block(struct device *dev, unsigned int block,
+			  unsigned int attempt)
+{
+	size_t offset = (size_t)block * STFUB_DFU_TRANSFER_SIZE;
+	uint16_t len = MIN(image.len - offset, STFUB_DFU_TRANSFER_SIZE);
+	uint8_t status[6];
+	int ret;
+
+	ret = dev->ops->control(dev, 0, DFU_DNLOAD, block,
+				(void *)(image.data + offset), len);
+
+	/* dfuDNLOAD-SYNC, then dfuDNBUSY for bwPollTimeout while the
+	 * block is erased and programmed */
+	while (ret >= 0) {
+		if (dfu_status(dev, status) < 0)
+			return -1;
+
+		switch (status[4]) {
+		case STATE_DFU_DNLOAD_IDLE:
+			return 0;
+		case STATE_DFU_DNBUSY:
+			dfu_poll_wait(status);
+			continue;
+		case STATE_DFU_ERROR:
+			break;
+		default:
+			device_fail(dev, "block %u: unexpected state %u",
+				    block, status[4]);
+			return -1;
+		}
+		break;
+	}
+
+	/* A stalled DNLOAD also leaves the device in dfuERROR */
+	if (dfu_status(dev, status) < 0 ||
+	    dev->ops->control(dev, 0, DFU_CLRSTATUS, 0, NULL, 0) < 0) {
+		device_fail(dev, "block %u: no way out of dfuERROR", block);
+		return -1;
+	}
+
+	if (attempt >= max_retries) {
+		device_fail(dev, "block %u: DFU status %u", block, status[0]);
+		return -1;
+	}
+
+	dev->retries++;
+	return 1;
+}
+
+/*
+   A device that is not manifestation tolerant starts the image, or
+   resets, right after it reported dfuMANIFEST-WAIT-RESET.
+ */
+static int manifest(struct device *dev)
+{
+	uint8_t status[6];
+
+	if (dev->ops->control(dev, 0, DFU_DNLOAD, image.blocks, NULL, 0) < 0) {
+		device_fail(dev, "device has not got the whole image");
+		return -1;
+	}
+
+	for (;;) {
+		if (dfu_status(dev, status) < 0)
+			return -1;
+
+		switch (status[4]) {
+		case STATE_DFU_MANIFEST:
+			dfu_poll_wait(status);
+			break;
+		case STATE_DFU_IDLE:
+		case STATE_DFU_MANIFEST_WAIT_RESET:
+			return 0;
+		case STATE_DFU_ERROR:
+			device_fail(dev, "manifestation failed, DFU status %u",
+				    status[0]);
+			return -1;
+		default:
+			device_fail(dev, "manifestation: unexpected state %u",
+				    status[4]);
+			return -1;
+		}
+	}
+}
+
+static void *flash_device(void *arg)
+{
+	struct device *dev = arg;
+	unsigned int block, attempt = 0;
+	double start;
+	int ret;
+
+	if (dev->ops->set_altsetting(dev, altsetting) < 0) {
+		device_fail(dev, "no altsetting %u", altsetting);
+		return NULL;
+	}
+
+	start = now();
+
+	for (block = 0; block < image.blocks; ) {
+		ret = download_block(dev, block, attempt);
+		if (ret < 0)
+			return NULL;
+
+		if (ret) {
+			attempt++;
+		} else {
+			dev->blocks++;
+			block++;
+			attempt = 0;
+		}
+	}
+
+	dev->download = now() - start;
+	start = now();
+
+	if (manifest(dev) < 0)
+		return NULL;
+
+	dev->manifest = now() - start;
+
+	return NULL;
+}
+
+static void usb_report(const char *what, int ret)
+{
+	fprintf(stderr, "%s: %s\n", what, libusb_error_name(ret));
+}
+
+static int usb_control(struct device *dev, int in, uint8_t request,
+		       uint16_t value, void *buf, uint16_t len)
+{
+	return libusb_control_transfer(dev->handle,
+				       LIBUSB_REQUEST_TYPE_CLASS |
+				       LIBUSB_RECIPIENT_INTERFACE |
+				       (in ? LIBUSB_ENDPOINT_IN : 0), request,
+				       value, STFUB_DFU_INTERFACE, buf, len,
+				       REQUEST_TIMEOUT_MS);
+}
+
+static int usb_set_altsetting(struct device *dev, unsigned int altsetting)
+{
+	return libusb_set_interface_alt_setting(dev->handle,
+						STFUB_DFU_INTERFACE,
+						altsetting);
+}
+
+static void usb_close(struct device *dev)
+{
+	/* Gone already if it started the image */
+	libusb_release_interface(dev->handle, STFUB_DFU_INTERFACE);
+	libusb_close(dev->handle);
+}
+
+static const struct backend_ops usb_ops = {
+	.control	= usb_control,
+	.set_altsetting	= usb_set_altsetting,
+	.close		= usb_close,
+};
+
+static unsigned int usb_open_all(struct device *devs, unsigned int vid,
+				 unsigned int pid)
+{
+	struct libusb_device_descriptor desc;
+	libusb_device **list;
+	unsigned char serial[32];
+	uint8_t ports[8];
+	unsigned int n = 0;
+	ssize_t count, i;
+	int ret, nports, j, len;
+
+	ret = libusb_init(NULL);
+	if (ret < 0) {
+		usb_report("libusb_init", ret);
+		exit(1);
+	}
+
+	count = libusb_get_device_list(NULL, &list);
+	if (count < 0) {
+		usb_report("device list", count);
+		exit(1);
+	}
+
+	for (i = 0; i < count && n < MAX_DEVICES; i++) {
+		struct device *dev = &devs[n];
+
+		if (libusb_get_device_descriptor(list[i], &desc) < 0 ||
+		    desc.idVendor != vid || desc.idProduct != pid)
+			continue;
+
+		/* Bus and port path, so that a board can be found */
+		len = snprintf(dev->name, sizeof(dev->name), "%u-",
+			       libusb_get_bus_number(list[i]));
+		nports = libusb_get_port_numbers(list[i], ports,
+						 sizeof(ports));
+		for (j = 0; j < nports; j++)
+			len += snprintf(dev->name + len,
+					sizeof(dev->name) - len, "%s%u",
+					j ? "." : "", ports[j]);
+
+		ret = libusb_open(list[i], &dev->handle);
+		if (ret < 0) {
+			usb_report(dev->name, ret);
+			continue;
+		}
+
+		ret = libusb_claim_interface(dev->handle, STFUB_DFU_INTERFACE);
+		if (ret < 0) {
+			usb_report(dev->name, ret);
+			libusb_close(dev->handle);
+			continue;
+		}
+
+		if (desc.iSerialNumber &&
+		    libusb_get_string_descriptor_ascii(dev->handle,
+						       desc.iSerialNumber,
+						       serial,
+						       sizeof(serial)) > 0)
+			snprintf(dev->name + len, sizeof(dev->name) - len,
+				 " %s", serial);
+
+		dev->ops = &usb_ops;
+		n++;
+	}
+
+	libusb_free_device_list(list, 1);
+
+	if (!n) {
+		fprintf(stderr, "no device %04x:%04x found\n", vid, pid);
+		exit(1);
+	}
+
+	return n;
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	ssize_t ret;
+
+	while (len) {
+		ret = write(fd, p, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		p   += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+static int read_all(int fd, void *buf, size_t len)
+{
+	uint8_t *p = buf;
+	ssize_t ret;
+
+	while (len) {
+		ret = read(fd, p, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		p   += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+static int sim_request(struct device *dev, uint8_t type, uint8_t request,
+		       uint16_t value, void *buf, uint16_t len)
+{
+	struct stfub_sim_request req;
+	struct stfub_sim_reply reply;
+
+	req.bmRequestType = type;
+	req.bRequest	  = request;
+	req.wValue	  = value;
+	req.wIndex	  = STFUB_DFU_INTERFACE;
+	req.wLength	  = len;
+
+	if (write_all(dev->fd, &req, sizeof(req)) < 0 ||
+	    (!(type & 0x80) && write_all(dev->fd, buf, len) < 0) ||
+	    read_all(dev->fd, &reply, sizeof(reply)) < 0)
+		return -1;
+
+	if (reply.length < 0 || reply.length > len ||
+	    read_all(dev->fd, buf, reply.length) < 0)
+		return -1;
+
+	return (type & 0x80) ? reply.length : len;
+}
+
+static int sim_control(struct device *dev, int in, uint8_t request,
+		       uint16_t value, void *buf, uint16_t len)
+{
+	return sim_request(dev, 0x21 | (in ? 0x80 : 0), request, value,
+			   buf, len);
+}
+
+static int sim_set_altsetting(struct device *dev, unsigned int altsetting)
+{
+	return sim_request(dev, 0x01, STFUB_SIM_SET_INTERFACE, altsetting,
+			   NULL, 0);
+}
+
+static void sim_close(struct device *dev)
+{
+	close(dev->fd);
+	waitpid(dev->pid, NULL, 0);
+}
+
+static const struct backend_ops sim_ops = {
+	.control	= sim_control,
+	.set_altsetting	= sim_set_altsetting,
+	.close		= sim_close,
+};
+
+static unsigned int sim_start_all(struct device *devs, unsigned int n,
+				  const char *sim, const char *timing,
+				  const char *keys, const char *failures)
+{
+	const char *args[10];
+	char fdarg[16];
+	unsigned int i;
+	int sv[2], argc = 0;
+
+	/* Simulated devices do not check what stfub-flash writes */
+	signal(SIGPIPE, SIG_IGN);
+
+	for (i = 0; i < n; i++) {
+		/* Or the other simulators would keep this one's end open */
+		if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+			perror("socketpair");
+			exit(1);
+		}
+
+		devs[i].pid = fork();
+		if (devs[i].pid < 0) {
+			perror("fork");
+			exit(1);
+		}
+
+		/* dfu.c keeps its state in statics, hence a process each */
+		if (!devs[i].pid) {
+			fcntl(sv[1], F_SETFD, 0);
+			snprintf(fdarg, sizeof(fdarg), "%d", sv[1]);
+
+			args[argc++] = sim;
+			args[argc++] = "-f";
+			args[argc++] = fdarg;
+			if (timing) {
+				args[argc++] = "-t";
+				args[argc++] = timing;
+			}
+			if (keys) {
+				args[argc++] = "-k";
+				args[argc++] = keys;
+			}
+			if (failures) {
+				args[argc++] = "-e";
+				args[argc++] = failures;
+			}
+			args[argc] = NULL;
+
+			execv(sim, (char **)args);
+			perror(sim);
+			_exit(1);
+		}
+
+		close(sv[1]);
+		devs[i].fd  = sv[0];
+		devs[i].ops = &sim_ops;
+		snprintf(devs[i].name, sizeof(devs[i].name), "sim%u", i);
+	}
+
+	return n;
+}
+
+int main(int argc, char **argv)
+{
+	static struct device devs[MAX_DEVICES];
+	unsigned int vid = 0x0483, pid = 0xDF11, ndevs, nsim = 0, i, ok = 0;
+	const char *sim = NULL, *timing = NULL, *keys = NULL, *failures = NULL;
+	char sim_path[PATH_MAX];
+	double start, elapsed;
+	size_t len;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "d:a:r:S:X:t:k:e:")) != -1) {
+		switch (opt) {
+		case 'd':
+			if (sscanf(optarg, "%x:%x", &vid, &pid) != 2)
+				usage();
+			break;
+		case 'a':
+			altsetting = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			max_retries = strtoul(optarg, NULL, 0);
+			break;
+		case 'S':
+			nsim = strtoul(optarg, NULL, 0);
+			if (!nsim || nsim > MAX_DEVICES)
+				usage();
+			break;
+		case 'X':
+			sim = optarg;
+			break;
+		case 't':
+			timing = optarg;
+			break;
+		case 'k':
+			keys = optarg;
+			break;
+		case 'e':
+			failures = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (optind != argc - 1)
+		usage();
+
+	image.data   = read_image(argv[optind], &len);
+	image.len    = len;
+	image.blocks = (len + STFUB_DFU_TRANSFER_SIZE - 1) /
+		STFUB_DFU_TRANSFER_SIZE;
+	check_image(argv[optind]);
+
+	if (nsim) {
+		if (!sim) {
+			snprintf(sim_path, sizeof(sim_path), "%s/stfub-sim",
+				 dirname(strdup(argv[0])));
+			sim = sim_path;
+		}
+		ndevs = sim_start_all(devs, nsim, sim, timing, keys,
+				      failures);
+	} else {
+		ndevs = usb_open_all(devs, vid, pid);
+	}
+
+	fprintf(stderr, "flashing %zu bytes (%u blocks) to %u devices\n",
+		image.len, image.blocks, ndevs);
+
+	start = now();
+
+	for (i = 0; i < ndevs; i++)
+		if (pthread_create(&devs[i].thread, NULL, flash_device,
+				   &devs[i])) {
+			perror("pthread_create");
+			exit(1);
+		}
+
+	for (i = 0; i < ndevs; i++)
+		pthread_join(devs[i].thread, NULL);
+
+	elapsed = now() - start;
+
+	printf("%-24s %6s %7s %9s %9s %8s  %s\n", "device", "blocks",
+	       "retries", "download", "manifest", "KiB/s", "result");
+
+	for (i = 0; i < ndevs; i++) {
+		struct device *dev = &devs[i];
+
+		printf("%-24s %6u %7u %8.2fs %8.2fs %8.1f  %s\n", dev->name,
+		       dev->blocks, dev->retries, dev->download,
+		       dev->manifest, dev->download ?
+		       image.len / dev->download / 1024 : 0.0,
+		       dev->error[0] ? dev->error : "ok");
+
+		ok += !dev->error[0];
+		dev->ops->close(dev);
+	}
+
+	printf("%u of %u devices flashed in %.2fs, %.1f KiB/s overall\n",
+	       ok, ndevs, elapsed, ok * image.len / elapsed / 1024);
+
+	if (!nsim)
+		libusb_exit(NULL);
+
+	return ok == ndevs ? 0 : 1;
+}
@@ -0,0 +1,1136 @@
+/*
+ * This file is part of the stfuboot project.
+ *
+ * Copyright (C) 2012 Innovative Converged Devices (ICD)
+ *
+ * Author(s):
+ *          Andrey Smirnov <andrey.smirnov@convergeddevices.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * stfub-image -- native replacement for stfub-prefix.
+ *
+ * Produces the 512 byte info block prefix expected by the bootloader,
+ * verifies already prefixed images, decodes compressed uploads and
+ * benchmarks the CRC code.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <elf.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <libstfub/info_block.h>
+#include <libstfub/key_slots.h>
+#include <libstfub/statistics.h>
+#include <libstfub/fault.h>
+#include <libstfub/rle.h>
+#include <libstfub/wear.h>
+
+#include "aes.h"
+#include "crc.h"
+#include "ed25519.h"
+#include "rle.h"
+#include "sha256.h"
+#include "stm32-crc.h"
+
+#define STFUB_AP_ROM_START	0x08004A00
+/* Where the application starts with a bootloader built with STFUB_CRYPTO */
+#define STFUB_AP_ROM_START_CRYPTO	0x08009A00
+#define STFUB_KY_ROM_SIZE	2048
+#define STREAM_CHUNK_SIZE	(64 * 1024)
+
+#define MIN(a, b) ((a)<(b) ? (a) : (b))
+
+struct image {
+	uint8_t *data;
+	size_t   len;
+	bool	 mapped;
+};
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: stfub-image pack [-m] [-k <key>] [-S <seed>] [-s <slot>] [-o <output>] <firmware.bin|firmware.elf>\n"
+		"       stfub-image verify [-k <key>] [-p <public key>] <image>\n"
+		"       stfub-image keys -o <output> <key>[,<public key>]...\n"
+		"       stfub-image genkey <name>\n"
+		"       stfub-image wear <counters>\n"
+		"       stfub-image stats <statistics>\n"
+		"       stfub-image fault <record>\n"
+		"       stfub-image unrle <upload> <output>\n"
+		"       stfub-image bench [<megabytes>]\n"
+		"\n"
+		"  -m  map the input instead of streaming it through a buffer\n"
+		"  -k  encrypt the firmware with the raw 16 byte AES key in <key>\n"
+		"  -S  sign the firmware with the Ed25519 key derived from <seed>\n"
+		"  -s  key slot the bootloader should use (default: 0)\n"
+		"  -o  write the prefixed image to <output> (default: in place)\n");
+	exit(2);
+}
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static void write_all(int fd, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	ssize_t ret;
+
+	while (len) {
+		ret = write(fd, p, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			die("write");
+		}
+		p   += ret;
+		len -= ret;
+	}
+}
+
+static size_t read_full(int fd, void *buf, size_t len)
+{
+	uint8_t *p = buf;
+	size_t done = 0;
+	ssize_t ret;
+
+	while (done < len) {
+		ret = read(fd, p + done, len - done);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			die("read");
+		}
+		if (ret == 0)
+			break;
+		done += ret;
+	}
+
+	return done;
+}
+
+static void image_map(struct image *img, const char *path)
+{
+	struct stat st;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		die(path);
+
+	if (fstat(fd, &st) < 0)
+		die("fstat");
+
+	img->len    = st.st_size;
+	img->mapped = true;
+	img->data   = NULL;
+
+	if (img->len) {
+		img->data = mmap(NULL, img->len, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (img->data == MAP_FAILED)
+			die("mmap");
+	}
+
+	close(fd);
+}
+
+static void image_release(struct image *img)
+{
+	if (img->mapped) {
+		if (img->len)
+			munmap(img->data, img->len);
+	} else {
+		free(img->data);
+	}
+}
+
+static bool image_is_elf(const struct image *img)
+{
+	return img->len >= SELFMAG && !memcmp(img->data, ELFMAG, SELFMAG);
+}
+
+/*
+ * Flatten the loadable segments of an ELF file into a binary image
+ * starting at the lowest load address, filling the gaps with the
+ * erased flash value.
+ */
+static void image_from_elf(struct image *bin, const struct image *elf)
+{
+	const Elf32_Ehdr *ehdr = (const Elf32_Ehdr *)elf->data;
+	const Elf32_Phdr *phdr;
+	uint32_t lo = UINT32_MAX, hi = 0;
+	int i;
+
+	if (elf->len < sizeof(*ehdr) ||
+	    ehdr->e_ident[EI_CLASS] != ELFCLASS32 ||
+	    ehdr->e_ident[EI_DATA]  != ELFDATA2LSB ||
+	    ehdr->e_machine != EM_ARM) {
+		fprintf(stderr, "not a little-endian 32-bit ARM ELF file\n");
+		exit(1);
+	}
+
+	if (ehdr->e_phoff + (size_t)ehdr->e_phnum * sizeof(*phdr) > elf->len) {
+		fprintf(stderr, "truncated ELF program header table\n");
+		exit(1);
+	}
+
+	phdr = (const Elf32_Phdr *)(elf->data + ehdr->e_phoff);
+
+	for (i = 0; i < ehdr->e_phnum; i++) {
+		if (phdr[i].p_type != PT_LOAD || !phdr[i].p_filesz)
+			continue;
+		if (phdr[i].p_offset + phdr[i].p_filesz > elf->len) {
+			fprintf(stderr, "segment %d lies outside of the file\n", i);
+			exit(1);
+		}
+		if (phdr[i].p_paddr < lo)
+			lo = phdr[i].p_paddr;
+		if (phdr[i].p_paddr + phdr[i].p_filesz > hi)
+			hi = phdr[i].p_paddr + phdr[i].p_filesz;
+	}
+
+	if (lo >= hi) {
+		fprintf(stderr, "ELF file has no loadable contents\n");
+		exit(1);
+	}
+
+	if (lo != STFUB_AP_ROM_START && lo != STFUB_AP_ROM_START_CRYPTO)
+		fprintf(stderr, "warning: image is linked at 0x%08x, "
+			"the application area starts at 0x%08x "
+			"(0x%08x with STFUB_CRYPTO)\n",
+			lo, STFUB_AP_ROM_START, STFUB_AP_ROM_START_CRYPTO);
+
+	bin->len    = hi - lo;
+	bin->mapped = false;
+	bin->data   = malloc(bin->len);
+	if (!bin->data)
+		die("malloc");
+
+	memset(bin->data, 0xFF, bin->len);
+
+	for (i = 0; i < ehdr->e_phnum; i++) {
+		if (phdr[i].p_type != PT_LOAD || !phdr[i].p_filesz)
+			continue;
+		memcpy(bin->data + (phdr[i].p_paddr - lo),
+		       elf->data + phdr[i].p_offset, phdr[i].p_filesz);
+	}
+}
+
+static struct {
+	bool			enabled;
+	uint8_t			key_slot;
+	uint8_t			nonce[STFUB_AES_NONCE_SIZE];
+	struct stfub_aes_ctx	aes;
+} cipher;
+
+static struct {
+	bool			enabled;
+	uint8_t			key_slot;
+	uint8_t			seed[STFUB_ED25519_SEED_SIZE];
+} signer;
+
+/* Running checksums over the plaintext firmware */
+struct firmware_sums {
+	uint32_t		crc;
+	struct stfub_sha256_ctx	sha;
+};
+
+static void sums_init(struct firmware_sums *sums)
+{
+	sums->crc = STM32_CRC_INIT;
+	stfub_sha256_init(&sums->sha);
+}
+
+static void sums_update(struct firmware_sums *sums, const uint8_t *buf,
+			size_t len)
+{
+	sums->crc = stm32_crc_update(sums->crc, buf, len / 4);
+	stfub_sha256_update(&sums->sha, buf, len);
+}
+
+static void info_block_fill(struct stfub_firmware_info *info,
+			    uint32_t size, struct firmware_sums *sums)
+{
+	memset(info, 0, sizeof(*info));
+
+	info->size		= size;
+	info->crc.firmware	= sums->crc;
+
+	if (cipher.enabled) {
+		info->flags		|= STFUB_FW_ENCRYPTED;
+		info->cipher.key_slot	 = cipher.key_slot;
+		memcpy(info->cipher.nonce, cipher.nonce, sizeof(cipher.nonce));
+	}
+
+	stfub_sha256_final(&sums->sha, info->signature.digest);
+
+	if (signer.enabled) {
+		info->flags		   |= STFUB_FW_SIGNED;
+		info->signature.key_slot    = signer.key_slot;
+		stfub_ed25519_sign(info->signature.value,
+				   info->signature.digest,
+				   sizeof(info->signature.digest),
+				   signer.seed);
+	}
+
+	info->crc.info_block	= stm32_crc_block(info,
+						  STFUB_INFO_BLOCK_CRC_WORDS);
+}
+
+/*
+ * The bootloader checks size / 4 words, so the image is padded to a
+ * word boundary with the erased flash value to keep its tail covered
+ * by the CRC.
+ */
+static size_t pad_to_word(uint8_t *buf, size_t len)
+{
+	while (len % 4)
+		buf[len++] = 0xFF;
+
+	return len;
+}
+
+/* Write firmware data found at @offset within the image, encrypting
+ * it on the way out if requested. The checksums are always computed
+ * over the plaintext since that is what ends up in flash. */
+static void write_firmware(int out, uint8_t *buf, size_t len, size_t offset)
+{
+	if (cipher.enabled)
+		stfub_aes_ctr_crypt(&cipher.aes, cipher.nonce, offset, buf, len);
+
+	write_all(out, buf, len);
+}
+
+static uint32_t pack_buffer(int out, const uint8_t *data, size_t len)
+{
+	struct stfub_firmware_info info;
+	static uint8_t chunk[STREAM_CHUNK_SIZE + 4];
+	struct firmware_sums sums;
+	size_t rest = len % 4;
+	size_t offset, n;
+
+	len -= rest;
+
+	sums_init(&sums);
+	sums_update(&sums, data, len);
+
+	if (rest) {
+		memcpy(chunk, data + len, rest);
+		sums_update(&sums, chunk, pad_to_word(chunk, rest));
+	}
+
+	info_block_fill(&info, len + (rest ? 4 : 0), &sums);
+	write_all(out, &info, sizeof(info));
+
+	if (!cipher.enabled) {
+		write_all(out, data, len);
+	} else {
+		for (offset = 0; offset < len; offset += n) {
+			n = MIN(STREAM_CHUNK_SIZE, len - offset);
+			memcpy(chunk, data + offset, n);
+			write_firmware(out, chunk, n, offset);
+		}
+	}
+
+	if (rest) {
+		memcpy(chunk, data + len, rest);
+		write_firmware(out, chunk, pad_to_word(chunk, rest), len);
+	}
+
+	return info.size;
+}
+
+/*
+ * Single pass over the input: the data is copied and checksummed in
+ * fixed-size chunks and the header, written as a placeholder first,
+ * is filled in once the totals are known.
+ */
+static uint32_t pack_stream(int out, int in)
+{
+	struct stfub_firmware_info info;
+	static uint8_t chunk[STREAM_CHUNK_SIZE + 4];
+	struct firmware_sums sums;
+	size_t len, total = 0;
+
+	memset(&info, 0xFF, sizeof(info));
+	write_all(out, &info, sizeof(info));
+
+	sums_init(&sums);
+
+	do {
+		len = read_full(in, chunk, STREAM_CHUNK_SIZE);
+		if (len % 4)
+			len = pad_to_word(chunk, len);
+
+		sums_update(&sums, chunk, len);
+		write_firmware(out, chunk, len, total);
+		total += len;
+	} while (len == STREAM_CHUNK_SIZE);
+
+	info_block_fill(&info, total, &sums);
+
+	if (pwrite(out, &info, sizeof(info), 0) != sizeof(info))
+		die("pwrite");
+
+	return info.size;
+}
+
+static void read_exactly(const char *path, uint8_t *buf, size_t len)
+{
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		die(path);
+
+	if (read_full(fd, buf, len) != len) {
+		fprintf(stderr, "%s: expected %zu raw bytes\n", path, len);
+		exit(1);
+	}
+
+	close(fd);
+}
+
+static void read_key(const char *path, uint8_t *key)
+{
+	read_exactly(path, key, STFUB_AES_KEY_SIZE);
+}
+
+static void random_bytes(uint8_t *buf, size_t len)
+{
+	int fd;
+
+	fd = open("/dev/urandom", O_RDONLY);
+	if (fd < 0 || read_full(fd, buf, len) != len)
+		die("/dev/urandom");
+	close(fd);
+}
+
+static void check_slot(unsigned long slot)
+{
+	if (slot >= STFUB_KEY_SLOT_COUNT) {
+		fprintf(stderr, "key slot must be below %d\n",
+			STFUB_KEY_SLOT_COUNT);
+		exit(1);
+	}
+}
+
+static void cipher_setup(const char *key_path, unsigned long slot)
+{
+	uint8_t key[STFUB_AES_KEY_SIZE];
+
+	check_slot(slot);
+	read_key(key_path, key);
+	random_bytes(cipher.nonce, sizeof(cipher.nonce));
+
+	stfub_aes_set_key(&cipher.aes, key);
+	cipher.key_slot = slot;
+	cipher.enabled  = true;
+}
+
+static void signer_setup(const char *seed_path, unsigned long slot)
+{
+	check_slot(slot);
+	read_exactly(seed_path, signer.seed, sizeof(signer.seed));
+
+	signer.key_slot = slot;
+	signer.enabled  = true;
+}
+
+static int cmd_pack(int argc, char **argv)
+{
+	struct image input, elf;
+	uint8_t magic[SELFMAG];
+	const char *output = NULL, *path;
+	char *tmp = NULL;
+	const char *key = NULL, *seed = NULL;
+	unsigned long slot = 0;
+	bool use_mmap = false;
+	uint32_t size;
+	int opt, out, in;
+
+	while ((opt = getopt(argc, argv, "k:mo:s:S:")) != -1) {
+		switch (opt) {
+		case 'k':
+			key = optarg;
+			break;
+		case 'S':
+			seed = optarg;
+			break;
+		case 's':
+			slot = strtoul(optarg, NULL, 0);
+			break;
+		case 'm':
+			use_mmap = true;
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (optind != argc - 1)
+		usage();
+
+	path = argv[optind];
+
+	if (key)
+		cipher_setup(key, slot);
+	if (seed)
+		signer_setup(seed, slot);
+
+	if (!output) {
+		/* Mimic stfub-prefix and replace the input file */
+		if (asprintf(&tmp, "%s.XXXXXX", path) < 0)
+			die("asprintf");
+		out = mkstemp(tmp);
+	} else {
+		out = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	}
+	if (out < 0)
+		die(output ? output : tmp);
+
+	in = open(path, O_RDONLY);
+	if (in < 0)
+		die(path);
+
+	/* mkstemp() creates the file 0600, keep the input's mode instead */
+	if (tmp) {
+		struct stat st;
+		mode_t mask;
+
+		mask = umask(0);
+		umask(mask);
+
+		if (fstat(in, &st) < 0 ||
+		    fchmod(out, st.st_mode & 07777 & ~mask) < 0)
+			die(tmp);
+	}
+
+	/* ELF files are flattened in memory, so they are always mapped */
+	if (read_full(in, magic, SELFMAG) == SELFMAG &&
+	    !memcmp(magic, ELFMAG, SELFMAG))
+		use_mmap = true;
+
+	if (use_mmap) {
+		close(in);
+		image_map(&input, path);
+
+		if (image_is_elf(&input)) {
+			elf = input;
+			image_from_elf(&input, &elf);
+			image_release(&elf);
+		}
+
+		size = pack_buffer(out, input.data, input.len);
+		image_release(&input);
+	} else {
+		if (lseek(in, 0, SEEK_SET) < 0)
+			die("lseek");
+		size = pack_stream(out, in);
+		close(in);
+	}
+
+	if (fsync(out) < 0 || close(out) < 0)
+		die("close");
+
+	if (tmp) {
+		if (rename(tmp, path) < 0)
+			die("rename");
+		free(tmp);
+	}
+
+	printf("Filesize: %u\n", size);
+
+	return 0;
+}
+
+static int cmd_verify(int argc, char **argv)
+{
+	const struct stfub_firmware_info *info;
+	uint8_t key[STFUB_AES_KEY_SIZE];
+	uint8_t public_key[STFUB_ED25519_PUBLIC_KEY_SIZE];
+	uint8_t digest[STFUB_SHA256_DIGEST_SIZE];
+	struct stfub_sha256_ctx sha;
+	struct stfub_aes_ctx aes;
+	const char *key_path = NULL, *public_key_path = NULL;
+	bool ok;
+	uint8_t *firmware = NULL;
+	struct image img;
+	uint32_t crc;
+	int opt, ret = 0;
+
+	while ((opt = getopt(argc, argv, "k:p:")) != -1) {
+		switch (opt) {
+		case 'k':
+			key_path = optarg;
+			break;
+		case 'p':
+			public_key_path = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (optind != argc - 1)
+		usage();
+
+	image_map(&img, argv[optind]);
+
+	if (img.len < sizeof(*info)) {
+		fprintf(stderr, "%s: too short to contain an info block\n",
+			argv[optind]);
+		return 1;
+	}
+
+	info = (const struct stfub_firmware_info *)img.data;
+
+	crc = stfub_crc_block(info, STFUB_INFO_BLOCK_CRC_WORDS);
+	printf("Info block CRC: 0x%08x (expected 0x%08x) %s\n",
+	       crc, info->crc.info_block,
+	       crc == info->crc.info_block ? "OK" : "MISMATCH");
+	if (crc != info->crc.info_block)
+		ret = 1;
+
+	printf("Firmware size:  %u\n", info->size);
+	if (info->flags & STFUB_FW_ENCRYPTED)
+		printf("Encrypted:      key slot %u\n", info->cipher.key_slot);
+
+	if (info->size > img.len - sizeof(*info)) {
+		printf("Firmware size exceeds the %zu bytes present\n",
+		       img.len - sizeof(*info));
+		ret = 1;
+	} else if ((info->flags & STFUB_FW_ENCRYPTED) && !key_path) {
+		printf("Firmware CRC:   not checked, pass -k to decrypt\n");
+	} else {
+		firmware = malloc(info->size + 1);
+		if (!firmware)
+			die("malloc");
+		memcpy(firmware, img.data + sizeof(*info), info->size);
+
+		if (info->flags & STFUB_FW_ENCRYPTED) {
+			read_key(key_path, key);
+			stfub_aes_set_key(&aes, key);
+			stfub_aes_ctr_crypt(&aes, info->cipher.nonce, 0,
+					    firmware, info->size);
+		}
+
+		crc = stfub_crc_block(firmware, info->size / 4);
+		printf("Firmware CRC:   0x%08x (expected 0x%08x) %s\n",
+		       crc, info->crc.firmware,
+		       crc == info->crc.firmware ? "OK" : "MISMATCH");
+		if (crc != info->crc.firmware)
+			ret = 1;
+
+		stfub_sha256_init(&sha);
+		stfub_sha256_update(&sha, firmware, info->size);
+		stfub_sha256_final(&sha, digest);
+		ok = !memcmp(digest, info->signature.digest, sizeof(digest));
+		printf("SHA-256:        %s\n", ok ? "OK" : "MISMATCH");
+		if (!ok && (info->flags & STFUB_FW_SIGNED))
+			ret = 1;
+
+		free(firmware);
+	}
+
+	if (!(info->flags & STFUB_FW_SIGNED)) {
+		printf("Signature:      none\n");
+	} else if (!public_key_path) {
+		printf("Signature:      key slot %u, not checked, pass -p\n",
+		       info->signature.key_slot);
+	} else {
+		read_exactly(public_key_path, public_key, sizeof(public_key));
+		ok = stfub_ed25519_verify(info->signature.value,
+					  info->signature.digest,
+					  sizeof(info->signature.digest),
+					  public_key);
+		printf("Signature:      key slot %u %s\n",
+		       info->signature.key_slot, ok ? "OK" : "BAD");
+		if (!ok)
+			ret = 1;
+	}
+
+	image_release(&img);
+
+	return ret;
+}
+
+/* Build the key slot page that is flashed to the start of ky_rom */
+static int cmd_keys(int argc, char **argv)
+{
+	struct stfub_key_slot slots[STFUB_KEY_SLOT_COUNT];
+	uint8_t page[STFUB_KY_ROM_SIZE];
+	const char *output = NULL;
+	char *arg, *comma;
+	int opt, out, i;
+
+	while ((opt = getopt(argc, argv, "o:")) != -1) {
+		switch (opt) {
+		case 'o':
+			output = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (!output || optind == argc ||
+	    argc - optind > STFUB_KEY_SLOT_COUNT)
+		usage();
+
+	memset(slots, 0xFF, sizeof(slots));
+	for (i = 0; optind + i < argc; i++) {
+		/* <aes key>[,<ed25519 public key>], either may be empty */
+		arg   = strdup(argv[optind + i]);
+		comma = strchr(arg, ',');
+		if (comma)
+			*comma++ = '\0';
+
+		if (*arg)
+			read_key(arg, slots[i].aes);
+		if (comma && *comma)
+			read_exactly(comma, slots[i].ed25519,
+				     sizeof(slots[i].ed25519));
+
+		free(arg);
+	}
+
+	memset(page, 0xFF, sizeof(page));
+	memcpy(page, slots, sizeof(slots));
+
+	out = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (out < 0)
+		die(output);
+	write_all(out, page, sizeof(page));
+	if (close(out) < 0)
+		die("close");
+
+	return 0;
+}
+
+static void write_file(const char *base, const char *ext, mode_t mode,
+		       const uint8_t *buf, size_t len)
+{
+	char *path;
+	int out;
+
+	if (asprintf(&path, "%s.%s", base, ext) < 0)
+		die("asprintf");
+
+	out = open(path, O_WRONLY | O_CREAT | O_EXCL, mode);
+	if (out < 0)
+		die(path);
+	write_all(out, buf, len);
+	if (close(out) < 0)
+		die("close");
+
+	printf("%s\n", path);
+	free(path);
+}
+
+/* Generate a fresh AES key and Ed25519 key pair */
+static int cmd_genkey(int argc, char **argv)
+{
+	uint8_t aes[STFUB_AES_KEY_SIZE];
+	uint8_t seed[STFUB_ED25519_SEED_SIZE];
+	uint8_t public_key[STFUB_ED25519_PUBLIC_KEY_SIZE];
+
+	if (argc != 2)
+		usage();
+
+	random_bytes(aes, sizeof(aes));
+	random_bytes(seed, sizeof(seed));
+	stfub_ed25519_public_key(public_key, seed);
+
+	write_file(argv[1], "aes",  0600, aes, sizeof(aes));
+	write_file(argv[1], "seed", 0600, seed, sizeof(seed));
+	write_file(argv[1], "pub",  0644, public_key, sizeof(public_key));
+
+	return 0;
+}
+
+/* Print the erase counters uploaded from the "Wear Counters" altsetting */
+static int cmd_wear(int argc, char **argv)
+{
+	struct stfub_wear_counters counters;
+	unsigned int i;
+
+	if (argc != 2)
+		usage();
+
+	read_exactly(argv[1], (uint8_t *)&counters, sizeof(counters));
+
+	if (counters.magic != STFUB_WEAR_MAGIC ||
+	    counters.pages > STFUB_WEAR_MAX_PAGES) {
+		fprintf(stderr, "%s: not an erase counter dump\n", argv[1]);
+		return 1;
+	}
+
+	printf("log rewritten %u times\n", counters.compactions);
+	for (i = 0; i < counters.pages; i++)
+		if (counters.page_size)
+			printf("0x%08x %u\n",
+			       counters.first_page + i * counters.page_size,
+			       counters.erases[i]);
+		else	/* sectors of different sizes */
+			printf("sector %u after 0x%08x %u\n", i,
+			       counters.first_page, counters.erases[i]);
+
+	return 0;
+}
+
+/* Print the counters uploaded from the "Statistics" altsetting */
+static int cmd_stats(int argc, char **argv)
+{
+	static const char * const requests[STFUB_STATISTICS_REQUESTS] = {
+		"DETACH", "DNLOAD", "UPLOAD", "GETSTATUS",
+		"CLRSTATUS", "GETSTATE", "ABORT",
+	};
+	struct stfub_statistics st;
+	unsigned int i;
+
+	if (argc != 2)
+		usage();
+
+	read_exactly(argv[1], (uint8_t *)&st, sizeof(st));
+
+	if (st.magic != STFUB_STATISTICS_MAGIC) {
+		fprintf(stderr, "%s: not a statistics dump\n", argv[1]);
+		return 1;
+	}
+
+	printf("blocks_received %u\n", st.blocks_received);
+	printf("bytes_programmed %u\n", st.bytes_programmed);
+	printf("pages_erased %u\n", st.pages_erased);
+	printf("pages_skipped %u\n", st.pages_skipped);
+	printf("erase_cycles %u\n", st.erase_cycles);
+	printf("program_cycles %u\n", st.program_cycles);
+	if (st.bytes_programmed)
+		printf("program_cycles_per_halfword %.1f\n",
+		       2.0 * st.program_cycles / st.bytes_programmed);
+	for (i = 0; i < STFUB_STATISTICS_REQUESTS; i++)
+		printf("requests.%s %u\n", requests[i], st.requests[i]);
+	printf("stalls %u\n", st.stalls);
+	printf("uart_drops %u\n", st.uart_drops);
+	printf("boot.firmware_check %u\n", st.boot.firmware_check);
+	printf("boot.main %u\n", st.boot.main);
+	printf("boot.usb_ready %u\n", st.boot.usb_ready);
+	printf("boot.first_request %u\n", st.boot.first_request);
+
+	return 0;
+}
+
+/* Print the record uploaded from the "Fault Record" altsetting */
+static int cmd_fault(int argc, char **argv)
+{
+	static const char * const exceptions[] = {
+		[3] = "HardFault", [4] = "MemManage",
+		[5] = "BusFault",  [6] = "UsageFault",
+	};
+	struct stfub_fault_record rec;
+	unsigned int i;
+
+	if (argc != 2)
+		usage();
+
+	read_exactly(argv[1], (uint8_t *)&rec, sizeof(rec));
+
+	if (rec.magic != STFUB_FAULT_MAGIC ||
+	    stm32_crc_block(&rec, offsetof(struct stfub_fault_record, crc) / 4) !=
+	    rec.crc) {
+		fprintf(stderr, "%s: not a fault record\n", argv[1]);
+		return 1;
+	}
+
+	printf("%s (exception %u), %u fault(s) recorded\n",
+	       rec.exception < 7 && exceptions[rec.exception] ?
+	       exceptions[rec.exception] : "unknown", rec.exception, rec.count);
+	printf("pc   0x%08x  lr   0x%08x  xpsr 0x%08x\n",
+	       rec.frame.pc, rec.frame.lr, rec.frame.xpsr);
+	printf("r0   0x%08x  r1   0x%08x  r2   0x%08x  r3   0x%08x\n",
+	       rec.frame.r0, rec.frame.r1, rec.frame.r2, rec.frame.r3);
+	printf("r12  0x%08x  sp   0x%08x  exc_return 0x%08x\n",
+	       rec.frame.r12, rec.sp, rec.exc_return);
+	printf("cfsr 0x%08x  hfsr 0x%08x  mmfar 0x%08x  bfar 0x%08x\n",
+	       rec.cfsr, rec.hfsr, rec.mmfar, rec.bfar);
+
+	for (i = 0; i < STFUB_FAULT_STACK_WORDS; i++)
+		printf("%s0x%08x: 0x%08x", i % 4 ? "  " : "\n",
+		       rec.sp + 4 * i, rec.stack[i]);
+	printf("\n");
+
+	return 0;
+}
+
+/*
+ * Expand a stream uploaded from the "Main Memory (RLE)" altsetting,
+ * returns the decoded image or NULL if the stream is malformed.
+ */
+static uint8_t *rle_decode(const uint8_t *in, size_t len,
+			   struct stfub_rle_header *header)
+{
+	const uint8_t *end = in + len;
+	uint8_t *out, *p;
+	uint32_t words, value, left;
+	uint16_t control;
+
+	if (len < sizeof(*header))
+		return NULL;
+
+	memcpy(header, in, sizeof(*header));
+	in += sizeof(*header);
+
+	if (header->magic != STFUB_RLE_MAGIC || header->length % 4)
+		return NULL;
+
+	out = malloc(header->length ? header->length : 1);
+	if (!out)
+		die("malloc");
+
+	p = out;
+	left = header->length / 4;
+
+	while (left) {
+		if (end - in < 2)
+			goto malformed;
+		control = in[0] | in[1] << 8;
+		in += 2;
+
+		words = (control & ~STFUB_RLE_RUN) + 1;
+		if (words > left)
+			goto malformed;
+
+		if (control & STFUB_RLE_RUN) {
+			if (end - in < 4)
+				goto malformed;
+			memcpy(&value, in, 4);
+			in += 4;
+			for (left -= words; words; words--, p += 4)
+				memcpy(p, &value, 4);
+		} else {
+			if ((size_t)(end - in) < words * 4)
+				goto malformed;
+			memcpy(p, in, words * 4);
+			in   += words * 4;
+			p    += words * 4;
+			left -= words;
+		}
+	}
+
+	if (in != end)
+		goto malformed;
+
+	return out;
+
+malformed:
+	free(out);
+	return NULL;
+}
+
+static int cmd_unrle(int argc, char **argv)
+{
+	struct stfub_rle_header header;
+	struct image upload;
+	uint8_t *image;
+	int out;
+
+	if (argc != 3)
+		usage();
+
+	image_map(&upload, argv[1]);
+
+	image = rle_decode(upload.data, upload.len, &header);
+	if (!image) {
+		fprintf(stderr, "%s: not a complete compressed upload\n",
+			argv[1]);
+		return 1;
+	}
+
+	out = open(argv[2], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (out < 0)
+		die(argv[2]);
+	write_all(out, image, header.length);
+	if (close(out) < 0)
+		die("close");
+
+	printf("0x%08x - 0x%08x: %u bytes from %zu (%.1f%%)\n",
+	       header.start, header.start + header.length, header.length,
+	       upload.len, header.length ? 100.0 * upload.len / header.length : 0);
+
+	free(image);
+	image_release(&upload);
+
+	return 0;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int cmd_bench(int argc, char **argv)
+{
+	size_t megabytes = 64, len, i;
+	uint32_t crc_ref, crc_fast, seed = 0x12345678;
+	double t0, t_ref, t_fast, t_aes, t_sha, t_sig, t_rle;
+	struct stfub_rle_header rle_header;
+	uint8_t *rle, *unrle;
+	size_t rle_len;
+	int n;
+	uint8_t digest[STFUB_SHA256_DIGEST_SIZE];
+	uint8_t public_key[STFUB_ED25519_PUBLIC_KEY_SIZE];
+	uint8_t signature[STFUB_ED25519_SIGNATURE_SIZE];
+	struct stfub_sha256_ctx sha;
+	struct stfub_aes_ctx aes;
+	bool ok;
+	uint8_t *buf;
+
+	if (argc > 2)
+		usage();
+	if (argc == 2)
+		megabytes = strtoul(argv[1], NULL, 0);
+	if (!megabytes)
+		usage();
+
+	len = megabytes << 20;
+	buf = malloc(len);
+	if (!buf)
+		die("malloc");
+
+	for (i = 0; i < len; i++) {
+		seed = seed * 1103515245 + 12345;
+		buf[i] = seed >> 16;
+	}
+
+	t0	= now();
+	crc_ref	= stm32_crc_update_bitwise(STM32_CRC_INIT, buf, len / 4);
+	t_ref	= now() - t0;
+
+	t0	 = now();
+	crc_fast = stm32_crc_update(STM32_CRC_INIT, buf, len / 4);
+	t_fast	 = now() - t0;
+
+	stfub_aes_set_key(&aes, buf);
+	t0	= now();
+	stfub_aes_ctr_crypt(&aes, buf, 0, buf, len);
+	t_aes	= now() - t0;
+
+	printf("bitwise:     %8.1f MB/s  crc 0x%08x\n",
+	       megabytes / t_ref, crc_ref);
+	printf("slice-by-8:  %8.1f MB/s  crc 0x%08x\n",
+	       megabytes / t_fast, crc_fast);
+	printf("aes-128-ctr: %8.1f MB/s  (%.2f ns/byte)\n",
+	       megabytes / t_aes, t_aes * 1e9 / len);
+
+	t0	= now();
+	stfub_sha256_init(&sha);
+	stfub_sha256_update(&sha, buf, len);
+	stfub_sha256_final(&sha, digest);
+	t_sha	= now() - t0;
+
+	stfub_ed25519_public_key(public_key, buf);
+	stfub_ed25519_sign(signature, digest, sizeof(digest), buf);
+	t0	= now();
+	ok	= stfub_ed25519_verify(signature, digest, sizeof(digest),
+				       public_key);
+	t_sig	= now() - t0;
+
+	printf("sha-256:     %8.1f MB/s\n", megabytes / t_sha);
+	printf("ed25519:     %8.2f ms per verification%s\n",
+	       t_sig * 1e3, ok ? "" : " (FAILED)");
+
+	/* Like a half full flash: the second half erased, with a few
+	 * repeated words thrown into the first */
+	memset(buf + len / 2, 0xFF, len / 2);
+	memset(buf + len / 8, 0, 4096);
+
+	rle = malloc(len + len / 2);
+	if (!rle)
+		die("malloc");
+
+	t0	= now();
+	stfub_rle_begin(buf, buf + len);
+	rle_len = 0;
+	do {
+		n = stfub_rle_read(rle + rle_len, 2048);
+		rle_len += n;
+	} while (n == 2048);
+	t_rle	= now() - t0;
+
+	printf("rle:         %8.1f MB/s  (%.1f%% of the size)\n",
+	       megabytes / t_rle, 100.0 * rle_len / len);
+
+	unrle = rle_decode(rle, rle_len, &rle_header);
+	ok = ok && unrle && rle_header.length == len &&
+		!memcmp(unrle, buf, len);
+
+	free(unrle);
+	free(rle);
+	free(buf);
+
+	if (crc_ref != crc_fast || !ok) {
+		fprintf(stderr, "self-check failed\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 2)
+		usage();
+
+	if (!strcmp(argv[1], "pack"))
+		return cmd_pack(argc - 1, argv + 1);
+	if (!strcmp(argv[1], "verify"))
+		return cmd_verify(argc - 1, argv + 1);
+	if (!strcmp(argv[1], "keys"))
+		return cmd_keys(argc - 1, argv + 1);
+	if (!strcmp(argv[1], "genkey"))
+		return cmd_genkey(argc - 1, argv + 1);
+	if (!strcmp(argv[1], "wear"))
+		return cmd_wear(argc - 1, argv + 1);
+	if (!strcmp(argv[1], "stats"))
+		return cmd_stats(argc - 1, argv + 1);
+	if (!strcmp(argv[1], "fault"))
+		return cmd_fault(argc - 1, argv + 1);
+	if (!strcmp(argv[1], "unrle"))
+		return cmd_unrle(argc - 1, argv + 1);
+	if (!strcmp(argv[1], "bench"))
+		return cmd_bench(argc - 1, argv + 1);
+
+	usage();
+	return 2;
+}
@@ -0,0 +1,436 @@
+/*
+ * This file is part of the stfuboot project.
+ *
+ * Copyright (C) 2012 Innovative Converged Devices (ICD)
+ *
+ * Author(s):
+ *          Andrey Smirnov <andrey.smirnov@convergeddevices.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * stfub-sim -- a simulated stfuboot device, the backend stfub-flash -S
+ * schedules downloads to when there is no hardware at hand.
+ *
+ * It is the bootloader's own DFU code, dfu.c and what that calls, built
+ * for the host. Flash, the option bytes and RAM are mapped at the
+ * addresses the firmware expects them at, and this file stands in for
+ * geometry.c, timebase.c and the bits of libopencm3 the DFU code uses:
+ * the flash behaves like that of the F107 (2K pages, programming a
+ * half-word that is not erased fails) and takes the typical datasheet
+ * time to erase and program, scaled by -t. The device ends where the bootloader would
+ * start an image or reset.
+ *
+ * Requests come from the socket passed as -f, see stfub-sim.h.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <libopencm3/stm32/f1/flash.h>
+#include <libopencm3/usb/usbd.h>
+
+#include "dfu.h"
+#include "geometry.h"
+#include "printf.h"
+#include "reset.h"
+#include "stfub-sim.h"
+#include "timebase.h"
+
+#define STFUB_SIM_FLASH_SIZE		(256 * 1024)
+#define STFUB_SIM_ERASE_US		20000
+#define STFUB_SIM_HALF_WORD_NS		52500
+
+/* What stfub-mem-layout-crypto.ld and bootloader.ld give the firmware */
+#define STFUB_SIM_SYMBOL(name, value)			\
+	asm(".globl " #name "\n\t.set " #name ", " #value)
+
+STFUB_SIM_SYMBOL(_bl_rom_start,	0x08001000);
+STFUB_SIM_SYMBOL(_ky_rom_start,	0x08009000);
+STFUB_SIM_SYMBOL(_if_rom_start,	0x08009800);
+STFUB_SIM_SYMBOL(_op_rom_start,	0x1FFFF800);
+STFUB_SIM_SYMBOL(_op_rom_end,	0x1FFFF810);
+STFUB_SIM_SYMBOL(_ri_ram_start,	0x20004000);
+STFUB_SIM_SYMBOL(_ri_ram_end,	0x2000EEE0);
+
+extern unsigned _ky_rom_start;
+
+static const struct {
+	u32 start, size;
+} stfub_sim_regions[] = {
+	{ STFUB_FLASH_BASE,	STFUB_SIM_FLASH_SIZE },
+	{ 0x1FFFF000,		0x1000 },	/* option bytes */
+	{ 0x20000000,		0x10000 },	/* SRAM */
+};
+
+static const struct usb_dfu_descriptor stfub_sim_dfu_descr = {
+	.bLength		= sizeof(struct usb_dfu_descriptor),
+	.bDescriptorType	= DFU_FUNCTIONAL,
+	.bmAttributes		= USB_DFU_CAN_DOWNLOAD | USB_DFU_CAN_UPLOAD |
+				  USB_DFU_WILL_DETACH,
+	.wDetachTimeout		= 255,
+	.wTransferSize		= STFUB_DFU_TRANSFER_SIZE,
+	.bcdDFUVersion		= 0x0110,
+};
+
+/* Percentage of the datasheet times that erasing and programming take */
+static unsigned int stfub_sim_speed = 100;
+/* Every that many programming operations fails, 0 for none */
+static unsigned int stfub_sim_fail_every;
+static bool stfub_sim_verbose;
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: stfub-sim -f <fd> [-t <percent>] [-k <key slots>] [-e <n>] [-v]\n"
+		"\n"
+		"  -f  socket to take requests from\n"
+		"  -t  flash timing, in percent of the datasheet figures (default: 100)\n"
+		"  -k  key slot page to preload, as made by stfub-image keys\n"
+		"  -e  fail every n-th programming operation, as write protection would\n"
+		"  -v  print what the bootloader prints\n");
+	exit(2);
+}
+
+static void stfub_sim_delay_ns(u64 ns)
+{
+	ns = ns * stfub_sim_speed / 100;
+	if (ns)
+		usleep(ns / 1000);
+}
+
+u32 stfub_flash_end(void)
+{
+	return STFUB_FLASH_BASE + STFUB_SIM_FLASH_SIZE;
+}
+
+u32 stfub_flash_sector_number(u32 address)
+{
+	return (address - STFUB_FLASH_BASE) / STFUB_FLASH_PAGE_SIZE;
+}
+
+u32 stfub_flash_sector_start(u32 address)
+{
+	return address & ~(STFUB_FLASH_PAGE_SIZE - 1);
+}
+
+u32 stfub_flash_sector_size(u32 address)
+{
+	return STFUB_FLASH_PAGE_SIZE;
+}
+
+enum stfub_flash_status stfub_flash_erase_sector(u32 address)
+{
+	memset((void *)(uintptr_t)stfub_flash_sector_start(address), 0xFF,
+	       STFUB_FLASH_PAGE_SIZE);
+	stfub_sim_delay_ns(STFUB_SIM_ERASE_US * 1000ULL);
+
+	return STFUB_FLASH_OK;
+}
+
+u32 stfub_flash_erase_ms(u32 start, u32 end)
+{
+	return (stfub_flash_sector_number(end - 1) -
+		stfub_flash_sector_number(start) + 1) * 40;
+}
+
+enum stfub_flash_status stfub_flash_program(u32 address, const void *data,
+					    u32 len)
+{
+	volatile u16 *dst = (volatile u16 *)(uintptr_t)address;
+	enum stfub_flash_status status = STFUB_FLASH_OK;
+	static unsigned int count;
+	const u8 *src = data;
+	u16 half_word;
+
+	stfub_sim_delay_ns((u64)len / 2 * STFUB_SIM_HALF_WORD_NS);
+
+	if (stfub_sim_fail_every && ++count % stfub_sim_fail_every == 0)
+		return STFUB_FLASH_PROTECTED;
+
+	for (; len; len -= 2, src += 2, dst++) {
+		memcpy(&half_word, src, sizeof(half_word));
+
+		/* PGERR, and the half-word is left as it was */
+		if (*dst != 0xFFFF)
+			status = STFUB_FLASH_NOT_ERASED;
+		else
+			*dst = half_word;
+	}
+
+	return status;
+}
+
+u32 stfub_timebase_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void flash_unlock(void)
+{
+}
+
+void flash_lock(void)
+{
+}
+
+void flash_unlock_option_bytes(void)
+{
+}
+
+void flash_program_half_word(u32 address, u16 data)
+{
+	stfub_flash_program(address, &data, sizeof(data));
+}
+
+void flash_erase_all_pages(void)
+{
+	memset((void *)STFUB_FLASH_BASE, 0xFF, STFUB_SIM_FLASH_SIZE);
+	stfub_sim_delay_ns(STFUB_SIM_ERASE_US * 1000ULL);
+}
+
+void scb_reset_system(void)
+{
+	if (stfub_sim_verbose)
+		fprintf(stderr, "stfub-sim: reset\n");
+	exit(0);
+}
+
+/* Simulated flash has no option bytes */
+bool stfub_exception_handlers_pages_are_protected(void)
+{
+	return false;
+}
+
+/* Nothing ever faults here */
+const struct stfub_fault_record *stfub_fault_record(void)
+{
+	return NULL;
+}
+
+int stfub_printf(const char *format, ...)
+{
+	va_list ap;
+	int ret = 0;
+
+	if (stfub_sim_verbose) {
+		va_start(ap, format);
+		ret = vfprintf(stderr, format, ap);
+		va_end(ap);
+	}
+
+	return ret;
+}
+
+static void stfub_sim_map(void)
+{
+	unsigned int i;
+	void *p;
+
+	for (i = 0; i < sizeof(stfub_sim_regions) / sizeof(stfub_sim_regions[0]); i++) {
+		p = mmap((void *)(uintptr_t)stfub_sim_regions[i].start,
+			 stfub_sim_regions[i].size, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE,
+			 -1, 0);
+		if (p != (void *)(uintptr_t)stfub_sim_regions[i].start) {
+			fprintf(stderr, "stfub-sim: cannot map 0x%08x: %s\n",
+				stfub_sim_regions[i].start, strerror(errno));
+			exit(1);
+		}
+
+		/* RAM comes up with whatever, erased flash reads as ones */
+		memset(p, 0xFF, stfub_sim_regions[i].size);
+	}
+}
+
+static void stfub_sim_load(const char *path, void *address, size_t size)
+{
+	FILE *f;
+
+	f = fopen(path, "rb");
+	if (!f) {
+		perror(path);
+		exit(1);
+	}
+
+	if (fread(address, 1, size, f) != size) {
+		fprintf(stderr, "%s: expected %zu bytes\n", path, size);
+		exit(1);
+	}
+
+	fclose(f);
+}
+
+/* Returns false at the end of the stream */
+static bool read_all(int fd, void *buf, size_t len)
+{
+	u8 *p = buf;
+	ssize_t ret;
+
+	while (len) {
+		ret = read(fd, p, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return false;
+		p   += ret;
+		len -= ret;
+	}
+
+	return true;
+}
+
+static bool write_all(int fd, const void *buf, size_t len)
+{
+	const u8 *p = buf;
+	ssize_t ret;
+
+	while (len) {
+		ret = write(fd, p, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return false;
+		p   += ret;
+		len -= ret;
+	}
+
+	return true;
+}
+
+/*
+   One request, as the USB core would hand it to main.c's callbacks.
+   Returns false once the other end has gone.
+ */
+static bool stfub_sim_serve(int fd)
+{
+	static u8 buf[STFUB_DFU_TRANSFER_SIZE] __attribute__((aligned(4)));
+	void (*complete)(usbd_device *, struct usb_setup_data *) = NULL;
+	struct stfub_sim_request req;
+	struct stfub_sim_reply reply;
+	struct usb_setup_data setup;
+	bool in;
+	u8 *data = buf;
+	u16 len;
+	int ret;
+
+	if (!read_all(fd, &req, sizeof(req)))
+		return false;
+
+	in = req.bmRequestType & 0x80;
+	if (req.wLength > sizeof(buf))
+		return false;
+	if (!in && !read_all(fd, buf, req.wLength))
+		return false;
+
+	setup.bmRequestType	= req.bmRequestType;
+	setup.bRequest		= req.bRequest;
+	setup.wValue		= req.wValue;
+	setup.wIndex		= req.wIndex;
+	setup.wLength		= req.wLength;
+	len			= req.wLength;
+
+	if (req.bmRequestType == USB_REQ_TYPE_INTERFACE &&
+	    req.bRequest == STFUB_SIM_SET_INTERFACE) {
+		ret = req.wValue < STFUB_AS_NUM ? USBD_REQ_HANDLED :
+			USBD_REQ_NOTSUPP;
+		if (ret == USBD_REQ_HANDLED)
+			stfub_dfu_switch_altsetting(NULL, req.wIndex,
+						    req.wValue);
+		len = 0;
+	} else {
+		ret = stfub_dfu_handle_control_request(NULL, &setup, &data,
+						       &len, &complete);
+	}
+
+	reply.length = ret == USBD_REQ_HANDLED ? (in ? len : 0) : -1;
+
+	if (!write_all(fd, &reply, sizeof(reply)) ||
+	    (reply.length > 0 && !write_all(fd, data, reply.length)))
+		return false;
+
+	/* After the status stage, as the USB core does */
+	if (ret == USBD_REQ_HANDLED && complete)
+		complete(NULL, &setup);
+
+	return true;
+}
+
+int main(int argc, char **argv)
+{
+	const char *keys = NULL;
+	struct pollfd pfd;
+	int fd = -1, opt;
+
+	while ((opt = getopt(argc, argv, "f:t:k:e:v")) != -1) {
+		switch (opt) {
+		case 'f':
+			fd = atoi(optarg);
+			break;
+		case 't':
+			stfub_sim_speed = strtoul(optarg, NULL, 0);
+			break;
+		case 'k':
+			keys = optarg;
+			break;
+		case 'e':
+			stfub_sim_fail_every = strtoul(optarg, NULL, 0);
+			break;
+		case 'v':
+			stfub_sim_verbose = true;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (fd < 0 || optind != argc)
+		usage();
+
+	stfub_sim_map();
+	if (keys)
+		stfub_sim_load(keys, &_ky_rom_start, STFUB_FLASH_PAGE_SIZE);
+
+	stfub_dfu_init(&stfub_sim_dfu_descr);
+
+	pfd.fd	   = fd;
+	pfd.events = POLLIN;
+
+	/* main.c's loop, with the socket for the bus */
+	for (;;) {
+		if (poll(&pfd, 1, 1) > 0 && !stfub_sim_serve(fd))
+			return 0;
+
+		stfub_dfu_tick();
+
+		if (stfub_dfu_exit_requested()) {
+			if (stfub_sim_verbose)
+				fprintf(stderr, "stfub-sim: starting %p\n",
+					stfub_dfu_exit_requested());
+			return 0;
+		}
+	}
+}
@@ -0,0 +1,48 @@
+/*
+ * This file is part of the stfuboot project.
+ *
+ * Copyright (C) 2012 Innovative Converged Devices (ICD)
+ *
+ * Author(s):
+ *          Andrey Smirnov <andrey.smirnov@convergeddevices.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __STFUB_SIM_H__
+#define __STFUB_SIM_H__
+
+#include <stdint.h>
+
+/*
+ * How tools/stfub-flash talks to a simulated device over a socket: a
+ * setup packet, followed by wLength bytes for an OUT request, and a
+ * reply with the bytes of an IN request, or -1 where the device would
+ * have stalled. A SET_INTERFACE request selects the DFU altsetting.
+ */
+#define STFUB_SIM_SET_INTERFACE		11
+
+struct stfub_sim_request {
+	uint8_t  bmRequestType;
+	uint8_t  bRequest;
+	uint16_t wValue;
+	uint16_t wIndex;
+	uint16_t wLength;
+} __attribute__((packed));
+
+struct stfub_sim_reply {
+	int32_t  length;
+} __attribute__((packed));
+
+#endif	/* __STFUB_SIM_H__ */
@@ -0,0 +1,163 @@
+#!/usr/bin/env python3
+#
+# This file is part of the stfuboot project.
+#
+# Copyright (C) 2012 Innovative Converged Devices (ICD)
+#
+# Author(s):
+#          Andrey Smirnov <andrey.smirnov@convergeddevices.net>
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#
+
+"""Turn a raw SWO capture of a bootloader built with -DSTFUB_TRACE into
+a timeline, see trace.h for the event format.
+
+    stfub-trace.py [-p PORT] [-f HZ] capture.bin
+"""
+
+import argparse
+import sys
+
+EVENTS = {
+    1: "state",
+    2: "request",
+    3: "erase-start",
+    4: "erase-end",
+    5: "program-start",
+    6: "program-end",
+    7: "manifest-step",
+}
+
+DFU_STATES = [
+    "appIDLE", "appDETACH", "dfuIDLE", "dfuDNLOAD-SYNC", "dfuDNBUSY",
+    "dfuDNLOAD-IDLE", "dfuMANIFEST-SYNC", "dfuMANIFEST",
+    "dfuMANIFEST-WAIT-RESET", "dfuUPLOAD-IDLE", "dfuERROR",
+]
+
+DFU_REQUESTS = [
+    "DETACH", "DNLOAD", "UPLOAD", "GETSTATUS", "CLRSTATUS", "GETSTATE",
+    "ABORT",
+]
+
+MANIFEST_STEPS = [
+    "FLUSH", "CHECK_CRC", "CHECK_SIGNATURE", "WRITE_INFO_BLOCK", "DONE",
+]
+
+
+def itm_words(data, port):
+    """Yield the 32-bit stimulus writes to port found in an ITM stream"""
+    i = 0
+    while i < len(data):
+        header = data[i]
+        i += 1
+
+        if header == 0x00:
+            # Synchronization: zeros terminated by 0x80
+            while i < len(data) and data[i] == 0x00:
+                i += 1
+            i += 1
+            continue
+
+        size = header & 0x03
+        if size == 0:
+            # Overflow and timestamp packets carry continuation bytes
+            if header != 0x70 and header & 0x80:
+                while i < len(data) and data[i] & 0x80:
+                    i += 1
+                i += 1
+            continue
+
+        length = {1: 1, 2: 2, 3: 4}[size]
+        payload = data[i:i + length]
+        i += length
+
+        # Bit 2 set: hardware source (DWT) packet
+        if header & 0x04 or header >> 3 != port or length != 4:
+            continue
+        if len(payload) == 4:
+            yield int.from_bytes(payload, "little")
+
+
+def describe(event, arg):
+    name = EVENTS.get(event, "event-%d" % event)
+
+    if event == 1:
+        detail = DFU_STATES[arg] if arg < len(DFU_STATES) else str(arg)
+    elif event == 2:
+        req = arg >> 16
+        detail = "%s wValue=%d" % (DFU_REQUESTS[req] if req < len(DFU_REQUESTS)
+                                   else "bRequest=%d" % req, arg & 0xFFFF)
+    elif event == 3 and arg == 0:
+        detail = "mass erase"
+    elif event in (3, 5):
+        detail = "0x08%06x" % arg
+    elif event == 4:
+        detail = "%d page(s)" % arg if arg else "mass erase and restore"
+    elif event == 6:
+        detail = "%d bytes" % arg
+    elif event == 7:
+        detail = MANIFEST_STEPS[arg] if arg < len(MANIFEST_STEPS) else str(arg)
+    else:
+        detail = "0x%06x" % arg
+
+    return name, detail
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("-p", "--port", type=int, default=1,
+                        help="ITM stimulus port (default: 1)")
+    parser.add_argument("-f", "--frequency", type=float, default=48e6,
+                        help="core clock in Hz (default: 48000000)")
+    parser.add_argument("capture")
+    args = parser.parse_args()
+
+    with open(args.capture, "rb") as f:
+        words = list(itm_words(f.read(), args.port))
+
+    cycles_per_us = args.frequency / 1e6
+    start = prev = None
+    open_ops = {}
+
+    for word, cycles in zip(words[0::2], words[1::2]):
+        event, arg = word >> 24, word & 0xFFFFFF
+
+        if start is None:
+            start = prev = cycles
+
+        # The counter wraps every 89s at 48MHz
+        t = ((cycles - start) & 0xFFFFFFFF) / cycles_per_us
+        dt = ((cycles - prev) & 0xFFFFFFFF) / cycles_per_us
+        prev = cycles
+
+        name, detail = describe(event, arg)
+        line = "%12.1f us %+10.1f  %-14s %s" % (t, dt, name, detail)
+
+        # Pair up start/end events to show how long the operation took
+        if event in (3, 5):
+            open_ops[event] = cycles
+        elif event in (4, 6) and event - 1 in open_ops:
+            took = ((cycles - open_ops.pop(event - 1)) & 0xFFFFFFFF)
+            line += "  (%.1f us)" % (took / cycles_per_us)
+
+        print(line)
+
+    if len(words) % 2:
+        print("warning: capture ends in the middle of an event",
+              file=sys.stderr)
+
+
+if __name__ == "__main__":
+    main()
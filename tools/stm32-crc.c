@@ -0,0 +1,112 @@
+/*
+ * This file is part of the stfuboot project.
+ *
+ * Copyright (C) 2012 Innovative Converged Devices (ICD)
+ *
+ * Author(s):
+ *          Andrey Smirnov <andrey.smirnov@convergeddevices.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdbool.h>
+
+#include "stm32-crc.h"
+
+/*
+ * Slicing-by-8 tables. crc_table[k][b] is the CRC register after
+ * shifting byte b placed at the top of an otherwise empty register
+ * through 8 * (k + 1) bit steps.
+ */
+static uint32_t crc_table[8][256];
+static bool crc_table_ready;
+
+static void stm32_crc_init_tables(void)
+{
+	uint32_t c;
+	int i, k, b;
+
+	for (b = 0; b < 256; b++) {
+		c = (uint32_t)b << 24;
+		for (i = 0; i < 8; i++)
+			c = (c & 0x80000000U) ? (c << 1) ^ STM32_CRC_POLY : c << 1;
+		crc_table[0][b] = c;
+	}
+
+	for (k = 1; k < 8; k++)
+		for (b = 0; b < 256; b++) {
+			c = crc_table[k - 1][b];
+			crc_table[k][b] = (c << 8) ^ crc_table[0][c >> 24];
+		}
+
+	crc_table_ready = true;
+}
+
+static inline uint32_t load_le32(const uint8_t *p)
+{
+	return (uint32_t)p[0] | (uint32_t)p[1] << 8 |
+	       (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+uint32_t stm32_crc_update_bitwise(uint32_t crc, const void *data,
+				  size_t nwords)
+{
+	const uint8_t *p = data;
+	int i;
+
+	while (nwords--) {
+		crc ^= load_le32(p);
+		p += 4;
+
+		for (i = 0; i < 32; i++)
+			crc = (crc & 0x80000000U) ?
+				(crc << 1) ^ STM32_CRC_POLY : crc << 1;
+	}
+
+	return crc;
+}
+
+uint32_t stm32_crc_update(uint32_t crc, const void *data, size_t nwords)
+{
+	const uint8_t *p = data;
+	uint32_t w;
+
+	if (!crc_table_ready)
+		stm32_crc_init_tables();
+
+	for (; nwords >= 2; nwords -= 2, p += 8) {
+		crc ^= load_le32(p);
+		w    = load_le32(p + 4);
+
+		crc = crc_table[7][crc >> 24] ^
+		      crc_table[6][(crc >> 16) & 0xFF] ^
+		      crc_table[5][(crc >> 8) & 0xFF] ^
+		      crc_table[4][crc & 0xFF] ^
+		      crc_table[3][w >> 24] ^
+		      crc_table[2][(w >> 16) & 0xFF] ^
+		      crc_table[1][(w >> 8) & 0xFF] ^
+		      crc_table[0][w & 0xFF];
+	}
+
+	if (nwords) {
+		crc ^= load_le32(p);
+
+		crc = crc_table[3][crc >> 24] ^
+		      crc_table[2][(crc >> 16) & 0xFF] ^
+		      crc_table[1][(crc >> 8) & 0xFF] ^
+		      crc_table[0][crc & 0xFF];
+	}
+
+	return crc;
+}
@@ -0,0 +1,51 @@
+/*
+ * This file is part of the stfuboot project.
+ *
+ * Copyright (C) 2012 Innovative Converged Devices (ICD)
+ *
+ * Author(s):
+ *          Andrey Smirnov <andrey.smirnov@convergeddevices.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __STM32_CRC_H__
+#define __STM32_CRC_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Software model of the STM32 CRC calculation unit: CRC-32 with
+ * polynomial 0x04C11DB7, initial value 0xFFFFFFFF, no reflection
+ * and no final XOR, fed with whole 32-bit words MSB first. The
+ * result is identical to crc_calculate_block() run over the same
+ * little-endian words.
+ */
+#define STM32_CRC_INIT		0xFFFFFFFFU
+#define STM32_CRC_POLY		0x04C11DB7U
+
+/* Feed @nwords little-endian words from @data into @crc */
+uint32_t stm32_crc_update(uint32_t crc, const void *data, size_t nwords);
+
+/* Bit-at-a-time reference implementation, used for self-checks */
+uint32_t stm32_crc_update_bitwise(uint32_t crc, const void *data,
+				  size_t nwords);
+
+static inline uint32_t stm32_crc_block(const void *data, size_t nwords)
+{
+	return stm32_crc_update(STM32_CRC_INIT, data, nwords);
+}
+
+#endif	/* __STM32_CRC_H__ */
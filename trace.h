@@ -0,0 +1,118 @@
+/*
+ * This file is part of the stfuboot project.
+ *
+ * Copyright (C) 2012 Innovative Converged Devices (ICD)
+ *
+ * Author(s):
+ *          Andrey Smirnov <andrey.smirnov@convergeddevices.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <libopencm3/cm3/common.h>
+
+#include "dwt.h"
+
+/*
+   Event trace over ITM, for timing investigations where printing to
+   the UART would disturb what is being measured. Built in only with
+   -DSTFUB_TRACE, otherwise every call compiles to nothing.
+
+   Each event is two words written to stimulus port STFUB_TRACE_PORT:
+   the event (type in the top byte, argument in the lower 24 bits)
+   followed by the cycle counter at the time it was emitted.
+   tools/stfub-trace.py turns an SWO capture into a timeline.
+
+   SWO (PB3, with the debug port in SWD mode) is set up for NRZ at
+   STFUB_TRACE_SWO_BAUD, so a debug probe or any UART adapter fast
+   enough can record it. Emitting an event costs a few cycles unless the
+   ITM FIFO is full; on the wire an event takes 10 bytes, 50us at 2MBd.
+ */
+#define STFUB_TRACE_PORT		1
+#ifndef STFUB_TRACE_SWO_BAUD
+#define STFUB_TRACE_SWO_BAUD		2000000
+#endif
+
+enum stfub_trace_event {
+	STFUB_TRACE_STATE = 1,		/* new enum dfu_state */
+	STFUB_TRACE_REQUEST,		/* bRequest << 16 | wValue */
+	STFUB_TRACE_ERASE_START,	/* address, 0 for a mass erase */
+	STFUB_TRACE_ERASE_END,		/* pages erased, 0 after a mass erase */
+	STFUB_TRACE_PROGRAM_START,	/* address */
+	STFUB_TRACE_PROGRAM_END,	/* bytes programmed */
+	STFUB_TRACE_MANIFEST_STEP,	/* enum stfub_manifest_step */
+};
+
+#ifdef STFUB_TRACE
+
+#define STFUB_ITM_STIM(n)	MMIO32(0xE0000000 + 4 * (n))
+#define STFUB_ITM_TER		MMIO32(0xE0000E00)
+#define STFUB_ITM_TCR		MMIO32(0xE0000E80)
+#define STFUB_ITM_TCR_ITMENA	(1 << 0)
+#define STFUB_ITM_TCR_TRACEBUSID (1 << 16)
+#define STFUB_ITM_LAR		MMIO32(0xE0000FB0)
+#define STFUB_ITM_LAR_KEY	0xC5ACCE55
+
+#define STFUB_TPIU_ACPR		MMIO32(0xE0040010)
+#define STFUB_TPIU_SPPR		MMIO32(0xE00400F0)
+#define STFUB_TPIU_SPPR_NRZ	2
+#define STFUB_TPIU_FFCR		MMIO32(0xE0040304)
+
+#define STFUB_DBGMCU_CR		MMIO32(0xE0042004)
+#define STFUB_DBGMCU_CR_TRACE_IOEN (1 << 5)
+
+/* Needs the system clock set up, and stfub_dwt_enable() (TRCENA) */
+static inline void stfub_trace_init(void)
+{
+	STFUB_DBGMCU_CR	|= STFUB_DBGMCU_CR_TRACE_IOEN;
+
+	STFUB_TPIU_SPPR	 = STFUB_TPIU_SPPR_NRZ;
+	STFUB_TPIU_ACPR	 = 48000000 / STFUB_TRACE_SWO_BAUD - 1;
+	STFUB_TPIU_FFCR	 = 0x100;	/* no formatter, as for SWO */
+
+	STFUB_ITM_LAR	 = STFUB_ITM_LAR_KEY;
+	STFUB_ITM_TCR	 = STFUB_ITM_TCR_ITMENA | STFUB_ITM_TCR_TRACEBUSID;
+	STFUB_ITM_TER	|= 1 << STFUB_TRACE_PORT;
+}
+
+static inline void stfub_trace_write(u32 word)
+{
+	while (!(STFUB_ITM_STIM(STFUB_TRACE_PORT) & 1))
+		;
+	STFUB_ITM_STIM(STFUB_TRACE_PORT) = word;
+}
+
+static inline void stfub_trace(enum stfub_trace_event event, u32 arg)
+{
+	u32 cycles = stfub_dwt_cycles();
+
+	if (!(STFUB_ITM_TCR & STFUB_ITM_TCR_ITMENA) ||
+	    !(STFUB_ITM_TER & (1 << STFUB_TRACE_PORT)))
+		return;
+
+	stfub_trace_write((u32)event << 24 | (arg & 0xFFFFFF));
+	stfub_trace_write(cycles);
+}
+
+#else
+
+static inline void stfub_trace_init(void) { }
+static inline void stfub_trace(enum stfub_trace_event event, u32 arg) { }
+
+#endif	/* STFUB_TRACE */
+
+#endif	/* __TRACE_H__ */
@@ -32,6 +32,7 @@
 #include <libopencm3/stm32/usart.h>
 #include <libopencm3/stm32/f1/gpio.h>
 
+#include "stats.h"
 #include "uart.h"
 
 #define UART_BUFFER_SIZE 256
@@ -99,6 +100,9 @@ void stfub_uart_putchar(char c)
 	
 	if (usart_tx_interrupt_enabled(USART2)) {
 		while (uart_buffer_push(&uart_tx, c) < 0 && ++n < 1000);
+
+		if (n == 1000)
+			stfub_stats.uart_drops++;
 	} else {
 		usart_enable_tx_interrupt(USART2);
 		usart_send(USART2, (uint16_t)c);
@@ -0,0 +1,140 @@
+/*
+ * This file is part of the stfuboot project.
+ *
+ * Copyright (C) 2012 Innovative Converged Devices (ICD)
+ *
+ * Author(s):
+ *          Andrey Smirnov <andrey.smirnov@convergeddevices.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Per sector CRCs for the "Verify" altsetting, see libstfub/verify.h.
+ * The query is answered right away, from the tick that would have
+ * written it to flash, and the result is kept until the next one.
+ */
+
+#include <stdbool.h>
+#include <string.h>
+
+#include <libstfub/verify.h>
+
+#include "crc.h"
+#include "dfu.h"
+#include "geometry.h"
+#include "verify.h"
+
+/* Same estimate as manifestation uses for its CRC check */
+#define STFUB_VERIFY_CRC_WORDS_PER_MS	2048
+
+static struct {
+	struct stfub_verify_result result;
+	u32 data[STFUB_VERIFY_MAX_SECTORS];
+	bool bitmap;
+} verify;
+
+static bool stfub_verify_query_is_valid(const struct stfub_verify_query *query,
+					u32 len)
+{
+	u32 start, end;
+
+	if (len < sizeof(*query) || query->magic != STFUB_VERIFY_MAGIC ||
+	    query->altsetting >= STFUB_AS_NUM ||
+	    query->reply > STFUB_VERIFY_BITMAP ||
+	    len < sizeof(*query) + query->count * sizeof(u32))
+		return false;
+
+	/* Only banks in main flash, where the sectors are */
+	stfub_dfu_bank_range(query->altsetting, &start, &end);
+	if (start < STFUB_FLASH_BASE || end > stfub_flash_end())
+		return false;
+
+	return start <= query->start && query->start < query->end &&
+		query->end <= end &&
+		stfub_flash_sector_start(query->start) == query->start;
+}
+
+enum dfu_status stfub_verify_query(const void *buf, u32 len)
+{
+	const struct stfub_verify_query *query = buf;
+	u32 address, size, crc, n;
+
+	verify.result.magic = 0;
+
+	if (!stfub_verify_query_is_valid(query, len))
+		return DFU_STATUS_ERR_TARGET;
+
+	n = stfub_flash_sector_number(query->end - 1) -
+		stfub_flash_sector_number(query->start) + 1;
+	if (n > STFUB_VERIFY_MAX_SECTORS ||
+	    (query->count && query->count != n) ||
+	    (query->reply == STFUB_VERIFY_BITMAP && !query->count))
+		return DFU_STATUS_ERR_TARGET;
+
+	memset(&verify, 0, sizeof(verify));
+
+	/* A range ending mid-sector covers the rest of that sector too */
+	for (n = 0, address = query->start; address < query->end;
+	     n++, address += size) {
+		size = stfub_flash_sector_size(address);
+
+		crc = stfub_crc_block((const void *)address, size / 4);
+
+		if (query->count && crc != query->expected[n]) {
+			verify.result.mismatches++;
+			if (query->reply == STFUB_VERIFY_BITMAP)
+				verify.data[n / 32] |= 1U << (n % 32);
+		}
+
+		if (query->reply == STFUB_VERIFY_CRCS)
+			verify.data[n] = crc;
+	}
+
+	verify.result.magic   = STFUB_VERIFY_MAGIC;
+	verify.result.sectors = n;
+	verify.result.start   = query->start;
+	verify.result.end     = address;
+	verify.bitmap	      = query->reply == STFUB_VERIFY_BITMAP;
+
+	return DFU_STATUS_OK;
+}
+
+/* How long answering the query is going to take */
+u32 stfub_verify_query_ms(const void *buf, u32 len)
+{
+	const struct stfub_verify_query *query = buf;
+
+	if (!stfub_verify_query_is_valid(query, len))
+		return 0;
+
+	return (query->end - query->start) / 4 /
+		STFUB_VERIFY_CRC_WORDS_PER_MS + 1;
+}
+
+/* Empty until a query has been answered */
+const void *stfub_verify_result(u32 *size)
+{
+	u32 words = verify.result.sectors;
+
+	if (verify.bitmap)
+		words = (words + 31) / 32;
+
+	if (verify.result.magic == STFUB_VERIFY_MAGIC)
+		*size = sizeof(verify.result) + words * sizeof(u32);
+	else
+		*size = 0;
+
+	return &verify;
+}
@@ -0,0 +1,33 @@
+/*
+ * This file is part of the stfuboot project.
+ *
+ * Copyright (C) 2012 Innovative Converged Devices (ICD)
+ *
+ * Author(s):
+ *          Andrey Smirnov <andrey.smirnov@convergeddevices.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __VERIFY_H__
+#define __VERIFY_H__
+
+#include <libopencm3/cm3/common.h>
+#include <libopencm3/usb/dfu.h>
+
+enum dfu_status stfub_verify_query(const void *buf, u32 len);
+u32 stfub_verify_query_ms(const void *buf, u32 len);
+const void *stfub_verify_result(u32 *size);
+
+#endif	/* __VERIFY_H__ */
@@ -0,0 +1,222 @@
+/*
+ * This file is part of the stfuboot project.
+ *
+ * Copyright (C) 2012 Innovative Converged Devices (ICD)
+ *
+ * Author(s):
+ *          Andrey Smirnov <andrey.smirnov@convergeddevices.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Per page erase counters.
+ *
+ * The counters are kept in a log that takes the last two flash pages,
+ * wherever the flash of the part ends (wl_rom on a 256K part).
+ * Only one of them is active at a time: it starts with a snapshot of
+ * all counters followed by an append-only list of erase events, one
+ * half-word holding the page number per erase, so recording an erase
+ * costs a single half-word program and no erase. When the list is full
+ * the current counts are folded into a new snapshot in the other page,
+ * which is made valid by programming its header last; the old page
+ * stays valid until then, so a reset in the middle loses nothing.
+ *
+ * Snapshot counts are stored inverted so that a page that has never
+ * been erased does not need to be programmed at all.
+ */
+
+#include <stdbool.h>
+#include <string.h>
+
+#include <libopencm3/stm32/f1/flash.h>
+
+#include "geometry.h"
+#include "wear.h"
+
+#define MIN(a, b) ((a)<(b) ? (a) : (b))
+
+/* Each copy of the log takes a sector, but no more than 2K of it */
+#define STFUB_WEAR_LOG_SIZE	MIN(STFUB_FLASH_PAGE_SIZE, 2048)
+#define STFUB_WEAR_LOG_MAGIC	0x474F4C57	/* "WLOG" */
+#define STFUB_WEAR_FREE		0xFFFF
+
+#define STFUB_WEAR_LOG_ENTRIES						\
+	((STFUB_WEAR_LOG_SIZE - 2 * sizeof(u32) -			\
+	  STFUB_WEAR_MAX_PAGES * sizeof(u32)) / sizeof(u16))
+
+struct stfub_wear_log {
+	u32 magic;
+	u32 sequence;
+	u32 base[STFUB_WEAR_MAX_PAGES];
+	u16 entries[STFUB_WEAR_LOG_ENTRIES];
+} __attribute__((packed));
+
+extern unsigned _if_rom_start;
+
+static struct stfub_wear_counters counters;
+
+/* Also where the application area ends */
+u32 stfub_wear_log_start(void)
+{
+	return stfub_flash_end() - 2 * STFUB_FLASH_PAGE_SIZE;
+}
+
+static struct stfub_wear_log *stfub_wear_log_page(int n)
+{
+	return (struct stfub_wear_log *)(stfub_wear_log_start() +
+					 n * STFUB_FLASH_PAGE_SIZE);
+}
+
+static u32 stfub_wear_first_page(void)
+{
+	return stfub_flash_sector_start((u32)&_if_rom_start);
+}
+
+static unsigned int stfub_wear_pages(void)
+{
+	return stfub_flash_sector_number(stfub_wear_log_start() - 1) -
+		stfub_flash_sector_number(stfub_wear_first_page()) + 1;
+}
+
+static bool stfub_wear_log_is_valid(const struct stfub_wear_log *log)
+{
+	return log->magic == STFUB_WEAR_LOG_MAGIC;
+}
+
+static struct stfub_wear_log *stfub_wear_active_log(void)
+{
+	struct stfub_wear_log *a = stfub_wear_log_page(0);
+	struct stfub_wear_log *b = stfub_wear_log_page(1);
+
+	if (!stfub_wear_log_is_valid(a))
+		return stfub_wear_log_is_valid(b) ? b : NULL;
+	if (!stfub_wear_log_is_valid(b))
+		return a;
+
+	return a->sequence > b->sequence ? a : b;
+}
+
+static unsigned int stfub_wear_log_length(const struct stfub_wear_log *log)
+{
+	unsigned int i;
+
+	for (i = 0; i < STFUB_WEAR_LOG_ENTRIES; i++)
+		if (log->entries[i] == STFUB_WEAR_FREE)
+			break;
+
+	return i;
+}
+
+static void stfub_wear_program_word(volatile u32 *word, u32 value)
+{
+	flash_program_half_word((u32)word, value & 0xFFFF);
+	flash_program_half_word((u32)word + 2, value >> 16);
+}
+
+/* Fold the log into counters.erases[] */
+static void stfub_wear_count(const struct stfub_wear_log *log)
+{
+	unsigned int i, length;
+
+	memset(counters.erases, 0, sizeof(counters.erases));
+	counters.compactions = 0;
+
+	if (!log)
+		return;
+
+	for (i = 0; i < STFUB_WEAR_MAX_PAGES; i++)
+		counters.erases[i] = ~log->base[i];
+
+	length = stfub_wear_log_length(log);
+	for (i = 0; i < length; i++)
+		if (log->entries[i] < STFUB_WEAR_MAX_PAGES)
+			counters.erases[log->entries[i]]++;
+
+	counters.compactions = log->sequence;
+}
+
+/*
+   Start a new log in the page that is not active, with the current
+   counts as its snapshot. Flash has to be unlocked. Returns NULL if the
+   page could not be erased, the old log then stays the active one.
+ */
+static struct stfub_wear_log *stfub_wear_compact(struct stfub_wear_log *old)
+{
+	struct stfub_wear_log *log;
+	unsigned int i;
+
+	stfub_wear_count(old);
+
+	log = (old == stfub_wear_log_page(0)) ?
+		stfub_wear_log_page(1) : stfub_wear_log_page(0);
+
+	if (stfub_flash_erase_sector((u32)log) != STFUB_FLASH_OK)
+		return NULL;
+
+	for (i = 0; i < STFUB_WEAR_MAX_PAGES; i++)
+		if (counters.erases[i])
+			stfub_wear_program_word(&log->base[i],
+						~counters.erases[i]);
+
+	stfub_wear_program_word(&log->sequence, old ? old->sequence + 1 : 1);
+	stfub_wear_program_word(&log->magic, STFUB_WEAR_LOG_MAGIC);
+
+	return log;
+}
+
+/*
+   Called for every page erased on behalf of a download, with flash
+   already unlocked. Pages outside of the info block and application
+   area are not tracked.
+ */
+void stfub_wear_record_erase(u32 address)
+{
+	struct stfub_wear_log *log;
+	unsigned int length;
+	u32 page;
+
+	if (address < stfub_wear_first_page())
+		return;
+
+	page = stfub_flash_sector_number(address) -
+		stfub_flash_sector_number(stfub_wear_first_page());
+	if (page >= stfub_wear_pages() || page >= STFUB_WEAR_MAX_PAGES)
+		return;
+
+	log = stfub_wear_active_log();
+	length = log ? stfub_wear_log_length(log) : STFUB_WEAR_LOG_ENTRIES;
+
+	if (length == STFUB_WEAR_LOG_ENTRIES) {
+		/* The erase goes uncounted if there is no room for it */
+		log = stfub_wear_compact(log);
+		if (!log)
+			return;
+		length = 0;
+	}
+
+	flash_program_half_word((u32)&log->entries[length], page);
+}
+
+const struct stfub_wear_counters *stfub_wear_counters(void)
+{
+	stfub_wear_count(stfub_wear_active_log());
+
+	counters.magic		= STFUB_WEAR_MAGIC;
+	counters.first_page	= stfub_wear_first_page();
+	counters.page_size	= STFUB_FLASH_PAGE_SIZE;
+	counters.pages		= MIN(stfub_wear_pages(), STFUB_WEAR_MAX_PAGES);
+
+	return &counters;
+}